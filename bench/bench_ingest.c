@@ -0,0 +1,287 @@
+/**
+ * Benchmark of how fast the client absorbs the initial burst of output
+ * manager events (head, name, mode, size, refresh, current_mode, ...).
+ *
+ * For every head count a mock_compositor is started with that many synthetic
+ * heads of -m modes each, and the client connects to it repeatedly. One run
+ * goes from wl_display_connect() to the first zwlr_output_manager_v1.done,
+ * with the client's own listeners and the asynchronous logger in place; the
+ * heads are freed again before the next run. Every head count runs in a child
+ * process, so peak RSS belongs to that head count alone. malloc and friends
+ * are wrapped to count allocations, including those made by libwayland.
+ *
+ * Results are printed as one JSON document on stdout.
+ *
+ * Build: gcc -O2 -o bench_ingest bench/bench_ingest.c -lwayland-client -lm -pthread
+ * Usage: bench_ingest [-M mock_compositor] [-n heads[,heads...]] [-m modes] [-r repeats]
+ */
+
+#define NO_MAIN
+#include "../main.c"
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_MAX_HEAD_COUNTS      16
+#define BENCH_MAX_REPEATS        1000
+
+struct bench_result {
+	uint64_t events;
+	uint64_t allocations;
+	uint64_t bytes;
+	double done_ms;
+};
+
+// allocation counting
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void __libc_free(void * ptr);
+
+static _Atomic uint64_t allocations;
+static _Atomic uint64_t bytes_allocated;
+
+void * malloc(size_t size) {
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&bytes_allocated, size, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) {
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&bytes_allocated, count * size, memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size) {
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&bytes_allocated, size, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void * ptr) {
+	__libc_free(ptr);
+}
+
+static double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_double(const void * a, const void * b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// nearest rank percentile of sorted samples
+static double percentile(const double * sorted, int count, double p) {
+	int rank = (int)(p / 100.0 * count + 0.999999);
+	if (rank < 1) rank = 1;
+	if (rank > count) rank = count;
+	return sorted[rank - 1];
+}
+
+// starts the mock compositor and returns the socket name it listens on
+static pid_t start_mock(const char * mock_path, int heads, int modes, char * socket_name, size_t size) {
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		char heads_arg[16], modes_arg[16];
+		snprintf(heads_arg, sizeof(heads_arg), "%d", heads);
+		snprintf(modes_arg, sizeof(modes_arg), "%d", modes);
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(mock_path, mock_path, "-n", heads_arg, "-m", modes_arg, (char *)NULL);
+		perror("Cannot start mock compositor");
+		_exit(127);
+	}
+	close(fds[1]);
+
+	char line[144];
+	FILE * out = fdopen(fds[0], "r");
+	int ready = fgets(line, sizeof(line), out) && strncmp(line, "WAYLAND_DISPLAY=", 16) == 0;
+	fclose(out);
+	if (!ready) {
+		fprintf(stderr, "Mock compositor at %s did not start\n", mock_path);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	line[strcspn(line, "\n")] = '\0';
+	snprintf(socket_name, size, "%s", line + 16);
+	return pid;
+}
+
+// one connect-to-done run through the client's listeners
+static int ingest_once(const char * socket_name, struct bench_result * result) {
+	current_serial = 0;
+	previous_serial = 0;
+	output_manager = NULL;
+	uint64_t allocations_before = atomic_load(&allocations);
+	uint64_t bytes_before = atomic_load(&bytes_allocated);
+	double start = now_ms();
+
+	struct wl_display * display = wl_display_connect(socket_name);
+	if (!display) {
+		perror("Connection to mock compositor failed");
+		return 0;
+	}
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &registry_listener, 0);
+
+	uint64_t events = 0;
+	while (current_serial == 0) {
+		int dispatched = wl_display_dispatch(display);
+		if (dispatched < 0) {
+			perror("Dispatching mock compositor events failed");
+			wl_display_disconnect(display);
+			return 0;
+		}
+		events += dispatched;
+	}
+
+	result->done_ms = now_ms() - start;
+	result->events = events;
+	result->allocations = atomic_load(&allocations) - allocations_before;
+	result->bytes = atomic_load(&bytes_allocated) - bytes_before;
+
+	free_all_heads();
+	zwlr_output_manager_v1_destroy(output_manager);
+	output_manager = NULL;
+	wl_registry_destroy(registry);
+	registry = NULL;
+	wl_display_disconnect(display);
+	return 1;
+}
+
+// runs all repeats for one head count, prints its JSON object
+static int bench_heads(const char * mock_path, int heads, int modes, int repeats) {
+	char socket_name[128];
+	pid_t mock = start_mock(mock_path, heads, modes, socket_name, sizeof(socket_name));
+	if (mock < 0) {
+		return 0;
+	}
+
+	static struct bench_result results[BENCH_MAX_REPEATS];
+	static double done_ms[BENCH_MAX_REPEATS];
+	int ok = 1;
+	for (int r = 0; r < repeats && ok; r++) {
+		ok = ingest_once(socket_name, &results[r]);
+		done_ms[r] = results[r].done_ms;
+	}
+	kill(mock, SIGTERM);
+	waitpid(mock, NULL, 0);
+	if (!ok) {
+		return 0;
+	}
+
+	uint64_t allocation_sum = 0, byte_sum = 0;
+	for (int r = 0; r < repeats; r++) {
+		allocation_sum += results[r].allocations;
+		byte_sum += results[r].bytes;
+	}
+	qsort(done_ms, repeats, sizeof(double), compare_double);
+	double p50 = percentile(done_ms, repeats, 50);
+	double p99 = percentile(done_ms, repeats, 99);
+
+	log_flush();
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("    {\"heads\": %d, \"modes_per_head\": %d, \"events\": %llu, \"events_per_sec\": %.0f, "
+		"\"done_ms_p50\": %.3f, \"done_ms_p99\": %.3f, \"peak_rss_kb\": %ld, "
+		"\"allocations_per_run\": %.0f, \"bytes_allocated_per_run\": %.0f}",
+		heads, modes, (unsigned long long)results[0].events, results[0].events / (p50 / 1e3),
+		p50, p99, usage.ru_maxrss, (double)allocation_sum / repeats, (double)byte_sum / repeats);
+	fflush(stdout);
+	return 1;
+}
+
+int main(int argc, char ** argv) {
+
+	const char * mock_path = "./mock_compositor";
+	int head_counts[BENCH_MAX_HEAD_COUNTS] = { 1, 16, 256, 4096 };
+	int num_head_counts = 4;
+	int modes = 100;
+	int repeats = 20;
+	int opt;
+	while ((opt = getopt(argc, argv, "M:n:m:r:")) != -1) {
+		switch (opt) {
+			case 'M': mock_path = optarg; break;
+			case 'n':
+				num_head_counts = 0;
+				for (char * tok = strtok(optarg, ","); tok && num_head_counts < BENCH_MAX_HEAD_COUNTS; tok = strtok(NULL, ",")) {
+					head_counts[num_head_counts++] = atoi(tok);
+				}
+				break;
+			case 'm': modes = atoi(optarg); break;
+			case 'r': repeats = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-M mock_compositor] [-n heads[,heads...]] [-m modes] [-r repeats]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (repeats < 1 || repeats > BENCH_MAX_REPEATS) {
+		fprintf(stderr, "repeats must be between 1 and %d\n", BENCH_MAX_REPEATS);
+		return 1;
+	}
+
+	// the mock needs a runtime directory for its socket
+	char runtime_dir[] = "/tmp/bench_ingest_XXXXXX";
+	int own_runtime_dir = 0;
+	if (!getenv("XDG_RUNTIME_DIR")) {
+		if (!mkdtemp(runtime_dir)) {
+			perror("mkdtemp");
+			return 1;
+		}
+		setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+		own_runtime_dir = 1;
+	}
+
+	snprintf(log_file_path, sizeof(log_file_path), "/tmp/bench_ingest_log_%d.bin", (int)getpid());
+	snprintf(log_index_path, sizeof(log_index_path), "%s.idx", log_file_path);
+	snprintf(log_defs_path, sizeof(log_defs_path), "%s.defs", log_file_path);
+	wl_list_init(&heads);
+	wl_list_init(&pending_outputs);
+	wl_list_init(&config_requests);
+
+	printf("{\n  \"benchmark\": \"ingest\",\n  \"repeats\": %d,\n  \"results\": [\n", repeats);
+	fflush(stdout);
+	int failed = 0;
+	for (int i = 0; i < num_head_counts; i++) {
+		pid_t child = fork();
+		if (child == 0) {
+			if (!log_start(log_file_path)) {
+				fprintf(stderr, "Asynchronous logger unavailable, logging synchronously\n");
+			}
+			int ok = bench_heads(mock_path, head_counts[i], modes, repeats);
+			log_stop();
+			_exit(ok ? 0 : 1);
+		}
+		int status;
+		waitpid(child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%d heads: benchmark failed\n", head_counts[i]);
+			failed = 1;
+			break;
+		}
+		printf(i + 1 < num_head_counts ? ",\n" : "\n");
+		// the next child must not inherit (and print again) buffered output
+		fflush(stdout);
+	}
+	printf("  ]\n}\n");
+
+	unlink(log_file_path);
+	unlink(log_index_path);
+	unlink(log_defs_path);
+	if (own_runtime_dir) {
+		rmdir(runtime_dir);
+	}
+	return failed;
+}
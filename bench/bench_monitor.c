@@ -0,0 +1,339 @@
+/**
+ * Benchmark of the log reading behind the `monitor` command.
+ *
+ * The same synthetic records are written as the text log of old (256 MB by
+ * default) and as the binary log log_event() writes now, and every query is
+ * run by three implementations:
+ * 1. legacy  - the original fopen/fgets/sscanf/strcmp loop over the text log
+ * 2. render  - rendering of the whole binary log
+ * 3. indexed - rendering restricted to the byte range found in the .idx file
+ * Records carry nanosecond timestamps; besides the whole log, a second (single),
+ * a tenth of a second (burst) and a range between two instants (period) are
+ * queried. The output of every implementation is checked against the legacy loop before
+ * anything is timed; timed runs write into a pipe drained by a child process, so
+ * copying the matched records out is part of the measured cost.
+ *
+ * Build: gcc -O2 -o bench_monitor bench/bench_monitor.c -lwayland-client -lm -pthread
+ * Usage: bench_monitor [-s size_mb] [-r repeats] [log_path]
+ */
+
+#define NO_MAIN
+#include "../main.c"
+#include <sys/wait.h>
+
+#define BENCH_RECORDS_PER_SECOND    400
+#define BENCH_EPOCH          1767225600   // 2026-01-01 00:00:00 UTC
+
+struct bench_query {
+	const char * name;
+	char from[LOG_TIMESTAMP_MAX + 1];
+	char to[LOG_TIMESTAMP_MAX + 1];
+	int all;
+};
+
+struct bench_message {
+	int level;
+	const char * format;
+	const char * arg;
+};
+
+static const struct bench_message bench_messages[] = {
+	{ LOG_LEVEL_EVENT_RECEIVED, "RECEIVED: zwlr_output_head_v1 - %s\n", "mode" },
+	{ LOG_LEVEL_INFO, "Local reference to mode - mode created\n", NULL },
+	{ LOG_LEVEL_INFO, "Local reference to mode - listeners added\n", NULL },
+	{ LOG_LEVEL_EVENT_RECEIVED, "RECEIVED: zwlr_output_mode_v1 - %s\n", "size" },
+	{ LOG_LEVEL_INFO, "Local reference to mode - size updated\n", NULL },
+	{ LOG_LEVEL_EVENT_RECEIVED, "RECEIVED: zwlr_output_mode_v1 - %s\n", "refresh" },
+	{ LOG_LEVEL_INFO, "Local reference to mode - refresh rate updated\n", NULL },
+	{ LOG_LEVEL_REQUEST_SENT, "SENT: zwlr_output_configuration_v1 - %s\n", "apply" },
+};
+
+#define BENCH_MESSAGES   (sizeof(bench_messages) / sizeof(bench_messages[0]))
+
+static double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// records are spread evenly over their second
+static int64_t bench_key(long record) {
+	return (BENCH_EPOCH + record / BENCH_RECORDS_PER_SECOND) * 1000000000LL
+		+ record % BENCH_RECORDS_PER_SECOND * (1000000000LL / BENCH_RECORDS_PER_SECOND);
+}
+
+static void format_bench_timestamp(char * out, long record) {
+	int64_t key = bench_key(record);
+	time_t t = key / 1000000000LL;
+	struct tm tm_info;
+	gmtime_r(&t, &tm_info);
+	strftime(out, LOG_TIMESTAMP_LEN + 1, "%Y-%m-%d::%H:%M:%S", &tm_info);
+	int64_t fraction = key % 1000000000LL;
+	out[LOG_TIMESTAMP_LEN] = '.';
+	for (int i = LOG_TIMESTAMP_MAX - 1; i > LOG_TIMESTAMP_LEN; i--, fraction /= 10) {
+		out[i] = '0' + fraction % 10;
+	}
+	out[LOG_TIMESTAMP_MAX] = '\0';
+}
+
+// writes the synthetic text log, returns the number of records in it
+static long generate_text_log(const char * path, uint64_t size) {
+	FILE * file = fopen(path, "w");
+	if (!file) {
+		perror("Error creating synthetic log");
+		exit(1);
+	}
+	char timestamp[LOG_TIMESTAMP_MAX + 1];
+	uint64_t written = 0;
+	long record = 0;
+	while (written < size) {
+		const struct bench_message * m = &bench_messages[record % BENCH_MESSAGES];
+		format_bench_timestamp(timestamp, record);
+		written += fprintf(file, "[%s]  [%s]  ", timestamp, log_level_name(m->level));
+		written += fprintf(file, m->format, m->arg);
+		written += fprintf(file, "\n");
+		record++;
+	}
+	fclose(file);
+	return record;
+}
+
+static size_t bench_build_event(char * out, int64_t key, const struct bench_message * m, ...) {
+	va_list args;
+	va_start(args, m);
+	size_t len = log_build_event(out, key, m->level, m->format, args);
+	va_end(args);
+	return len;
+}
+
+// writes the same records as the binary log, returns the nanoseconds spent building one
+static double generate_binary_log(const char * path, long records) {
+	static uint64_t event[(sizeof(struct log_record) + LOG_EVENT_MAX) / 8];
+	unlink(path);
+	snprintf(log_file_path, sizeof(log_file_path), "%s", path);
+	// formats are defined at their first use, strings at their second, the
+	// definitions go straight to the log
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < BENCH_MESSAGES; i++) {
+			bench_build_event((char *)event, 0, &bench_messages[i], bench_messages[i].arg);
+		}
+	}
+	FILE * file = fopen(path, "a");
+	if (!file) {
+		perror("Error creating synthetic log");
+		exit(1);
+	}
+	double build_ms = 0;
+	for (long record = 0; record < records; ) {
+		static char batch[1 << 20];
+		size_t len = 0;
+		double start = now_ms();
+		for (; record < records && len + sizeof(event) <= sizeof(batch); record++) {
+			const struct bench_message * m = &bench_messages[record % BENCH_MESSAGES];
+			len += bench_build_event(batch + len, bench_key(record), m, m->arg);
+		}
+		build_ms += now_ms() - start;
+		fwrite(batch, 1, len, file);
+	}
+	fclose(file);
+	return build_ms * 1e6 / records;
+}
+
+// the monitor loop as it was before the scanner, verbatim apart from the output stream
+static void legacy_monitor(const char * path, struct bench_query * q, FILE * out) {
+	char line[1024];
+	char timestamp[100];
+	FILE * file = fopen(path, "r");
+	if (q->all) {
+		while (fgets(line, sizeof(line), file)) {
+			fprintf(out, "%s", line);
+		}
+	} else {
+		while (fgets(line, sizeof(line), file)) {
+			if (sscanf(line, "[%[^]]]", timestamp) == 1) {
+				if (strcmp(timestamp, q->from) >= 0 && strcmp(timestamp, q->to) <= 0) {
+					fprintf(out, "%s", line);
+				}
+			}
+		}
+	}
+	fclose(file);
+}
+
+static void binary_monitor(const char * path, struct bench_query * q, int use_index, int out_fd) {
+	int fd = open(path, O_RDONLY);
+	if (q->all) {
+		print_log_all(fd, out_fd);
+	} else if (use_index) {
+		print_log_records(fd, q->from, q->to, out_fd);
+	} else {
+		int64_t from, to, span;
+		parse_timestamp_key(q->from, strlen(q->from), &from, &span);
+		parse_timestamp_key(q->to, strlen(q->to), &to, &span);
+		print_log_range(fd, from, to + span - 1, 0, 1, out_fd);
+	}
+	close(fd);
+}
+
+static uint64_t checksum_file(const char * path, uint64_t * size) {
+	uint64_t hash = 1469598103934665603ULL;
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	fstat(fd, &st);
+	*size = st.st_size;
+	if (st.st_size > 0) {
+		const unsigned char * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		for (off_t i = 0; i < st.st_size; i++) {
+			hash = (hash ^ data[i]) * 1099511628211ULL;
+		}
+		munmap((void *)data, st.st_size);
+	}
+	close(fd);
+	return hash;
+}
+
+static const char * text_path;
+static const char * binary_path;
+
+static void run_into(int variant, struct bench_query * q, int out_fd) {
+	if (variant == 0) {
+		FILE * out = fdopen(dup(out_fd), "w");
+		legacy_monitor(text_path, q, out);
+		fclose(out);
+	} else {
+		binary_monitor(binary_path, q, variant == 2, out_fd);
+	}
+}
+
+static void run_to_file(int variant, struct bench_query * q, const char * out_path) {
+	int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	run_into(variant, q, out_fd);
+	close(out_fd);
+}
+
+static double run_timed(int variant, struct bench_query * q) {
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	pid_t drain = fork();
+	if (drain == 0) {
+		char buf[1 << 16];
+		close(fds[1]);
+		while (read(fds[0], buf, sizeof(buf)) > 0);
+		_exit(0);
+	}
+	close(fds[0]);
+	double start = now_ms();
+	run_into(variant, q, fds[1]);
+	close(fds[1]);
+	waitpid(drain, NULL, 0);
+	return now_ms() - start;
+}
+
+int main(int argc, char ** argv) {
+
+	uint64_t size_mb = 256;
+	int repeats = 3;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:r:")) != -1) {
+		switch (opt) {
+			case 's': size_mb = strtoull(optarg, NULL, 10); break;
+			case 'r': repeats = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-s size_mb] [-r repeats] [log_path]\n", argv[0]);
+				return 1;
+		}
+	}
+	const char * path = optind < argc ? argv[optind] : "/tmp/bench_monitor_log.txt";
+	char binary[256];
+	snprintf(binary, sizeof(binary), "%s.bin", path);
+	text_path = path;
+	binary_path = binary;
+
+	fprintf(stderr, "Generating %llu MB synthetic log at %s and %s...\n", (unsigned long long)size_mb, path, binary);
+	long records = generate_text_log(path, size_mb << 20);
+	long seconds = records / BENCH_RECORDS_PER_SECOND + 1;
+	double build_ns = generate_binary_log(binary, records);
+	uint64_t text_size, log_size;
+	checksum_file(path, &text_size);
+	checksum_file(binary, &log_size);
+
+	double start = now_ms();
+	snprintf(log_index_path, sizeof(log_index_path), "%s.idx", binary);
+	snprintf(log_defs_path, sizeof(log_defs_path), "%s.defs", binary);
+	unlink(log_index_path);
+	unlink(log_defs_path);
+	log_ring.fd = open(binary, O_RDWR);
+	log_ring.file_offset = log_size;
+	log_index_open(log_index_path, log_defs_path);
+	log_index_catch_up();
+	close(log_ring.index_fd);
+	close(log_ring.defs_fd);
+	close(log_ring.fd);
+	double index_ms = now_ms() - start;
+
+	// the bounds are written out to the last digit the query covers, so that
+	// strcmp() in the legacy loop gives the same answer
+	struct bench_query queries[4] = {
+		{ .name = "monitor" , .all = 1 },
+		{ .name = "single" },
+		{ .name = "burst" },
+		{ .name = "period" },
+	};
+	format_bench_timestamp(queries[1].from, seconds / 2 * BENCH_RECORDS_PER_SECOND);
+	queries[1].from[LOG_TIMESTAMP_LEN] = '\0';
+	memcpy(queries[1].to, queries[1].from, LOG_TIMESTAMP_LEN);
+	strcpy(queries[1].to + LOG_TIMESTAMP_LEN, ".999999999");
+	format_bench_timestamp(queries[2].from, seconds / 4 * BENCH_RECORDS_PER_SECOND + BENCH_RECORDS_PER_SECOND / 2);
+	queries[2].from[LOG_TIMESTAMP_LEN + 2] = '\0';
+	memcpy(queries[2].to, queries[2].from, LOG_TIMESTAMP_LEN + 2);
+	strcpy(queries[2].to + LOG_TIMESTAMP_LEN + 2, "99999999");
+	format_bench_timestamp(queries[3].from, seconds / 3 * BENCH_RECORDS_PER_SECOND + BENCH_RECORDS_PER_SECOND / 4);
+	format_bench_timestamp(queries[3].to, (seconds / 3 + seconds / 100) * BENCH_RECORDS_PER_SECOND + BENCH_RECORDS_PER_SECOND / 2);
+
+	static const char * variants[] = { "legacy", "render", "indexed" };
+	char out_path[300];
+	snprintf(out_path, sizeof(out_path), "%s.out", path);
+
+	printf("log: %ld records over %ld seconds, text %.1f MB, binary %.1f MB, %.0f ns to build a record, index built in %.1f ms\n",
+		records, seconds, text_size / 1048576.0, log_size / 1048576.0, build_ns, index_ms);
+	printf("%-8s %-8s %12s %12s %10s %9s\n", "query", "variant", "best ms", "log MB/s", "out KB", "speedup");
+
+	for (int q = 0; q < 4; q++) {
+		uint64_t expected_size, expected_hash = 0;
+		double legacy_best = 0;
+		for (int v = 0; v < 3; v++) {
+			uint64_t out_size;
+			run_to_file(v, &queries[q], out_path);
+			uint64_t hash = checksum_file(out_path, &out_size);
+			if (v == 0) {
+				expected_hash = hash;
+				expected_size = out_size;
+			} else if (hash != expected_hash || out_size != expected_size) {
+				fprintf(stderr, "%s/%s: output differs from the legacy loop\n", queries[q].name, variants[v]);
+				return 1;
+			}
+
+			double best = 0;
+			for (int r = 0; r < repeats; r++) {
+				double ms = run_timed(v, &queries[q]);
+				if (r == 0 || ms < best) {
+					best = ms;
+				}
+			}
+			if (v == 0) {
+				legacy_best = best;
+			}
+			printf("%-8s %-8s %12.2f %12.0f %10.0f %8.1fx\n", queries[q].name, variants[v], best,
+				(v == 0 ? text_size : log_size) / 1048576.0 / (best / 1e3), out_size / 1024.0, legacy_best / best);
+		}
+	}
+
+	unlink(out_path);
+	unlink(binary);
+	unlink(log_index_path);
+	unlink(log_defs_path);
+	return 0;
+}
@@ -1,9 +1,22 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "main.h"
 #include "wayland-client.h"
 #include "protocols/wlr-output-management-client.h"
@@ -13,14 +26,37 @@
 // global objects to store state
 
 static struct wl_list heads;
+static struct head_index heads_by_name;
+static struct head_index heads_by_identity;
 static struct zwlr_output_manager_v1 * output_manager;
 static uint32_t output_manager_name;
-static struct zwlr_output_configuration_v1 * configuration_object;
+static struct wl_list config_requests;
+static uint32_t next_config_id = 1;
+static struct config_result config_results[CONFIG_RESULTS_MAX];
+static uint32_t config_results_next = 0;
+static uint32_t retry_attempts = CONFIG_RETRY_ATTEMPTS;
 static char log_file_path[256];
-static volatile int result = 0;
+static char log_index_path[264];
+static char log_defs_path[264];
 static struct wl_registry * registry;
 static uint32_t current_serial;
 static uint32_t previous_serial = 0;
+static struct wl_list pending_outputs;
+static int transaction_open = 0;
+static int apply_mode = CONFIG_APPLY;
+static struct latency_stats latency_stats;
+static struct state_snapshot snapshots[2];
+static int snapshot_current = 0;
+static struct change_history change_history;
+static uint64_t next_head_id = 1;
+static int watching = 0;
+static uint64_t watch_seen = 0;
+static volatile sig_atomic_t stop_requested = 0;
+static struct state_cache state_cache;
+static int state_ready = 0;
+static struct log_ring log_ring;
+static struct log_intern log_intern;
+static struct trace_recorder * trace_recorder;
 
 
 // events - registry
@@ -31,7 +67,7 @@ void registry_global(void *data, struct wl_registry *reg, uint32_t name, const c
         output_manager = wl_registry_bind(reg, name, &zwlr_output_manager_v1_interface, version);
 		output_manager_name = name;
 		log_event(log_file_path, 5 , "SENT: wl_registry - bind, (name: %u, interface: %s)", name, interface);
-        zwlr_output_manager_v1_add_listener(output_manager, &output_manager_listener, NULL);
+        trace_add_listener(output_manager, &output_manager_listener, data);
 		log_event(log_file_path, 1 , "Local reference to output manager - listeners added\n");    
 	}
 }
@@ -46,29 +82,63 @@ void registry_global_remove(void *data, struct wl_registry *reg, uint32_t name)
 	}
 }
 
+// The registry's globals have all been announced. Without an output manager
+// there is no done to wait for.
+
+void registry_synced(void *data, struct wl_callback *callback, uint32_t callback_data) {
+	wl_callback_destroy(callback);
+	if (!output_manager && !state_ready){
+		log_event(log_file_path, 1, "No output manager announced, state cache not used\n");
+		state_ready = 1;
+		state_cache_unload();
+	}
+}
+
 // events - output_manager
 
 void output_manager_head(void * data, struct zwlr_output_manager_v1 * output_manager, struct zwlr_output_head_v1 * output_head){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_manager_v1 - head\n");
-	struct local_head * lh = malloc(sizeof(struct local_head));
+	struct arena arena = { 0 };
+	struct local_head * lh = arena_alloc(&arena, sizeof(struct local_head));
+	if (!lh){
+		log_event(log_file_path, 2 , "Local reference to head - out of memory, head ignored\n");
+		zwlr_output_head_v1_release(output_head);
+		return;
+	}
 	memset(lh, 0, sizeof(struct local_head));
+	lh->arena = arena;
+	lh->modes.arena = &lh->arena;
+	lh->id = next_head_id++;
 	lh->head = output_head;
-	wl_list_init(&lh->available_modes);
 	wl_list_insert(&heads, &lh->link);
 	log_event(log_file_path, 1 , "Local reference to head - created\n");
-	zwlr_output_head_v1_add_listener(lh->head, &head_listener, lh);
+	trace_add_listener(lh->head, &head_listener, lh);
 	log_event(log_file_path, 1 , "Local reference to head - listeners added\n");
 }
 
 void output_manager_done(void * data, struct zwlr_output_manager_v1 * output_manager, uint32_t serial){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_manager_v1 - done\n");
+	uint64_t done_ns = monotonic_ns();
 	previous_serial = current_serial;
 	current_serial = serial;
 	log_event(log_file_path, 1 , "Local reference to output manager - serial updated\n");
+	int first_done = !state_ready;
+	state_ready = 1;
+	// a matching profile goes out first, recording and caching the state can wait
+	profiles_match(data, done_ns);
+	struct change_set * set = record_state_changes(serial);
+	if (first_done){
+		// the first done completes the state the cache stood in for
+		state_cache_reconcile();
+	} else if (set){
+		state_cache_save();
+	}
 }
 
 void output_manager_finished(void *data, struct zwlr_output_manager_v1 *output_manager) {
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_manager_v1 - finished\n");
+	// no more head events will come, drop what is left and the pooled memory
+	free_all_heads();
     if (output_manager) {
         output_manager = NULL; 
 		log_event(log_file_path, 1 , "Local reference to output manager - destroyed\n");
@@ -81,19 +151,19 @@ void head_name(void * data, struct zwlr_output_head_v1 * output_head, const char
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_head_v1 - name\n");
 	struct local_head * lh = data;
 	if (lh->name){
-		free(lh->name);
+		head_index_remove(&heads_by_name, lh->name, lh);
+	}
+	lh->name = arena_strdup(&lh->arena, name);
+	if (!head_index_insert(&heads_by_name, lh->name, lh)){
+		log_event(log_file_path, 2 , "Head index - name not indexed, memory not allocated\n");
 	}
-	lh->name = strdup(name);
 	log_event(log_file_path, 1 , "Local reference to head - name updated\n");
 }
 
 void head_description(void * data, struct zwlr_output_head_v1 * output_head, const char * description){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_head_v1 - description\n");
 	struct local_head * lh = data;
-	if (lh->description){
-		free(lh->description);
-	}
-	lh->description = strdup(description);
+	lh->description = arena_strdup(&lh->arena, description);
 	log_event(log_file_path, 1 , "Local reference to head - description updated\n");
 }
 
@@ -108,11 +178,13 @@ void head_physical_size(void *data, struct zwlr_output_head_v1 * output_head, in
 void head_mode(void *data, struct zwlr_output_head_v1 * output_head, struct zwlr_output_mode_v1 *mode) {
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_head_v1 - mode\n");
 	struct local_head * lh = data;
-	struct local_mode * lm = malloc(sizeof(struct local_mode));
+	if (mode_table_add(&lh->modes, mode) < 0){
+		log_event(log_file_path, 2 , "Local reference to mode - out of memory, mode ignored\n");
+		zwlr_output_mode_v1_release(mode);
+		return;
+	}
 	log_event(log_file_path, 1 , "Local reference to mode - mode created\n");
-	lm->mode = mode;
-	wl_list_insert(&lh->available_modes, &lm->link);
-	zwlr_output_mode_v1_add_listener(lm->mode, &mode_listener, lm);
+	trace_add_listener(mode, &mode_listener, lh);
 	log_event(log_file_path, 1 , "Local reference to mode - listeners added\n");
 	log_event(log_file_path, 1 , "Local reference to head - mode received\n");
 }
@@ -127,41 +199,17 @@ void head_enabled(void *data, struct zwlr_output_head_v1 * output_head, int32_t
 void head_current_mode(void *data, struct zwlr_output_head_v1 * output_head, struct zwlr_output_mode_v1 *mode) {
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_head_v1 - current_mode\n");
 	struct local_head * lh = data;
-	struct local_mode * lm;
-	int found = 0;
-
-	// 'C' = Current
-	// 'B' = Became Current
-	// 'P' = Previously Current
-	// 'N' = Neutral (unused)
+	int row = mode_table_row(&lh->modes, mode);
 
-	wl_list_for_each(lm, &lh->available_modes, link){
-		if(lm->mode == mode){
-			lh->current_mode = lm;
-			if(lm->status == 'P'){
-				lm->status = 'B';
-			} else {
-				lm->status = 'C';
-			}
-			found = 1;
+	if (row < 0){
+		row = mode_table_add(&lh->modes, mode);
+		if (row < 0){
+			log_event(log_file_path, 2 , "Local reference to mode - out of memory, mode ignored\n");
+			return;
 		}
-		 else {
-			if (lm->status == 'C'){
-				lm->status = 'N';
-			}
-			else if (lm->status == 'B'){
-				lm->status = 'P';
-			}
-		 }		
-	}
-
-	if(found == 0){
-		struct local_mode * lm = malloc(sizeof(struct local_mode));
-		lm->mode = mode;
-		wl_list_insert(&lh->available_modes, &lm->link);
-		zwlr_output_mode_v1_add_listener(lm->mode, &mode_listener, lm);
-		lm->status = 'C';
+		trace_add_listener(mode, &mode_listener, lh);
 	}
+	mode_table_set_current(&lh->modes, row);
 
 	log_event(log_file_path, 1 , "Local reference to head - current mode event received\n");
 }
@@ -190,66 +238,30 @@ void head_scale(void *data, struct zwlr_output_head_v1 * output_head, wl_fixed_t
 
 void head_finished(void *data, struct zwlr_output_head_v1 * output_head) {
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_head_v1 - finished\n");
-	struct local_head * lh = data;
-	struct local_mode * lm, * tmp_lm;
-	wl_list_for_each_safe(lm, tmp_lm, &lh->available_modes, link){
-		zwlr_output_mode_v1_release(lm->mode);
-		log_event(log_file_path, 5, "SENT: zwlr_output_mode_v1 - release\n");
-		wl_list_remove(&lm->link);
-		free(lm);
-	}
-	if(lh->name){
-		free(lh->name);
-	}
-	if(lh->description){
-		free(lh->description);
-	}
-	if(lh->make){
-		free(lh->make);
-	}
-	if(lh->model){
-		free(lh->model);
-	}
-	if(lh->serial_number){
-		free(lh->serial_number);
-	}
-	if(lh->head){
-		zwlr_output_head_v1_release(lh->head);
-		log_event(log_file_path, 5, "SENT: zwlr_output_head_v1 - release\n");
-		lh->head = NULL;
-	}
-	wl_list_remove(&lh->link);
-	free(lh);
-	log_event(log_file_path, 1 , "Local reference to head - freed\n");
+	free_head(data);
 }
 
 void head_make(void *data, struct zwlr_output_head_v1 * output_head, const char *make) {
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_head_v1 - make\n");
 	struct local_head * lh = data;
-	if (lh->make){
-		free(lh->make);
-	}
-	lh->make = strdup(make);
+	lh->make = arena_strdup(&lh->arena, make);
+	head_update_identity(lh);
 	log_event(log_file_path, 1 , "Local reference to head - make updated\n");
 }
 
 void head_model(void *data, struct zwlr_output_head_v1 * output_head, const char *model) {
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_head_v1 - model\n");
 	struct local_head * lh = data;
-	if (lh->model){
-		free(lh->model);
-	}
-	lh->model = strdup(model);
+	lh->model = arena_strdup(&lh->arena, model);
+	head_update_identity(lh);
 	log_event(log_file_path, 1 , "Local reference to head - model updated\n");
 }
 
 void head_serial_number(void *data, struct zwlr_output_head_v1 * output_head, const char * serial_number) {
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_head_v1 - number\n");
 	struct local_head * lh = data;
-	if (lh->serial_number){
-		free(lh->serial_number);
-	}
-	lh->serial_number = strdup(serial_number);
+	lh->serial_number = arena_strdup(&lh->arena, serial_number);
+	head_update_identity(lh);
 	log_event(log_file_path, 1 , "Local reference to head - serial_number updated\n");
 }
 
@@ -264,81 +276,141 @@ void head_adaptive_sync(void *data, struct zwlr_output_head_v1 * output_head, ui
 
 void mode_size(void * data, struct zwlr_output_mode_v1 * mode, int32_t width, int32_t height){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_mode_v1 - size\n");
-	struct local_mode * lm = data;
-	if (lm->mode == mode){
-		lm->height = height;
-		lm->width = width;
+	struct local_head * lh = data;
+	int row = mode_table_row(&lh->modes, mode);
+	if (row >= 0){
+		lh->modes.height[row] = height;
+		lh->modes.width[row] = width;
+		lh->modes.slots_valid = 0;
 	}
 	log_event(log_file_path, 1 , "Local reference to mode - size updated\n");
 }
 
 void mode_refresh(void * data, struct zwlr_output_mode_v1 * mode, int32_t refresh){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_mode_v1 - refresh\n");
-	struct local_mode * lm = data;
-	if(lm->mode == mode){
-		lm->refresh = refresh;
+	struct local_head * lh = data;
+	int row = mode_table_row(&lh->modes, mode);
+	if (row >= 0){
+		lh->modes.refresh[row] = refresh;
+		lh->modes.slots_valid = 0;
 	}
 	log_event(log_file_path, 1 , "Local reference to mode - refresh rate updated\n");
 }
 
 void mode_preferred(void * data, struct zwlr_output_mode_v1 * mode){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_mode_v1 - preferred\n");
-	struct local_mode * lm = data;
-	if(lm->mode == mode){
-		if (lm->status == 'C'){
-			lm->status = 'B';
-		} else {
-			lm->status = 'P';
-		}
+	struct local_head * lh = data;
+	int row = mode_table_row(&lh->modes, mode);
+	if (row >= 0){
+		lh->modes.flags[row] |= MODE_PREFERRED;
 	}
 	log_event(log_file_path, 1 , "Local reference to mode - status updated\n");
 }
 
 void mode_finished(void * data, struct zwlr_output_mode_v1 * mode){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_mode_v1 - finished\n");
-	struct local_mode * lm = data;
-	if (lm->mode){
-		zwlr_output_mode_v1_release(lm->mode);
-		log_event(log_file_path, 5, "SENT: zwlr_output_mode_v1 - release\n");
-		lm->mode = NULL;
-	}
-	wl_list_remove(&lm->link);
-	if (lm){
-		free(lm);
+	struct local_head * lh = data;
+	transaction_forget_mode(mode);
+	zwlr_output_mode_v1_release(mode);
+	log_event(log_file_path, 5, "SENT: zwlr_output_mode_v1 - release\n");
+	int row = mode_table_row(&lh->modes, mode);
+	if (row >= 0){
+		mode_table_remove(&lh->modes, row);
 	}
 	log_event(log_file_path, 1 , "Local reference to mode - freed\n");
 }
 
 // events - output configuration layout
 
+// The state changed under a configuration: it is sent again against a later
+// done (tested again first for CONFIG_TEST_THEN_APPLY), waiting twice as long
+// after every cancel, until it runs out of retries.
+static void config_request_cancelled(struct config_request * req) {
+	if (req->attempts < retry_attempts) {
+		uint64_t delay_ms = (uint64_t)CONFIG_RETRY_BASE_MS << req->attempts;
+		if (delay_ms > CONFIG_RETRY_MAX_MS) {
+			delay_ms = CONFIG_RETRY_MAX_MS;
+		}
+		req->attempts++;
+		req->retry_ns = monotonic_ns() + delay_ms * 1000000;
+		log_event(log_file_path, 2, "Configuration %u cancelled, retry %u of %u in %llu ms\n",
+			req->id, req->attempts, retry_attempts, (unsigned long long)delay_ms);
+		return;
+	}
+	if (req->attempts) {
+		log_event(log_file_path, 2, "Configuration cancelled %u times, given up\n", req->attempts + 1);
+	}
+	if (req->mode != CONFIG_APPLY && !req->tag[0]) {
+		printf("Test cancelled: the output state changed, nothing was applied\n");
+	}
+	config_request_finish(req, OUTCOME_CANCELLED);
+}
+
 void configuration_object_succeeded(void * data, struct zwlr_output_configuration_v1 * config){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_configuration_v1 - succeeded\n");
-	result = 1;
-    zwlr_output_configuration_v1_destroy(config);
+	struct config_request * req = data;
+	record_config_latency(req, OUTCOME_SUCCEEDED);
+	zwlr_output_configuration_v1_destroy(config);
 	log_event(log_file_path, 5, "SENT:  zwlr_output_configuration_v1 - destroy\n");
-	if (configuration_object == config) {
-		configuration_object = NULL;
+	req->config = NULL;
+
+	if (req->mode == CONFIG_TEST_THEN_APPLY && !output_manager) {
+		log_event(log_file_path, 2, "Configuration %u tested, but the output manager is gone\n", req->id);
+		if (!req->tag[0]) {
+			printf("Test cancelled: the output manager is gone, nothing was applied\n");
+		}
+		config_request_finish(req, OUTCOME_CANCELLED);
+		return;
 	}
+	if (req->mode == CONFIG_TEST_THEN_APPLY && current_serial != req->serial) {
+		// a done arrived before the result, what was tested is not the state
+		// the apply would be built on
+		log_event(log_file_path, 2, "Configuration %u tested against serial %u, the state is now at %u\n",
+			req->id, req->serial, current_serial);
+		config_request_cancelled(req);
+		return;
+	}
+	if (req->mode == CONFIG_TEST_THEN_APPLY) {
+		// the test passed against the current state, apply the same changes
+		// in a fresh configuration built on the same serial
+		log_event(log_file_path, 1 , "Configuration test succeeded, applying\n");
+		req->mode = CONFIG_APPLY;
+		req->config = build_configuration(req);
+		zwlr_output_configuration_v1_apply(req->config);
+		req->sent_ns = monotonic_ns();
+		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_v1 - apply\n");
+		return;
+	}
+	if (req->mode == CONFIG_TEST && !req->tag[0]) {
+		printf("Test succeeded: the configuration can be applied\n");
+	}
+	if (req->attempts) {
+		log_event(log_file_path, 3, "Configuration succeeded after %u retries\n", req->attempts);
+	}
+	config_request_finish(req, OUTCOME_SUCCEEDED);
 }
 
 void configuration_object_failed(void * data, struct zwlr_output_configuration_v1 * config){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_configuration_v1 - failed\n");
-	result = -1;
+	struct config_request * req = data;
+	record_config_latency(req, OUTCOME_FAILED);
 	zwlr_output_configuration_v1_destroy(config);
 	log_event(log_file_path, 5, "SENT:  zwlr_output_configuration_v1 - destroy\n");
-	if (configuration_object == config) {
-		configuration_object = NULL;
+	req->config = NULL;
+	if (req->mode != CONFIG_APPLY && !req->tag[0]) {
+		printf("Test failed: the configuration was rejected, nothing was applied\n");
 	}
+	config_request_finish(req, OUTCOME_FAILED);
 }
 
 void configuration_object_cancelled(void * data, struct zwlr_output_configuration_v1 * config){
 	log_event(log_file_path, 4 , "RECEIVED: zwlr_output_configuration_v1 - cancelled\n");
-	result = 0;
+	struct config_request * req = data;
+	record_config_latency(req, OUTCOME_CANCELLED);
 	zwlr_output_configuration_v1_destroy(config);
 	log_event(log_file_path, 5, "SENT:  zwlr_output_configuration_v1 - destroy\n");
-	if (configuration_object == config) {
-		configuration_object = NULL;
-	}
+	req->config = NULL;
+	config_request_cancelled(req);
 }
 
 // listener definitions
@@ -348,6 +420,10 @@ struct wl_registry_listener registry_listener = {
 	.global_remove = registry_global_remove,
 };
 
+struct wl_callback_listener registry_sync_listener = {
+	.done = registry_synced,
+};
+
 struct zwlr_output_manager_v1_listener output_manager_listener = {
 	.head = output_manager_head,	
 	.done = output_manager_done,
@@ -386,702 +462,5664 @@ struct zwlr_output_configuration_v1_listener configuration_object_listener = {
 
 // helper methods
 
-int setup_log_file() {
-    char dir[128];
-    if (getcwd(dir, sizeof(dir)) != NULL) {
-        snprintf(log_file_path, sizeof(log_file_path), "%s/log.txt", dir);
-		return 1;
-    } else {
-        perror("Error with setting up log file");
-		return 0;
-    }
-}
+// latency statistics - time from sending apply or test to the result, in
+// log-linear histograms (HDR style): each power of two range of microseconds
+// is split into LATENCY_SUB_BUCKETS linear buckets, so every value is kept
+// within about 6% whatever its magnitude. A request is counted once under
+// every property kind it changes.
 
-const char* get_timestamp() {
-    static char timestamp[28];
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d::%H:%M:%S", tm_info);
-    return timestamp;
-}
+static const char * latency_kind_names[STAT_KINDS] = {
+	"mode", "cmode", "scale", "transform", "position", "adaptivesync", "enabled",
+};
 
-void log_event(const char *log_file, int level, const char *format, ...) {
-    FILE *file = fopen(log_file, "a");
-    if (file == NULL) {
-        perror("Error opening log file");
-        return;
-    }
-    const char *timestamp = get_timestamp();
-    const char *level_str = "";
-    switch (level) {
-        case LOG_LEVEL_INFO:
-            level_str = "INFO";
-            break;
-        case LOG_LEVEL_ERROR:
-            level_str = "ERROR";
-            break;
-        case LOG_LEVEL_SUCCESS:
-            level_str = "SUCCESS";
-            break;
-        case LOG_LEVEL_EVENT_RECEIVED:
-            level_str = "EVENT";
-            break;
-        case LOG_LEVEL_REQUEST_SENT:
-            level_str = "REQUEST";
-            break;
-		case LOG_LEVEL_RESULT:
-			level_str = "RESULT";
-			break;
-        default:
-            level_str = "UNKNOWN";
-            break;
-    }
-    fprintf(file, "[%s]  [%s]  ", timestamp, level_str);
-    va_list args;
-    va_start(args, format);
-    vfprintf(file, format, args); 
-    va_end(args);
-    fprintf(file, "\n");
-    fclose(file);
+uint64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void handle_print_outputs(struct wl_list *heads) {
-    struct local_head *lh;
-    wl_list_for_each(lh, heads, link) {
-        printf("Output: %s\n", lh->name ? lh->name : "(unknown)");
-        printf("  Description      : %s\n", lh->description ? lh->description : "(none)");
-        printf("  Make             : %s\n", lh->make ? lh->make : "(unknown)");
-        printf("  Model            : %s\n", lh->model ? lh->model : "(unknown)");
-        printf("  Serial Number    : %s\n", lh->serial_number ? lh->serial_number : "(unknown)");
-        printf("  Physical Size    : %dmm x %dmm\n", lh->physical_width, lh->physical_height);
-        printf("  Enabled          : %s\n", lh->enabled ? "Yes" : "No");
-        printf("  Position         : (%d, %d)\n", lh->pos_x, lh->pos_y);
-        printf("  Transform        : %d\n", lh->transform);
-        printf("  Scale Factor     : %.3f\n", wl_fixed_to_double(lh->scale));
-        printf("  Adaptive Sync    : %s\n", lh->adaptive_sync_state ? "Enabled" : "Disabled");
-        printf("  Available Modes:\n");
-        struct local_mode *lm;
-        wl_list_for_each(lm, &lh->available_modes, link) {
-            const char *status_desc = "Normal";
-            if (lm->status == 'C') status_desc = "Current";
-            else if (lm->status == 'P') status_desc = "Preferred";
-            else if (lm->status == 'B') status_desc = "Current+Preferred";
-
-            printf("    %dx%d @ %dHz [%s]\n",
-                   lm->width,
-                   lm->height,
-                   lm->refresh,
-                   status_desc);
-        }
-        printf("--------------------------------------------------------\n\n");
-    }
+static uint32_t latency_bucket(uint64_t value) {
+	if (value < LATENCY_SUB_BUCKETS) {
+		return value;
+	}
+	uint32_t shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+	return (shift + 1) * LATENCY_SUB_BUCKETS + (uint32_t)(value >> shift) - LATENCY_SUB_BUCKETS;
 }
 
-void free_sop(struct set_output_parser *sop) {
-	if (!sop) return;
-	if (sop->head) {
-		sop->head = NULL;
+// smallest value that falls into the bucket
+static uint64_t latency_bucket_floor(uint32_t bucket) {
+	if (bucket < LATENCY_SUB_BUCKETS) {
+		return bucket;
 	}
-	if (sop->mode) {
-		sop->mode->mode = NULL;
-		free(sop->mode);
-		sop->mode = NULL;
+	uint32_t shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	return (uint64_t)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << shift;
+}
+
+static void latency_record(struct latency_histogram *hist, uint64_t value, int outcome) {
+	if (hist->count == 0 || value < hist->min) {
+		hist->min = value;
 	}
-	if (sop->cmode) {
-		free(sop->cmode);
-		sop->cmode = NULL;
+	if (value > hist->max) {
+		hist->max = value;
 	}
+	hist->count++;
+	hist->sum += value;
+	hist->outcomes[outcome]++;
+	hist->buckets[latency_bucket(value)]++;
+}
 
-	if (sop->pos) {
-		free(sop->pos);
-		sop->pos = NULL;
+// highest value of the bucket holding the p-th percentile
+static uint64_t latency_percentile(const struct latency_histogram *hist, double p) {
+	uint64_t rank = (uint64_t)(p / 100.0 * hist->count + 0.999999);
+	uint64_t seen = 0;
+	for (uint32_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		seen += hist->buckets[bucket];
+		if (seen >= rank && seen > 0) {
+			uint64_t value = bucket + 1 < LATENCY_BUCKETS ? latency_bucket_floor(bucket + 1) - 1 : hist->max;
+			return value < hist->min ? hist->min : value > hist->max ? hist->max : value;
+		}
 	}
+	return hist->max;
+}
 
-	if (sop->transform) {
-		free(sop->transform);
-		sop->transform = NULL;
-	}
-	if (sop->scale) {
-		free(sop->scale);
-		sop->scale = NULL;
-	}
-	if (sop->adaptive_sync) {
-		free(sop->adaptive_sync);
-		sop->adaptive_sync = NULL;
+uint32_t config_request_kinds(struct config_request *req) {
+	uint32_t kinds = 0;
+	struct set_output_parser *sop;
+	wl_list_for_each(sop, &req->changes, link) {
+		kinds |= sop->settings.set;
 	}
-	free(sop);
+	return kinds;
 }
 
-struct command_result * fill_res (struct command_result * res, int cmd, int val, int err){
-	res->command = cmd;
-	res->validity = val;
-	res->error_code = err;
-	res->data = NULL;
-	return res;
+void record_config_latency(struct config_request *req, int outcome) {
+	uint64_t elapsed_us = (monotonic_ns() - req->sent_ns) / 1000;
+	struct latency_histogram *set = req->mode == CONFIG_APPLY ? latency_stats.apply : latency_stats.test;
+	for (int kind = 0; kind < STAT_KINDS; kind++) {
+		if (req->kinds & (1 << kind)) {
+			latency_record(&set[kind], elapsed_us, outcome);
+		}
+	}
 }
 
-void free_res(struct command_result *res) {
-    if (res->data) free_sop(res->data);
-    free(res);
+static void print_latency_rows(const char *request, const struct latency_histogram *set) {
+	for (int kind = 0; kind < STAT_KINDS; kind++) {
+		const struct latency_histogram *hist = &set[kind];
+		if (hist->count == 0) {
+			continue;
+		}
+		printf("%-7s %-13s %6llu %9llu %6llu %9llu %9llu %9llu %9llu %9llu %9llu %9llu\n",
+			request, latency_kind_names[kind],
+			(unsigned long long)hist->count,
+			(unsigned long long)hist->outcomes[OUTCOME_SUCCEEDED],
+			(unsigned long long)hist->outcomes[OUTCOME_FAILED],
+			(unsigned long long)hist->outcomes[OUTCOME_CANCELLED],
+			(unsigned long long)hist->min,
+			(unsigned long long)latency_percentile(hist, 50),
+			(unsigned long long)latency_percentile(hist, 90),
+			(unsigned long long)latency_percentile(hist, 99),
+			(unsigned long long)hist->max,
+			(unsigned long long)(hist->sum / hist->count));
+	}
 }
 
-struct command_result * parse_command(char * cmd){
-
-	struct command_result * res = malloc(sizeof(struct command_result));
-	res->data = NULL;
-	char * param_one = strtok(cmd, " ");
-
-	// CASE - NO COMMAND
-	if (!param_one) {
-		return fill_res(res, 0, 0, 1);
+void handle_print_stats() {
+	int any = 0;
+	for (int kind = 0; kind < STAT_KINDS; kind++) {
+		any |= latency_stats.apply[kind].count || latency_stats.test[kind].count;
 	}
-	
-	// CASE - LIST_OUTPUTS
-	else if (strcmp(param_one,"list_outputs")==0){
-		handle_print_outputs(&heads);
-		return fill_res(res, 1, 1, 0);
+	if (!any) {
+		printf("No configuration results recorded yet\n");
+		return;
 	}
+	printf("Configuration latency, request sent to result (microseconds)\n");
+	printf("%-7s %-13s %6s %9s %6s %9s %9s %9s %9s %9s %9s %9s\n",
+		"request", "property", "count", "succeeded", "failed", "cancelled", "min", "p50", "p90", "p99", "max", "mean");
+	print_latency_rows("apply", latency_stats.apply);
+	print_latency_rows("test", latency_stats.test);
+}
 
-	// CASE - SET_OUTPUT
+// state diffing - at every done the heads are copied into a snapshot and
+// compared with the one taken at the previous done. Heads are matched by id,
+// which unlike the local_head pointer is never reused. Each difference is one
+// line of text; the lines of one done form a change set, the last
+// CHANGE_HISTORY sets are kept for the changes command.
 
-	else if (strcmp(param_one,"set_output")==0){
+static int compare_head_snapshot(const void *a, const void *b) {
+	uint64_t x = ((const struct head_snapshot *)a)->id, y = ((const struct head_snapshot *)b)->id;
+	return (x > y) - (x < y);
+}
 
-		char * param_two = strtok(NULL, " ");
-		if (!param_two){
-			return fill_res(res, 2, 0, 2);
+static int compare_mode_key(const void *a, const void *b) {
+	const struct mode_key *x = a, *y = b;
+	if (x->width != y->width) return x->width < y->width ? -1 : 1;
+	if (x->height != y->height) return x->height < y->height ? -1 : 1;
+	if (x->refresh != y->refresh) return x->refresh < y->refresh ? -1 : 1;
+	return 0;
+}
 
-		} else {
-			int found = 0;
-			struct local_head * lh;
-			wl_list_for_each(lh, &heads, link){
-				if (strcmp(param_two,lh->name)==0 && lh->enabled==1){
-					found = 1;
-					break;
-				}
-			}
-		
-			if (found == 0){
-				return fill_res(res, 2, 0, 3);
-			}
-
-			int num_subcommands = 0;
-			int num_cmd_mode = 0;
-			int num_cmd_cmode = 0;
-			int num_cmd_scale = 0;
-			int num_cmd_transform = 0;
-			int num_cmd_position = 0;
-			int num_cmd_adaptive_sync = 0;
-			struct set_output_parser * sop = malloc(sizeof(struct set_output_parser));
-			
-			memset(sop, 0, sizeof(struct set_output_parser));
-			sop->head = lh;
-
-			while(1){
-
-				char * subcmd = strtok(NULL, " ");
-				char * propval = NULL;
-
-				if (num_subcommands >= MAX_SUBCMDS){
-					free_sop(sop);
-					return fill_res(res, 2, 0, 4);
-				}
-				if (!subcmd && num_subcommands==0){
-					free_sop(sop);
-					return fill_res(res, 2, 0, 5);
-				}
-				else if (! subcmd && num_subcommands > 0){
-					res->command = 2;
-					res->validity = 1;
-					res->error_code = 0;
-					res->data = sop;
-					return res;
-				}
-				else {
-					propval = strtok(NULL, " ");
-					if (!propval){
-						free_sop(sop);
-						return fill_res(res, 2, 0, 6);
-					}
-				}
-				
-
-				if (subcmd && propval){
-
-					num_subcommands++;
-
-					if(strcmp(subcmd, "mode") == 0 ){
-						if ((num_cmd_mode < 1) && (num_cmd_cmode < 1)){
-							struct local_mode * lm;
-							int width, height, refresh;
-							int mode_found = 0;
-							if (sscanf(propval, "%d,%d@%d", &width, &height, &refresh) == 3) {
-								wl_list_for_each(lm, &lh->available_modes, link){
-									if (lm->width == width && lm->height == height && lm->refresh == refresh){
-										sop->mode = malloc(sizeof(struct local_mode_modified));
-										if (sop->mode == NULL) {
-											free_sop(sop);
-											return fill_res(res, 2, 0, 7);
-										}
-										(sop->mode)->mode = lm;
-										(sop->mode)->status = 1;
-										num_cmd_mode++;	
-										mode_found = 1;
-										log_event(log_file_path, 1 , "Valid mode subcommand found\n");
-										break;
-									}
-								}	
-							} else {
-								free_sop(sop);
-								return fill_res(res, 2, 0, 8);
-							}
-
-							if (mode_found == 0){
-								free_sop(sop);
-								return fill_res(res, 2, 0, 8);
-							}
-
-						} 
-						else {
-							free_sop(sop);
-							return fill_res(res, 2, 0, 8);
-						}
-					}
-
-
-					else if(strcmp(subcmd, "cmode") == 0){
-						if(num_cmd_cmode < 1 && num_cmd_mode < 1){
-							struct custom_mode * cmode = malloc(sizeof(struct custom_mode));
-							if (cmode == NULL) {
-								free_sop(sop);
-								return fill_res(res, 2, 0, 7);
-							}
-							if (sscanf(propval, "%d,%d@%d", &cmode->width, &cmode->height, &cmode->refresh) == 3){
-								cmode->status = 1;
-								sop->cmode = cmode;
-								num_cmd_cmode++;
-								log_event(log_file_path, 1 , "Valid custom mode subcommand found\n");
-
-							} else {
-								free_sop(sop);
-								return fill_res(res, 2, 0, 9);
-							}
-						}
-						else {
-							free_sop(sop);
-							return fill_res(res, 2, 0, 9);
-						}
-					}
-
-					else if (strcmp(subcmd, "pos") == 0) {
-						if (num_cmd_position < 1) {
-							struct position *pos = malloc(sizeof(struct position));
-							if (pos == NULL) {
-								free_sop(sop);
-								return fill_res(res, 2, 0, 7);
-							}
-					
-							if (sscanf(propval, "%d,%d", &pos->x, &pos->y) == 2) {
-								pos->status = 1;
-								sop->pos = pos;
-								num_cmd_position++;
-								log_event(log_file_path, 1 , "Valid position subcommand found\n");
-
-							} else {
-								free_sop(sop); 
-								return fill_res(res, 2, 0, 10);
-							}
-
-						} else {
-							free_sop(sop);
-							return fill_res(res, 2, 0, 10);
-						}
-					}
-					
-
-					else if(strcmp(subcmd, "transform") == 0){
-						if (num_cmd_transform < 1){
-							int transform;
-							if (sscanf(propval, "%d", &transform) == 1){
-								if ((transform <= 7) && (transform >= 0)){
-									sop->transform = malloc(sizeof(struct transform));
-									if (sop->transform == NULL) {
-										free_sop(sop);
-										return fill_res(res, 2, 0, 7);
-									}
-									sop->transform->transform = transform;
-									sop->transform->status = 1;
-									num_cmd_transform++;
-									log_event(log_file_path, 1 , "Valid transform subcommand found\n");
-								} else {
-									free_sop(sop);
-									return fill_res(res, 2, 0, 11);
-								}
-							} else {
-								free_sop(sop);
-								return fill_res(res, 2, 0, 11);
-							}
-						}
-						else {
-							free_sop(sop);
-							return fill_res(res, 2, 0, 11);
-						}
-					}
-
-					else if(strcmp(subcmd, "scale") == 0){
-						if (num_cmd_scale < 1) {
-							double scale_value;
-							if (sscanf(propval, "%lf", &scale_value) == 1){
-								if (scale_value > 0.0) { 
-									sop->scale = malloc(sizeof(struct scale));
-									if (sop->scale == NULL) {
-										free_sop(sop);
-										return fill_res(res, 2, 0, 7);
-									}
-									sop->scale->scale = wl_fixed_from_double(scale_value);
-									sop->scale->status = 1;
-									num_cmd_scale++;
-									log_event(log_file_path, 1 , "Valid scale subcommand found\n");
-								} else {
-									free_sop(sop);
-									return fill_res(res, 2, 0, 12);
-								}
-							} else {
-								free_sop(sop);
-								return fill_res(res, 2, 0, 12);
-							}
-						} else {
-							free_sop(sop);
-							return fill_res(res, 2, 0, 12);
-						}
-					}
-
-					else if(strcmp(subcmd, "adaptivesync") == 0){
-						if (num_cmd_adaptive_sync < 1) {
-							uint32_t adaptive_sync_value;
-							if (sscanf(propval, "%d", &adaptive_sync_value) == 1) {
-								if (adaptive_sync_value == 0 || adaptive_sync_value == 1) {
-									sop->adaptive_sync = malloc(sizeof(struct adaptive_sync));
-									if (sop->adaptive_sync == NULL) {
-										free_sop(sop);
-										return fill_res(res, 2, 0, 7);
-									}
-									sop->adaptive_sync->adaptive_sync = adaptive_sync_value;
-									sop->adaptive_sync->status = 1;
-									num_cmd_adaptive_sync++;
-									log_event(log_file_path, 1 , "Valid adaptive sync subcommand found\n");
-								} else {
-									free_sop(sop);
-									return fill_res(res, 2, 0, 13);
-								}
-							} else {
-								free_sop(sop);
-								return fill_res(res, 2, 0, 13);
-							}
-						} else {
-							free_sop(sop);
-							return fill_res(res, 2, 0, 13);
-						}
-					}
-					
-					else {
-						free_sop(sop);
-						return fill_res(res, 2, 0, 6);
-					}
-				}		
-			}
-	 	}
+static int snapshot_take(struct state_snapshot *snap, uint32_t serial) {
+	uint32_t count = 0, mode_count = 0;
+	struct local_head *lh;
+	wl_list_for_each(lh, &heads, link) {
+		count++;
+		mode_count += lh->modes.count;
+	}
+	if (count > snap->capacity) {
+		struct head_snapshot *grown = realloc(snap->heads, count * sizeof(struct head_snapshot));
+		if (!grown) return 0;
+		snap->heads = grown;
+		snap->capacity = count;
+	}
+	if (mode_count > snap->mode_capacity) {
+		struct mode_key *grown = realloc(snap->modes, mode_count * sizeof(struct mode_key));
+		if (!grown) return 0;
+		snap->modes = grown;
+		snap->mode_capacity = mode_count;
 	}
-	
-	else if (strcmp(param_one, "monitor") == 0) {
-		char *param_two = strtok(NULL, " ");
-
-		char line[1024];
-
-		FILE *file = fopen(log_file_path, "r");
-		if (!file) {
-			perror("Error opening log file for reading");
-			return fill_res(res, 3, 0, 15);
-		}
 
-		if (!param_two) {
-			while (fgets(line, sizeof(line), file)) {
-				printf("%s", line);
-			}
-			
-			fclose(file);
-    		return fill_res(res, 3, 1, 0);
-		}
-	
-		else if (strcmp(param_two, "single") == 0) {
-			char timestamp[100]; 
-			char *param_three = strtok(NULL, " ");
-			if (!param_three) {
-				fclose(file);
-				return fill_res(res, 3, 0, 16);
-			}
-	
-			while (fgets(line, sizeof(line), file)) {
-				if (sscanf(line, "[%[^]]]", timestamp) == 1) {
-					if (strcmp(timestamp, param_three) == 0) {
-						printf("%s", line);
-					}
-				}
+	snap->serial = serial;
+	snap->count = 0;
+	snap->mode_count = 0;
+	wl_list_for_each(lh, &heads, link) {
+		struct head_snapshot *hs = &snap->heads[snap->count++];
+		const struct mode_table *modes = &lh->modes;
+		hs->id = lh->id;
+		snprintf(hs->name, sizeof(hs->name), "%s", lh->name ? lh->name : "(unknown)");
+		hs->enabled = lh->enabled;
+		hs->pos_x = lh->pos_x;
+		hs->pos_y = lh->pos_y;
+		hs->transform = lh->transform;
+		hs->scale = lh->scale;
+		hs->adaptive_sync = lh->adaptive_sync_state;
+		hs->current = (struct mode_key){ 0, 0, 0 };
+		hs->first_mode = snap->mode_count;
+		hs->mode_count = modes->count;
+		for (uint32_t row = 0; row < modes->count; row++) {
+			struct mode_key key = { modes->width[row], modes->height[row], modes->refresh[row] };
+			snap->modes[snap->mode_count++] = key;
+			if (modes->flags[row] & MODE_CURRENT) {
+				hs->current = key;
 			}
 		}
-	
-		else if (strcmp(param_two, "period") == 0) {
-			char timestamp[100]; 
-			char *param_three = strtok(NULL, " ");
-			char *param_four = strtok(NULL, " ");
+	}
+	qsort(snap->heads, snap->count, sizeof(struct head_snapshot), compare_head_snapshot);
+	return 1;
+}
 
-			if (!param_three || !param_four) {
-				fclose(file);
-				return fill_res(res, 3, 0, 17); 
-			}
-	
-			while (fgets(line, sizeof(line), file)) {
-				if (sscanf(line, "[%[^]]]", timestamp) == 1) {
-					if (strcmp(timestamp, param_three) >= 0 && strcmp(timestamp, param_four) <= 0) {
-						printf("%s", line);
-					}
-				}
-			}
+static void change_append(struct change_set *set, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int needed = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (needed < 0) {
+		return;
+	}
+	if (set->len + needed + 1 > set->capacity) {
+		size_t capacity = set->capacity ? set->capacity : 256;
+		while (capacity < set->len + needed + 1) {
+			capacity *= 2;
 		}
-	
-		else {
-			fclose(file);
-			return fill_res(res, 3, 0, 14);  
+		char *grown = realloc(set->text, capacity);
+		if (!grown) {
+			return;
 		}
-	
-		fclose(file);
-		return fill_res(res, 3, 1, 0); 
+		set->text = grown;
+		set->capacity = capacity;
 	}
+	va_start(args, format);
+	vsnprintf(set->text + set->len, set->capacity - set->len, format, args);
+	va_end(args);
+	set->len += needed;
+}
 
-	
-	else if (strcmp(param_one, "exit")==0){
-		return fill_res(res, 4, 1, 0);
+static void change_append_mode(struct change_set *set, struct mode_key mode) {
+	if (mode.width == 0 && mode.height == 0) {
+		change_append(set, "none");
+	} else {
+		change_append(set, "%dx%d@%d", mode.width, mode.height, mode.refresh);
 	}
+}
 
-	else {
-		return fill_res(res, 0, 0, 1);
+// the modes that one of the two lists has and the other does not
+static void diff_modes(struct change_set *set, const struct head_snapshot *hs,
+		struct mode_key *old_modes, uint32_t old_count, struct mode_key *new_modes, uint32_t new_count) {
+	if (old_count == new_count && memcmp(old_modes, new_modes, new_count * sizeof(struct mode_key)) == 0) {
+		return;
 	}
+	struct mode_key *sorted = malloc((old_count + new_count) * sizeof(struct mode_key) + 1);
+	if (!sorted) {
+		return;
+	}
+	memcpy(sorted, old_modes, old_count * sizeof(struct mode_key));
+	memcpy(sorted + old_count, new_modes, new_count * sizeof(struct mode_key));
+	qsort(sorted, old_count, sizeof(struct mode_key), compare_mode_key);
+	qsort(sorted + old_count, new_count, sizeof(struct mode_key), compare_mode_key);
+
+	size_t start = set->len;
+	change_append(set, "~ %s modes", hs->name);
+	size_t header = set->len;
+	uint32_t i = 0, j = 0;
+	while (i < old_count || j < new_count) {
+		int cmp = i == old_count ? 1 : j == new_count ? -1 : compare_mode_key(&sorted[i], &sorted[old_count + j]);
+		if (cmp < 0) {
+			change_append(set, " -%dx%d@%d", sorted[i].width, sorted[i].height, sorted[i].refresh);
+			i++;
+		} else if (cmp > 0) {
+			change_append(set, " +%dx%d@%d", sorted[old_count + j].width, sorted[old_count + j].height, sorted[old_count + j].refresh);
+			j++;
+		} else {
+			i++;
+			j++;
+		}
+	}
+	if (set->len == header) {
+		// same modes in another order
+		set->len = start;
+	} else {
+		change_append(set, "\n");
+	}
+	free(sorted);
 }
 
-const char* get_error_message(uint32_t error_code) {
-    switch (error_code) {
-        case 0: return "NO_ERROR";
-        case 1: return "INVALID_MAIN_COMMAND";
-        case 2: return "COMMAND_INCOMPLETE";
-        case 3: return "INVALID_OUTPUT_HEAD";
-        case 4: return "EXCEEDED_MAX_SUBCMDS";
-        case 5: return "NO_SUBCOMMANDS";
-        case 6: return "INVALID_SUBCOMMAND";
-        case 7: return "MEMORY_NOT_ALLOCATED";
-        case 8: return "INVALID_SUBCOMMAND_MODE";
-        case 9: return "INVALID_SUBCOMMAND_CMODE";
-        case 10: return "INVALID_SUBCOMMAND_POS";
-        case 11: return "INVALID_SUBCOMMAND_TRANSFORM";
-        case 12: return "INVALID_SUBCOMMAND_SCALE";
-        case 13: return "INVALID_SUBCOMMAND_ADAPTIVE_SYNC";
-        case 14: return "INVALID_MONITOR_COMMAND";
-        case 15: return "LOG_FILE_ERROR";
-        case 16: return "INVALID_MONITOR_SINGLE";
-        case 17: return "INVALID_MONITOR_PERIOD";
-        case 18: return "INVALID_MONITOR_MULTIPLE";
-        default: return "UNKNOWN_ERROR";
-    }
+static void diff_head(struct change_set *set, struct state_snapshot *old, const struct head_snapshot *a,
+		struct state_snapshot *new, const struct head_snapshot *b) {
+	if (strcmp(a->name, b->name) != 0) {
+		change_append(set, "~ %s name %s -> %s\n", b->name, a->name, b->name);
+	}
+	if (a->enabled != b->enabled) {
+		change_append(set, "~ %s enabled %d -> %d\n", b->name, a->enabled, b->enabled);
+	}
+	if (a->pos_x != b->pos_x || a->pos_y != b->pos_y) {
+		change_append(set, "~ %s position %d,%d -> %d,%d\n", b->name, a->pos_x, a->pos_y, b->pos_x, b->pos_y);
+	}
+	if (a->scale != b->scale) {
+		change_append(set, "~ %s scale %.3f -> %.3f\n", b->name, wl_fixed_to_double(a->scale), wl_fixed_to_double(b->scale));
+	}
+	if (a->transform != b->transform) {
+		change_append(set, "~ %s transform %d -> %d\n", b->name, a->transform, b->transform);
+	}
+	if (a->adaptive_sync != b->adaptive_sync) {
+		change_append(set, "~ %s adaptivesync %u -> %u\n", b->name, a->adaptive_sync, b->adaptive_sync);
+	}
+	if (compare_mode_key(&a->current, &b->current) != 0) {
+		change_append(set, "~ %s mode ", b->name);
+		change_append_mode(set, a->current);
+		change_append(set, " -> ");
+		change_append_mode(set, b->current);
+		change_append(set, "\n");
+	}
+	diff_modes(set, b, old->modes + a->first_mode, a->mode_count, new->modes + b->first_mode, b->mode_count);
 }
 
-	
-
-int main(){
-
-	int lof_file_status = setup_log_file();
-	if (lof_file_status == 0){
-		return -1;
+static void diff_snapshots(struct change_set *set, struct state_snapshot *old, struct state_snapshot *new) {
+	uint32_t i = 0, j = 0;
+	while (i < old->count || j < new->count) {
+		const struct head_snapshot *a = i < old->count ? &old->heads[i] : NULL;
+		const struct head_snapshot *b = j < new->count ? &new->heads[j] : NULL;
+		if (a && (!b || a->id < b->id)) {
+			change_append(set, "- %s\n", a->name);
+			i++;
+		} else if (b && (!a || b->id < a->id)) {
+			change_append(set, "+ %s enabled=%d pos=%d,%d scale=%.3f transform=%d adaptivesync=%u mode=",
+				b->name, b->enabled, b->pos_x, b->pos_y, wl_fixed_to_double(b->scale), b->transform, b->adaptive_sync);
+			change_append_mode(set, b->current);
+			change_append(set, " modes=%u\n", b->mode_count);
+			j++;
+		} else {
+			diff_head(set, old, a, new, b);
+			i++;
+			j++;
+		}
 	}
-	log_event(log_file_path, 1, "Log File set up done in CWD.\n");
+}
 
-	struct wl_display * display = wl_display_connect(NULL);
-	if (!display){
-		log_event(log_file_path, 2, "Connection to Wayland display failed");
-		perror("Connection to wayland display failed");
-		return -1;
+// called at every done: snapshot, diff against the previous one, keep and log the result
+struct change_set * record_state_changes(uint32_t serial) {
+	struct state_snapshot *old = &snapshots[snapshot_current];
+	struct state_snapshot *new = &snapshots[!snapshot_current];
+	if (!snapshot_take(new, serial)) {
+		log_event(log_file_path, 2, "State snapshot - out of memory, changes not recorded\n");
+		return NULL;
 	}
-	log_event(log_file_path, 1 , "Connected to Wayland Socket: %s\n", getenv("WAYLAND_DISPLAY"));
-	wl_list_init(&heads);	
+	snapshot_current = !snapshot_current;
 
-	registry = wl_display_get_registry(display);
-	log_event(log_file_path, 5 , "Local reference to registry - created\n");
-	wl_registry_add_listener(registry, &registry_listener, 0);
-	log_event(log_file_path, 1 , "Local reference to registry - listeners added\n");
+	struct change_set *set = &change_history.sets[change_history.total % CHANGE_HISTORY];
+	set->len = 0;
+	diff_snapshots(set, old, new);
+	if (set->len == 0) {
+		return NULL;
+	}
+	set->serial = serial;
+	set->text[set->len] = '\0';
+	change_history.total++;
+	// a large set goes into several records, cut between lines
+	char *text = set->text;
+	for (size_t left = set->len; left > 0; ) {
+		size_t n = left;
+		if (n > LOG_CHUNK_MAX) {
+			char *cut = memrchr(text, '\n', LOG_CHUNK_MAX);
+			n = cut ? (size_t)(cut - text) + 1 : LOG_CHUNK_MAX;
+		}
+		char saved = text[n];
+		text[n] = '\0';
+		if (text == set->text) {
+			log_event(log_file_path, 1, "Output state changed at serial %u:\n%s", serial, text);
+		} else {
+			log_event(log_file_path, 1, "Output state changed at serial %u, continued:\n%s", serial, text);
+		}
+		text[n] = saved;
+		text += n;
+		left -= n;
+	}
+	return set;
+}
 
-	wl_display_roundtrip(display);
+// the last count change sets, oldest first
+void handle_print_changes(uint32_t count) {
+	if (change_history.total == 0) {
+		printf("No changes recorded yet\n");
+		return;
+	}
+	if (count > change_history.total) {
+		count = change_history.total;
+	}
+	for (uint32_t k = count; k > 0; k--) {
+		struct change_set *set = &change_history.sets[(change_history.total - k) % CHANGE_HISTORY];
+		printf("serial %u\n%s", set->serial, set->text);
+	}
+}
 
-	char input[256];
-	while(1){
-		wl_display_roundtrip(display);
-		wl_display_roundtrip(display);
+// arena - everything a head owns (the local_head itself, its strings and its
+// mode table) is carved out of fixed size blocks chained to the head. When the
+// head goes away its blocks go back to a global pool in one splice, so
+// hotplug reuses memory instead of going through malloc/free per field.
+// Requests bigger than a block get their own allocation.
 
-		printf("$ " );
-
-		if (fgets(input, sizeof(input), stdin)!=NULL){
-			input[strcspn(input, "\n")] = '\0';
-			struct command_result * cmd = parse_command(input);
-
-			if (cmd->validity == 0) {
-				log_event(log_file_path, 1, "Invalid Command");
-				log_event(log_file_path, 7, "Error: %s", get_error_message(cmd->error_code));
-				perror("Invalid Command\n");
-			}
-
-			else if (cmd->command == 1){
-				log_event(log_file_path, 1, "List Output command received");
-				log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
-			}
-
-			else if (cmd->command == 2){
-				log_event(log_file_path, 1, "Set Output command received");
-				struct set_output_parser * sop = cmd->data;
-				struct local_head *lh = sop->head;
-
-				configuration_object = zwlr_output_manager_v1_create_configuration(output_manager, current_serial);
-				log_event(log_file_path, 5 , "SENT: zwlr_output_manager_v1 - create_configuration\n");
-				zwlr_output_configuration_v1_add_listener(configuration_object, &configuration_object_listener, 0);
-				log_event(log_file_path, 1 , "Local reference to configuration object - created\n");
-				log_event(log_file_path, 1 , "Local reference to configuration object - listeners added\n");
-
-
-				if (lh->enabled){
-					lh->head_config = zwlr_output_configuration_v1_enable_head(configuration_object, lh->head);
-					log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_v1 - enable_head\n");
-					log_event(log_file_path, 1 , "Local reference to head config - created\n");
-
-					if (sop->mode){
-						if (sop->mode->status == 1){
-							zwlr_output_configuration_head_v1_set_mode(lh->head_config, sop->mode->mode->mode);
-							log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_mode\n");
-						}
-					}
-
-					if (sop->pos){
-						if (sop->pos->status == 1){
-							zwlr_output_configuration_head_v1_set_position(lh->head_config, sop->pos->x, sop->pos->y);
-							log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_position\n");
-						}
-					}
-
-					if (sop->cmode){
-						if (sop->cmode->status == 1){
-							zwlr_output_configuration_head_v1_set_custom_mode(lh->head_config, sop->cmode->width, sop->cmode->height, sop->cmode->refresh);
-							log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_custom_mode\n");
-						}
-					}
-
-					if (sop->transform){
-						if (sop->transform->status == 1){
-							zwlr_output_configuration_head_v1_set_transform(lh->head_config, sop->transform->transform);
-							log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_transform\n");
-						}
-					}
-					if (sop->scale){
-						if (sop->scale->status == 1){
-							zwlr_output_configuration_head_v1_set_scale(lh->head_config, sop->scale->scale);
-							log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_scale\n");
-						}
-					}
-					if (sop->adaptive_sync){
-						if (sop->adaptive_sync->status == 1){
-							zwlr_output_configuration_head_v1_set_adaptive_sync(lh->head_config, sop->adaptive_sync->adaptive_sync);
-							log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_adaptive_sync\n");
-						}
-					}
-
-					zwlr_output_configuration_v1_apply(configuration_object);
-					log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_v1 - apply\n");
-					wl_display_roundtrip(display);
-				}
-			}
+static struct arena_block * arena_pool;
 
-			else if (cmd->command == 3){
-				log_event(log_file_path, 1, "Monitor command received");
-				log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
-			}
+void * arena_alloc(struct arena *arena, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
 
-			else if (cmd->command == 4){
-				log_event(log_file_path, 1, "Exit command received");
-				log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
-				break;
-			}
+	if (size > ARENA_BLOCK_SIZE - sizeof(struct arena_block)) {
+		struct arena_block *large = malloc(sizeof(struct arena_block) + size);
+		if (!large) {
+			return NULL;
+		}
+		large->next = arena->large;
+		large->used = size;
+		arena->large = large;
+		return large->data;
+	}
 
-			else {
-				log_event(log_file_path, 1, "Invalid command");
-				perror("Please type 'exit' to exit the program");
+	struct arena_block *block = arena->blocks;
+	if (!block || block->used + size > ARENA_BLOCK_SIZE - sizeof(struct arena_block)) {
+		block = arena_pool;
+		if (block) {
+			arena_pool = block->next;
+		} else {
+			block = malloc(ARENA_BLOCK_SIZE);
+			if (!block) {
+				return NULL;
 			}
-
 		}
+		block->used = 0;
+		block->next = arena->blocks;
+		if (!arena->blocks) {
+			arena->last = block;
+		}
+		arena->blocks = block;
 	}
+	void *ptr = block->data + block->used;
+	block->used += size;
+	return ptr;
+}
 
-	// CLEAN UP
+char * arena_strdup(struct arena *arena, const char *str) {
+	size_t len = strlen(str) + 1;
+	char *copy = arena_alloc(arena, len);
+	if (copy) {
+		memcpy(copy, str, len);
+	}
+	return copy;
+}
 
-	log_event(log_file_path, 1, "Cleaning up...\n");
-	
+// The arena usually lives in one of its own blocks, so it is copied out
+// before anything is handed back.
 
-	struct local_head *lh, *tmp_lh;
-	wl_list_for_each_safe(lh, tmp_lh, &heads, link) {
-		if(lh->name){
-			free(lh->name);
-		}
-		if(lh->description){
-			free(lh->description);
-		}
-		if(lh->make){
-			free(lh->make);
-		}
-		if(lh->model){
-			free(lh->model);
-		}
-		if(lh->serial_number){
-			free(lh->serial_number);
-		}
-		if (lh->head) {
-			zwlr_output_head_v1_release(lh->head);
-			log_event(log_file_path, 5, "SENT: zwlr_output_head_v1 - release\n");
-		}
-		if(lh->head_config){
-			lh->head_config = NULL;
-		}
+void arena_release(struct arena *arena) {
+	struct arena released = *arena;
+	while (released.large) {
+		struct arena_block *next = released.large->next;
+		free(released.large);
+		released.large = next;
+	}
+	if (released.blocks) {
+		released.last->next = arena_pool;
+		arena_pool = released.blocks;
+	}
+}
 
-		struct local_mode *lm, *tmp_lm;
-		wl_list_for_each_safe(lm, tmp_lm, &lh->available_modes, link) {
-			zwlr_output_mode_v1_release(lm->mode);
-			log_event(log_file_path, 5, "SENT: zwlr_output_mode_v1 - release\n");
-			wl_list_remove(&lm->link);
-			free(lm);
-			log_event(log_file_path, 1 , "Local reference to mode - freed\n");
-		}
+// gives the pooled blocks back to the system
 
-		wl_list_remove(&lh->link);
-		free(lh);
-		log_event(log_file_path, 1 , "Local reference to head - freed\n");
+void arena_pool_reset() {
+	while (arena_pool) {
+		struct arena_block *next = arena_pool->next;
+		free(arena_pool);
+		arena_pool = next;
 	}
+}
 
-	if (configuration_object){
-		zwlr_output_configuration_v1_destroy(configuration_object);
-		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_v1 - destroy\n");
-		configuration_object = NULL;
+// releases the proxies of a head and everything allocated for it
+
+void free_head(struct local_head *lh) {
+	transaction_forget_head(lh);
+	head_index_remove(&heads_by_name, lh->name, lh);
+	head_index_remove(&heads_by_identity, lh->identity, lh);
+	mode_table_release(&lh->modes);
+	if (lh->head){
+		zwlr_output_head_v1_release(lh->head);
+		log_event(log_file_path, 5, "SENT: zwlr_output_head_v1 - release\n");
+	}
+	wl_list_remove(&lh->link);
+	arena_release(&lh->arena);
+	log_event(log_file_path, 1 , "Local reference to head - freed\n");
+}
+
+void free_all_heads() {
+	struct local_head *lh, *tmp_lh;
+	wl_list_for_each_safe(lh, tmp_lh, &heads, link) {
+		free_head(lh);
+	}
+	head_index_clear(&heads_by_name);
+	head_index_clear(&heads_by_identity);
+	arena_pool_reset();
+}
+
+// mode table - the modes of a head as a struct of arrays in one block, in the
+// order they were advertised, so that listing and matching scan contiguous
+// memory. An exact (width, height, refresh) match goes through a small open
+// addressing table of row numbers, rebuilt lazily after the modes changed.
+
+static int mode_table_grow(struct mode_table *table) {
+	uint32_t capacity = table->capacity ? table->capacity * 2 : MODE_TABLE_MIN_CAPACITY;
+	size_t size = capacity * (3 * sizeof(int32_t) + sizeof(struct zwlr_output_mode_v1 *) + sizeof(uint8_t));
+	char *block = arena_alloc(table->arena, size);
+	if (!block) {
+		return 0;
+	}
+
+	// pointers first so every array stays naturally aligned
+	struct zwlr_output_mode_v1 **proxy = (struct zwlr_output_mode_v1 **)block;
+	int32_t *width = (int32_t *)(proxy + capacity);
+	int32_t *height = width + capacity;
+	int32_t *refresh = height + capacity;
+	uint8_t *flags = (uint8_t *)(refresh + capacity);
+	if (table->count) {
+		memcpy(proxy, table->proxy, table->count * sizeof(*proxy));
+		memcpy(width, table->width, table->count * sizeof(*width));
+		memcpy(height, table->height, table->count * sizeof(*height));
+		memcpy(refresh, table->refresh, table->count * sizeof(*refresh));
+		memcpy(flags, table->flags, table->count * sizeof(*flags));
+	}
+
+	table->proxy = proxy;
+	table->width = width;
+	table->height = height;
+	table->refresh = refresh;
+	table->flags = flags;
+	table->capacity = capacity;
+	return 1;
+}
+
+int mode_table_add(struct mode_table *table, struct zwlr_output_mode_v1 *mode) {
+	if (table->count == table->capacity && !mode_table_grow(table)) {
+		return -1;
+	}
+	uint32_t row = table->count++;
+	table->proxy[row] = mode;
+	table->width[row] = 0;
+	table->height[row] = 0;
+	table->refresh[row] = 0;
+	table->flags[row] = 0;
+	table->slots_valid = 0;
+	table->last = row;
+	return row;
+}
+
+// Mode events carry the proxy, not the row. They nearly always follow the
+// head's mode event for the same mode, so the last row touched is tried first.
+
+int mode_table_row(struct mode_table *table, struct zwlr_output_mode_v1 *mode) {
+	if (table->last < table->count && table->proxy[table->last] == mode) {
+		return table->last;
+	}
+	for (uint32_t row = 0; row < table->count; row++) {
+		if (table->proxy[row] == mode) {
+			table->last = row;
+			return row;
+		}
+	}
+	return -1;
+}
+
+void mode_table_remove(struct mode_table *table, uint32_t row) {
+	uint32_t tail = table->count - row - 1;
+	memmove(table->proxy + row, table->proxy + row + 1, tail * sizeof(*table->proxy));
+	memmove(table->width + row, table->width + row + 1, tail * sizeof(*table->width));
+	memmove(table->height + row, table->height + row + 1, tail * sizeof(*table->height));
+	memmove(table->refresh + row, table->refresh + row + 1, tail * sizeof(*table->refresh));
+	memmove(table->flags + row, table->flags + row + 1, tail * sizeof(*table->flags));
+	table->count--;
+	table->slots_valid = 0;
+}
+
+void mode_table_set_current(struct mode_table *table, uint32_t row) {
+	for (uint32_t i = 0; i < table->count; i++) {
+		table->flags[i] &= ~MODE_CURRENT;
+	}
+	table->flags[row] |= MODE_CURRENT;
+}
+
+static uint32_t mode_key_hash(int32_t width, int32_t height, int32_t refresh) {
+	uint64_t key = ((uint64_t)(uint32_t)width << 32 | (uint32_t)height) ^ ((uint64_t)(uint32_t)refresh * 0x9E3779B97F4A7C15ULL);
+	key *= 0xBF58476D1CE4E5B9ULL;
+	return key >> 32;
+}
+
+static int mode_table_index(struct mode_table *table) {
+	uint32_t slots = MODE_TABLE_MIN_CAPACITY;
+	while (slots < table->count * 2) {
+		slots *= 2;
+	}
+	if (slots - 1 != table->slot_mask || !table->slots) {
+		table->slots = arena_alloc(table->arena, slots * sizeof(uint32_t));
+		if (!table->slots) {
+			return 0;
+		}
+		table->slot_mask = slots - 1;
+	}
+	memset(table->slots, 0, slots * sizeof(uint32_t));
+
+	// inserted from the last row down, so that the first of duplicate modes wins
+	for (uint32_t row = table->count; row-- > 0;) {
+		uint32_t i = mode_key_hash(table->width[row], table->height[row], table->refresh[row]) & table->slot_mask;
+		while (table->slots[i]) {
+			uint32_t other = table->slots[i] - 1;
+			if (table->width[other] == table->width[row] && table->height[other] == table->height[row] && table->refresh[other] == table->refresh[row]) {
+				break;
+			}
+			i = (i + 1) & table->slot_mask;
+		}
+		table->slots[i] = row + 1;
+	}
+	table->slots_valid = 1;
+	return 1;
+}
+
+int mode_table_find(struct mode_table *table, int32_t width, int32_t height, int32_t refresh) {
+	if (!table->slots_valid && !mode_table_index(table)) {
+		return -1;
+	}
+	uint32_t i = mode_key_hash(width, height, refresh) & table->slot_mask;
+	for (; table->slots[i]; i = (i + 1) & table->slot_mask) {
+		uint32_t row = table->slots[i] - 1;
+		if (table->width[row] == width && table->height[row] == height && table->refresh[row] == refresh) {
+			return row;
+		}
+	}
+	return -1;
+}
+
+// releases every mode proxy still held, the memory goes with the head arena
+
+void mode_table_release(struct mode_table *table) {
+	for (uint32_t row = 0; row < table->count; row++) {
+		zwlr_output_mode_v1_release(table->proxy[row]);
+		log_event(log_file_path, 5, "SENT: zwlr_output_mode_v1 - release\n");
+	}
+	table->count = 0;
+}
+
+// head index - open addressing with linear probing over FNV-1a hashes, one
+// table by connector name and one by "make|model|serial". Entries point at
+// the key string owned by the head, so a key is removed before it is freed.
+
+uint64_t hash_string(const char *str) {
+	uint64_t hash = 14695981039346656037ULL;
+	while (*str) {
+		hash = (hash ^ (unsigned char)*str++) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Returns 0, leaving the table as it was, if the new one cannot be allocated.
+static int head_index_resize(struct head_index *index, uint32_t capacity) {
+	struct head_index_entry *old = index->entries;
+	uint32_t old_capacity = index->capacity;
+
+	struct head_index_entry *entries = calloc(capacity, sizeof(struct head_index_entry));
+	if (!entries) {
+		return 0;
+	}
+	index->entries = entries;
+	index->capacity = capacity;
+	index->count = 0;
+	index->used = 0;
+	for (uint32_t i = 0; i < old_capacity; i++) {
+		if (old[i].head && old[i].head != HEAD_INDEX_TOMBSTONE) {
+			head_index_insert(index, old[i].key, old[i].head);
+		}
+	}
+	free(old);
+	return 1;
+}
+
+int head_index_insert(struct head_index *index, const char *key, struct local_head *lh) {
+	if (!key) {
+		return 0;
+	}
+	// keep at least a quarter of the slots empty, tombstones count as used
+	if ((index->used + 1) * 4 > index->capacity * 3) {
+		uint32_t capacity = index->capacity ? index->capacity : HEAD_INDEX_MIN_CAPACITY;
+		while ((index->count + 1) * 2 > capacity) {
+			capacity *= 2;
+		}
+		// without a larger table, go on while a slot stays empty to end probes
+		if (!head_index_resize(index, capacity) && index->used + 2 > index->capacity) {
+			return 0;
+		}
+	}
+
+	uint64_t hash = hash_string(key);
+	uint32_t mask = index->capacity - 1;
+	uint32_t i = hash & mask;
+	while (index->entries[i].head && index->entries[i].head != HEAD_INDEX_TOMBSTONE) {
+		i = (i + 1) & mask;
+	}
+	if (!index->entries[i].head) {
+		index->used++;
+	}
+	index->entries[i].hash = hash;
+	index->entries[i].key = key;
+	index->entries[i].head = lh;
+	index->count++;
+	return 1;
+}
+
+void head_index_remove(struct head_index *index, const char *key, struct local_head *lh) {
+	if (!key || !index->capacity) {
+		return;
+	}
+	uint64_t hash = hash_string(key);
+	uint32_t mask = index->capacity - 1;
+	for (uint32_t i = hash & mask; index->entries[i].head; i = (i + 1) & mask) {
+		if (index->entries[i].head == lh && index->entries[i].hash == hash) {
+			index->entries[i].head = HEAD_INDEX_TOMBSTONE;
+			index->entries[i].key = NULL;
+			index->count--;
+			return;
+		}
+	}
+}
+
+struct local_head * head_index_find(struct head_index *index, const char *key) {
+	if (!index->capacity) {
+		return NULL;
+	}
+	uint64_t hash = hash_string(key);
+	uint32_t mask = index->capacity - 1;
+	for (uint32_t i = hash & mask; index->entries[i].head; i = (i + 1) & mask) {
+		struct head_index_entry *entry = &index->entries[i];
+		if (entry->head != HEAD_INDEX_TOMBSTONE && entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry->head;
+		}
+	}
+	return NULL;
+}
+
+// Like head_index_find(), for keys several heads can share: NULL with
+// *ambiguous set if more than one head has the key, as two identical monitors
+// without a serial number have the same make|model|serial.
+struct local_head * head_index_find_unique(struct head_index *index, const char *key, int *ambiguous) {
+	struct local_head *found = NULL;
+	*ambiguous = 0;
+	if (!index->capacity) {
+		return NULL;
+	}
+	uint64_t hash = hash_string(key);
+	uint32_t mask = index->capacity - 1;
+	for (uint32_t i = hash & mask; index->entries[i].head; i = (i + 1) & mask) {
+		struct head_index_entry *entry = &index->entries[i];
+		if (entry->head != HEAD_INDEX_TOMBSTONE && entry->hash == hash && strcmp(entry->key, key) == 0) {
+			if (found && found != entry->head) {
+				*ambiguous = 1;
+				return NULL;
+			}
+			found = entry->head;
+		}
+	}
+	return found;
+}
+
+void head_index_clear(struct head_index *index) {
+	free(index->entries);
+	memset(index, 0, sizeof(struct head_index));
+}
+
+// rebuilds the "make|model|serial" key after one of its parts changed
+
+void head_update_identity(struct local_head *lh) {
+	head_index_remove(&heads_by_identity, lh->identity, lh);
+
+	const char *make = lh->make ? lh->make : "";
+	const char *model = lh->model ? lh->model : "";
+	const char *serial = lh->serial_number ? lh->serial_number : "";
+	size_t len = strlen(make) + strlen(model) + strlen(serial) + 3;
+	lh->identity = arena_alloc(&lh->arena, len);
+	if (lh->identity) {
+		snprintf(lh->identity, len, "%s|%s|%s", make, model, serial);
+		if (!head_index_insert(&heads_by_identity, lh->identity, lh)) {
+			log_event(log_file_path, 2, "Head index - identity not indexed, memory not allocated\n");
+		}
+	}
+}
+
+// a head is named by its connector (DP-1) or by "make|model|serial"; the
+// latter is ambiguous (NULL, *ambiguous set) when several heads share it
+
+struct local_head * find_head(const char *name, int *ambiguous) {
+	struct local_head *lh = head_index_find(&heads_by_name, name);
+	*ambiguous = 0;
+	if (!lh) {
+		lh = head_index_find_unique(&heads_by_identity, name, ambiguous);
+	}
+	return lh;
+}
+
+// the name a head is found by again after it went away: its identity, unless
+// another head shares it
+static const char * head_lookup_name(struct local_head *lh) {
+	int ambiguous;
+	if (lh->identity && (head_index_find_unique(&heads_by_identity, lh->identity, &ambiguous) || !ambiguous)) {
+		return lh->identity;
+	}
+	return lh->name;
+}
+
+// tokenizer - splits a command line in place, each token is NUL terminated
+// and keeps its length. A "double quoted" token may contain spaces, so a make
+// or model containing spaces can be typed. Returns 0 at the end of the line.
+
+int next_token(struct tokenizer *tk, struct token *token) {
+	char *c = tk->cursor;
+	if (!c) {
+		return 0;
+	}
+	while (*c == ' ' || *c == '\t') {
+		c++;
+	}
+	if (*c == '\0') {
+		tk->cursor = NULL;
+		return 0;
+	}
+	char *end;
+	if (*c == '"') {
+		token->text = ++c;
+		end = strchr(c, '"');
+		if (!end) {
+			end = c + strlen(c);
+		}
+	} else {
+		token->text = c;
+		end = c + strcspn(c, " \t");
+	}
+	token->len = end - token->text;
+	tk->cursor = *end ? end + 1 : NULL;
+	*end = '\0';
+	return 1;
+}
+
+// Keywords are told apart by length and first letter, then confirmed with
+// one compare; the switch is resolved at compile time.
+
+#define KEYWORD_KEY(len, first) ((len) << 8 | (unsigned char)(first))
+
+static int keyword_is(const struct token *token, const char *text, int keyword) {
+	return memcmp(token->text, text, token->len) == 0 ? keyword : KEYWORD_NONE;
+}
+
+int keyword_lookup(const struct token *token) {
+	if (token->len == 0 || token->len > 12) {
+		return KEYWORD_NONE;
+	}
+	switch (KEYWORD_KEY(token->len, token->text[0])) {
+		case KEYWORD_KEY(12, 'l'): return keyword_is(token, "list_outputs", KEYWORD_LIST_OUTPUTS);
+		case KEYWORD_KEY(10, 's'): return keyword_is(token, "set_output", KEYWORD_SET_OUTPUT);
+		case KEYWORD_KEY(11, 't'): return keyword_is(token, "test_output", KEYWORD_TEST_OUTPUT);
+		case KEYWORD_KEY(7, 'm'): return keyword_is(token, "monitor", KEYWORD_MONITOR);
+		case KEYWORD_KEY(5, 'b'): return keyword_is(token, "begin", KEYWORD_BEGIN);
+		case KEYWORD_KEY(6, 'c'): return keyword_is(token, "commit", KEYWORD_COMMIT);
+		case KEYWORD_KEY(5, 'a'): return keyword_is(token, "abort", KEYWORD_ABORT);
+		case KEYWORD_KEY(7, 'c'): return keyword_is(token, "changes", KEYWORD_CHANGES);
+		case KEYWORD_KEY(5, 'w'): return keyword_is(token, "watch", KEYWORD_WATCH);
+		case KEYWORD_KEY(7, 'u'): return keyword_is(token, "unwatch", KEYWORD_UNWATCH);
+		case KEYWORD_KEY(5, 's'):
+			return token->text[1] == 't' ? keyword_is(token, "stats", KEYWORD_STATS) : keyword_is(token, "scale", KEYWORD_SCALE);
+		case KEYWORD_KEY(8, 'p'): return keyword_is(token, "profiles", KEYWORD_PROFILES);
+		case KEYWORD_KEY(4, 'e'): return keyword_is(token, "exit", KEYWORD_EXIT);
+		case KEYWORD_KEY(4, 'm'): return keyword_is(token, "mode", KEYWORD_MODE);
+		case KEYWORD_KEY(5, 'c'): return keyword_is(token, "cmode", KEYWORD_CMODE);
+		case KEYWORD_KEY(3, 'p'): return keyword_is(token, "pos", KEYWORD_POS);
+		case KEYWORD_KEY(9, 't'): return keyword_is(token, "transform", KEYWORD_TRANSFORM);
+		case KEYWORD_KEY(12, 'a'): return keyword_is(token, "adaptivesync", KEYWORD_ADAPTIVE_SYNC);
+		case KEYWORD_KEY(7, 'e'): return keyword_is(token, "enabled", KEYWORD_ENABLED);
+		case KEYWORD_KEY(6, 's'): return keyword_is(token, "single", KEYWORD_SINGLE);
+		case KEYWORD_KEY(6, 'p'): return keyword_is(token, "period", KEYWORD_PERIOD);
+		case KEYWORD_KEY(5, 'r'): return keyword_is(token, "reset", KEYWORD_RESET);
+		case KEYWORD_KEY(6, '-'): return keyword_is(token, "--json", KEYWORD_JSON);
+		case KEYWORD_KEY(9, '-'): return keyword_is(token, "--compact", KEYWORD_COMPACT);
+		case KEYWORD_KEY(7, 'p'): return keyword_is(token, "profile", KEYWORD_PROFILE);
+		case KEYWORD_KEY(6, 'o'): return keyword_is(token, "output", KEYWORD_OUTPUT);
+		case KEYWORD_KEY(7, 'r'): return keyword_is(token, "results", KEYWORD_RESULTS);
+		case KEYWORD_KEY(4, 'w'): return keyword_is(token, "wait", KEYWORD_WAIT);
+		case KEYWORD_KEY(9, 'c'): return keyword_is(token, "connector", KEYWORD_CONNECTOR);
+	}
+	return KEYWORD_NONE;
+}
+
+// Decimal integer at the start of [s, end), returns the end of its digits or
+// NULL if there are none or the value does not fit an int32_t.
+static const char * scan_int(const char *s, const char *end, int32_t *value) {
+	int negative = s < end && *s == '-';
+	if (s < end && (*s == '-' || *s == '+')) {
+		s++;
+	}
+	const char *digits = s;
+	int64_t v = 0;
+	for (; s < end && *s >= '0' && *s <= '9'; s++) {
+		v = v * 10 + (*s - '0');
+		if (v > (int64_t)INT32_MAX + negative) {
+			return NULL;
+		}
+	}
+	if (s == digits) {
+		return NULL;
+	}
+	*value = negative ? -v : v;
+	return s;
+}
+
+// an integer that is the whole of the len characters at s
+int parse_int(const char *s, size_t len, int32_t *value) {
+	return scan_int(s, s + len, value) == s + len;
+}
+
+// "A<sep>B" as two integers, e.g. the 0,0 of a position
+static int parse_int_pair(const char *s, size_t len, char sep, int32_t *a, int32_t *b) {
+	const char *end = s + len;
+	s = scan_int(s, end, a);
+	return s && s < end && *s == sep && scan_int(s + 1, end, b) == end;
+}
+
+// "W,H@R" of a mode
+static int parse_mode(const char *s, size_t len, int32_t *width, int32_t *height, int32_t *refresh) {
+	const char *end = s + len;
+	const char *at = memchr(s, '@', len);
+	return at && parse_int_pair(s, at - s, ',', width, height) && scan_int(at + 1, end, refresh) == end;
+}
+
+// Decimal number into wl_fixed_t (24.8), rounded to the nearest 1/256.
+// Digits past the ninth decimal do not change the result and are skipped.
+int parse_fixed(const char *s, size_t len, wl_fixed_t *value) {
+	const char *end = s + len;
+	int32_t whole = 0;
+	int negative = s < end && *s == '-';
+	const char *c = s < end && *s == '.' ? s : scan_int(s, end, &whole);
+	if (!c || whole > (1 << 23) - 1 || whole < -(1 << 23)) {
+		return 0;
+	}
+	int64_t fraction = 0, scale = 1;
+	if (c < end && *c == '.') {
+		const char *digits = ++c;
+		for (; c < end && *c >= '0' && *c <= '9'; c++) {
+			if (scale < 1000000000) {
+				fraction = fraction * 10 + (*c - '0');
+				scale *= 10;
+			}
+		}
+		if (c == digits && digits - 1 == s) {
+			return 0;
+		}
+	}
+	if (c != end) {
+		return 0;
+	}
+	int64_t magnitude = (int64_t)(negative ? -whole : whole) * 256 + (fraction * 256 + scale / 2) / scale;
+	if (magnitude > INT32_MAX) {
+		return 0;
+	}
+	*value = negative ? -magnitude : magnitude;
+	return 1;
+}
+
+int setup_log_file() {
+    char dir[128];
+    if (getcwd(dir, sizeof(dir)) != NULL) {
+        snprintf(log_file_path, sizeof(log_file_path), "%s/%s", dir, LOG_FILE_NAME);
+		snprintf(log_index_path, sizeof(log_index_path), "%s.idx", log_file_path);
+		snprintf(log_defs_path, sizeof(log_defs_path), "%s.defs", log_file_path);
+		return 1;
+    } else {
+        perror("Error with setting up log file");
+		return 0;
+    }
+}
+
+static int64_t days_from_civil(int64_t y, int64_t m, int64_t d) {
+	y -= m <= 2;
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t yoe = y - era * 400;
+	int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+// Turns "YYYY-MM-DD::HH:MM:SS", optionally followed by '.' and 1 to 9 digits of
+// a fraction, into a key that sorts like the timestamp (nanoseconds, the
+// fields are taken as UTC). span is how many nanoseconds the timestamp covers:
+// a whole second without a fraction, 100 ms for ".5". Returns 0 if malformed.
+int parse_timestamp_key(const char *timestamp, size_t len, int64_t *key, int64_t *span) {
+	static const char pattern[] = "dddd-dd-dd::dd:dd:dd";
+	int v[LOG_TIMESTAMP_LEN];
+	if (len < LOG_TIMESTAMP_LEN || len == LOG_TIMESTAMP_LEN + 1 || len > LOG_TIMESTAMP_MAX) {
+		return 0;
+	}
+	for (int i = 0; i < LOG_TIMESTAMP_LEN; i++) {
+		if (pattern[i] == 'd') {
+			if (timestamp[i] < '0' || timestamp[i] > '9') {
+				return 0;
+			}
+			v[i] = timestamp[i] - '0';
+		} else if (timestamp[i] != pattern[i]) {
+			return 0;
+		}
+	}
+	int64_t nanoseconds = 0;
+	*span = 1000000000LL;
+	if (len > LOG_TIMESTAMP_LEN) {
+		if (timestamp[LOG_TIMESTAMP_LEN] != '.') {
+			return 0;
+		}
+		for (size_t i = LOG_TIMESTAMP_LEN + 1; i < len; i++) {
+			if (timestamp[i] < '0' || timestamp[i] > '9') {
+				return 0;
+			}
+			*span /= 10;
+			nanoseconds += (timestamp[i] - '0') * *span;
+		}
+	}
+	int64_t year = v[0] * 1000 + v[1] * 100 + v[2] * 10 + v[3];
+	int64_t month = v[5] * 10 + v[6];
+	int64_t day = v[8] * 10 + v[9];
+	int64_t hour = v[12] * 10 + v[13];
+	int64_t minute = v[15] * 10 + v[16];
+	int64_t second = v[18] * 10 + v[19];
+	int64_t seconds = days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+	*key = seconds * 1000000000LL + nanoseconds;
+	return 1;
+}
+
+// The key of the local time now. It is read from CLOCK_MONOTONIC, anchored to
+// the local wall clock (CLOCK_REALTIME and localtime()) once every
+// LOG_CLOCK_REFRESH_NS, so keys never go back between two anchorings. A small
+// step back of the wall clock at an anchoring is held off too; a large one
+// (clock set, daylight saving time) is followed.
+static int64_t log_timestamp_key() {
+	static int64_t offset;
+	static int64_t anchor_due = INT64_MIN;
+	static int64_t last_key = INT64_MIN;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t monotonic = now.tv_sec * 1000000000LL + now.tv_nsec;
+	if (monotonic >= anchor_due) {
+		struct timespec real;
+		struct tm tm_info;
+		clock_gettime(CLOCK_REALTIME, &real);
+		localtime_r(&real.tv_sec, &tm_info);
+		int64_t seconds = days_from_civil(tm_info.tm_year + 1900, tm_info.tm_mon + 1, tm_info.tm_mday) * 86400
+			+ tm_info.tm_hour * 3600 + tm_info.tm_min * 60 + tm_info.tm_sec;
+		offset = seconds * 1000000000LL + real.tv_nsec - monotonic;
+		anchor_due = monotonic + LOG_CLOCK_REFRESH_NS;
+	}
+	int64_t key = monotonic + offset;
+	if (key < last_key && last_key - key < LOG_CLOCK_STEP_NS) {
+		key = last_key;
+	}
+	last_key = key;
+	return key;
+}
+
+// Opens the binary log for appending and takes the writer lock on it, starting
+// it with LOG_FILE_MAGIC if it is new. Returns -1 if it cannot be opened, is
+// not a log of this program (errno EINVAL) or another process writes it
+// (errno EWOULDBLOCK).
+static int log_file_open(const char *path) {
+	int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	char magic[LOG_FILE_MAGIC_LEN];
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		if (write(fd, LOG_FILE_MAGIC, LOG_FILE_MAGIC_LEN) != LOG_FILE_MAGIC_LEN) {
+			close(fd);
+			return -1;
+		}
+	} else if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)) != 0) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	return fd;
+}
+
+// Opens the log this process writes, once; the lock is held until the process
+// exits, so the log, its index and its definitions have one writer only and
+// format and string ids never mix between runs. While another process holds
+// log.bin, this one writes log.bin.<pid> and its own sidecars instead.
+static int log_claim(const char *log_file) {
+	if (log_ring.claimed) {
+		return log_ring.fd;
+	}
+	int fd = log_file_open(log_file);
+	if (fd < 0 && errno == EWOULDBLOCK) {
+		char path[sizeof(log_file_path)];
+		if (snprintf(path, sizeof(path), "%s.%d", log_file, (int)getpid()) >= (int)sizeof(path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(log_file_path, path, sizeof(path));
+		snprintf(log_index_path, sizeof(log_index_path), "%s.idx", log_file_path);
+		snprintf(log_defs_path, sizeof(log_defs_path), "%s.defs", log_file_path);
+		fd = log_file_open(log_file_path);
+		if (fd >= 0) {
+			fprintf(stderr, "Log file in use by another process, logging to %s\n", log_file_path);
+		}
+	}
+	if (fd >= 0) {
+		log_ring.fd = fd;
+		log_ring.claimed = 1;
+	}
+	return fd;
+}
+
+static int log_record_valid(const struct log_record *record) {
+	return record->kind <= LOG_RECORD_STRING && record->size % 8 == 0;
+}
+
+// log index - maintained by the writer thread while it writes records
+
+static void log_index_append(int fd, const void *entries, size_t len) {
+	const char *data = entries;
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error writing log index");
+			return;
+		}
+		data += written;
+		len -= written;
+	}
+}
+
+// writes out the batch, definitions first so that no index entry is ever
+// ahead of the definitions its records need
+static void log_index_flush(struct log_index_batch *batch) {
+	if (batch->definition_count > 0 && log_ring.defs_fd >= 0) {
+		log_index_append(log_ring.defs_fd, batch->definitions, batch->definition_count * sizeof(uint64_t));
+	}
+	if (batch->count > 0) {
+		log_index_append(log_ring.index_fd, batch->entries, batch->count * sizeof(struct log_index_entry));
+	}
+	batch->definition_count = 0;
+	batch->count = 0;
+}
+
+static void log_index_record(const struct log_record *record, uint64_t offset, struct log_index_batch *batch) {
+	if (record->kind != LOG_RECORD_EVENT) {
+		batch->definitions[batch->definition_count] = offset;
+		if (++batch->definition_count == LOG_INDEX_BATCH) {
+			log_index_flush(batch);
+		}
+		return;
+	}
+	int64_t key = record->key;
+	if (key < log_ring.last_key && !(log_ring.index_flags & LOG_INDEX_UNORDERED)) {
+		// clock went backwards - the index can no longer be binary searched
+		log_ring.index_flags |= LOG_INDEX_UNORDERED;
+		pwrite(log_ring.index_fd, &log_ring.index_flags, sizeof(uint32_t), offsetof(struct log_index_header, flags));
+	}
+	// one entry per second, for the first record logged in it
+	int64_t last_key = log_ring.last_key;
+	if (key > last_key) {
+		log_ring.last_key = key;
+	}
+	if (key <= last_key || (last_key != INT64_MIN && key / 1000000000LL == last_key / 1000000000LL)) {
+		return;
+	}
+	batch->entries[batch->count].key = key;
+	batch->entries[batch->count].offset = offset;
+	if (++batch->count == LOG_INDEX_BATCH) {
+		log_index_flush(batch);
+	}
+}
+
+// Drops the definitions at or after offset from the sidecar, they are found
+// again when the log is indexed from there. Returns 0 if the sidecar is not usable.
+static int log_defs_truncate(uint64_t offset) {
+	char magic[8];
+	struct stat st;
+	if (fstat(log_ring.defs_fd, &st) < 0 || st.st_size < (off_t)sizeof(magic)
+		|| pread(log_ring.defs_fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, LOG_DEFS_MAGIC, sizeof(magic)) != 0) {
+		return 0;
+	}
+	// first entry at or after offset
+	uint64_t l = 0, r = (st.st_size - sizeof(magic)) / sizeof(uint64_t);
+	while (l < r) {
+		uint64_t m = l + (r - l) / 2, entry;
+		if (pread(log_ring.defs_fd, &entry, sizeof(entry), sizeof(magic) + m * sizeof(entry)) != sizeof(entry)) {
+			return 0;
+		}
+		if (entry < offset) l = m + 1; else r = m;
+	}
+	ftruncate(log_ring.defs_fd, sizeof(magic) + l * sizeof(uint64_t));
+	lseek(log_ring.defs_fd, 0, SEEK_END);
+	return 1;
+}
+
+// Opens (or rebuilds) the index and the definitions sidecar and works out from
+// which log offset they need catching up.
+static int log_index_open(const char *index_file, const char *defs_file) {
+	struct log_index_header header;
+	struct stat st;
+
+	log_ring.index_fd = open(index_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (log_ring.index_fd < 0) {
+		perror("Error opening log index");
+		return 0;
+	}
+	log_ring.defs_fd = open(defs_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (log_ring.defs_fd < 0) {
+		perror("Error opening log definitions");
+	}
+	log_ring.index_from = LOG_FILE_MAGIC_LEN;
+	log_ring.last_key = INT64_MIN;
+	log_ring.index_flags = 0;
+
+	fstat(log_ring.index_fd, &st);
+	uint64_t entries = st.st_size >= (off_t)sizeof(header) ? (st.st_size - sizeof(header)) / sizeof(struct log_index_entry) : 0;
+	if (pread(log_ring.index_fd, &header, sizeof(header), 0) == sizeof(header)
+		&& memcmp(header.magic, LOG_INDEX_MAGIC, sizeof(header.magic)) == 0) {
+		struct log_index_entry last;
+		log_ring.index_flags = header.flags;
+		if (entries > 0 && pread(log_ring.index_fd, &last, sizeof(last), sizeof(header) + (entries - 1) * sizeof(last)) == sizeof(last)
+			&& last.offset <= log_ring.file_offset && (log_ring.defs_fd < 0 || log_defs_truncate(last.offset))) {
+			// resume at the last indexed record, dropping any torn entry
+			log_ring.index_from = last.offset;
+			log_ring.last_key = last.key;
+			ftruncate(log_ring.index_fd, sizeof(header) + entries * sizeof(last));
+			lseek(log_ring.index_fd, 0, SEEK_END);
+			return 1;
+		}
+	}
+
+	// missing, foreign or stale index - rebuild it from the whole log
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LOG_INDEX_MAGIC, sizeof(header.magic));
+	ftruncate(log_ring.index_fd, 0);
+	pwrite(log_ring.index_fd, &header, sizeof(header), 0);
+	lseek(log_ring.index_fd, 0, SEEK_END);
+	if (log_ring.defs_fd >= 0) {
+		ftruncate(log_ring.defs_fd, 0);
+		pwrite(log_ring.defs_fd, LOG_DEFS_MAGIC, 8, 0);
+		lseek(log_ring.defs_fd, 0, SEEK_END);
+	}
+	return 1;
+}
+
+// Indexes what was already in the log before this run (only the tail if the
+// index is current). A record cut short by a crash is cut off the log, so the
+// records of this run follow whole ones.
+static void log_index_catch_up() {
+	uint64_t size = log_ring.file_offset;
+	if (size <= log_ring.index_from) {
+		return;
+	}
+	const char *log = mmap(NULL, size, PROT_READ, MAP_SHARED, log_ring.fd, 0);
+	if (log == MAP_FAILED) {
+		return;
+	}
+	struct log_index_batch batch;
+	batch.count = 0;
+	batch.definition_count = 0;
+	uint64_t pos = log_ring.index_from;
+	while (size - pos >= sizeof(struct log_record)) {
+		const struct log_record *record = (const struct log_record *)(log + pos);
+		if (!log_record_valid(record) || record->size > size - pos - sizeof(struct log_record)) {
+			break;
+		}
+		log_index_record(record, pos, &batch);
+		pos += sizeof(struct log_record) + record->size;
+	}
+	munmap((void *)log, size);
+	log_index_flush(&batch);
+	if (pos != size && ftruncate(log_ring.fd, pos) == 0) {
+		log_ring.file_offset = pos;
+	}
+}
+
+// asynchronous logger - log_event() copies binary records into log_ring,
+// log_writer() writes them out in batches
+
+static void log_ring_kick() {
+	if (!atomic_exchange_explicit(&log_ring.kicked, 1, memory_order_acq_rel)) {
+		sem_post(&log_ring.wake);
+	}
+}
+
+// Copies one record into the ring. When the ring is full the record is
+// dropped, unless block is set, in which case the caller waits for the writer
+// to make room (used for definitions, errors and results, which must not be lost).
+static int log_ring_push(const char *record, size_t len, int block) {
+	uint64_t head = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&log_ring.tail, memory_order_acquire);
+
+	while (LOG_RING_SIZE - (head - tail) < len) {
+		log_ring_kick();
+		if (!block) {
+			return 0;
+		}
+		struct timespec pause = { 0, 100000 };
+		nanosleep(&pause, NULL);
+		tail = atomic_load_explicit(&log_ring.tail, memory_order_acquire);
+	}
+
+	size_t offset = head & (LOG_RING_SIZE - 1);
+	size_t first = LOG_RING_SIZE - offset;
+	if (first > len) {
+		first = len;
+	}
+	memcpy(log_ring.buffer + offset, record, first);
+	memcpy(log_ring.buffer, record + first, len - first);
+	atomic_store_explicit(&log_ring.head, head + len, memory_order_release);
+
+	if (head + len - tail >= LOG_FLUSH_THRESHOLD) {
+		log_ring_kick();
+	}
+	return 1;
+}
+
+// copies len bytes at ring position pos, which may wrap around the end
+static void log_ring_read(uint64_t pos, void *out, size_t len) {
+	size_t offset = pos & (LOG_RING_SIZE - 1);
+	size_t first = LOG_RING_SIZE - offset;
+	if (first > len) {
+		first = len;
+	}
+	memcpy(out, log_ring.buffer + offset, first);
+	memcpy((char *)out + first, log_ring.buffer, len - first);
+}
+
+// After a failed write: cuts a record written in part off the log, so that
+// the next records follow whole ones. If the log then does not end at offset,
+// where the last whole record ends, the offsets of this run can no longer be
+// trusted and indexing stops.
+static void log_ring_lost(uint64_t offset) {
+	struct stat st;
+	if (fstat(log_ring.fd, &st) == 0 && (uint64_t)st.st_size > offset) {
+		ftruncate(log_ring.fd, offset);
+	}
+	if (fstat(log_ring.fd, &st) < 0 || (uint64_t)st.st_size != offset) {
+		fprintf(stderr, "Log file does not end where expected, no longer indexing it\n");
+		if (log_ring.index_fd >= 0) {
+			close(log_ring.index_fd);
+			log_ring.index_fd = -1;
+		}
+		if (log_ring.defs_fd >= 0) {
+			close(log_ring.defs_fd);
+			log_ring.defs_fd = -1;
+		}
+	}
+}
+
+static void log_ring_drain() {
+	uint64_t tail = atomic_load_explicit(&log_ring.tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&log_ring.head, memory_order_acquire);
+	uint64_t start = tail;
+
+	while (tail != head) {
+		size_t offset = tail & (LOG_RING_SIZE - 1);
+		size_t len = head - tail;
+		size_t first = LOG_RING_SIZE - offset;
+		if (first > len) {
+			first = len;
+		}
+		struct iovec iov[2] = {
+			{ log_ring.buffer + offset, first },
+			{ log_ring.buffer, len - first },
+		};
+		ssize_t written = writev(log_ring.fd, iov, len > first ? 2 : 1);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			perror("Error writing log file");
+			break;
+		}
+		tail += written;
+	}
+
+	// the ring only ever holds whole records; of a failed write only those
+	// that made it to the log in full are kept
+	uint64_t end = start;
+	while (end < tail) {
+		struct log_record record;
+		log_ring_read(end, &record, sizeof(record));
+		if (end + sizeof(record) + record.size > tail) {
+			break;
+		}
+		end += sizeof(record) + record.size;
+	}
+	if (tail != head) {
+		log_ring_lost(log_ring.file_offset + (end - start));
+		atomic_fetch_add_explicit(&log_ring.lost, head - end, memory_order_relaxed);
+	}
+
+	// index after the data is on disk so no entry ever points past the end of
+	// the log
+	if (log_ring.index_fd >= 0 && end != start) {
+		struct log_index_batch batch;
+		batch.count = 0;
+		batch.definition_count = 0;
+		for (uint64_t pos = start; pos < end; ) {
+			struct log_record record;
+			log_ring_read(pos, &record, sizeof(record));
+			log_index_record(&record, log_ring.file_offset + (pos - start), &batch);
+			pos += sizeof(record) + record.size;
+		}
+		log_index_flush(&batch);
+	}
+	log_ring.file_offset += end - start;
+
+	atomic_store_explicit(&log_ring.tail, head, memory_order_release);
+	pthread_mutex_lock(&log_ring.flush_lock);
+	pthread_cond_broadcast(&log_ring.flushed);
+	pthread_mutex_unlock(&log_ring.flush_lock);
+}
+
+static void * log_writer(void *arg) {
+	if (log_ring.index_fd >= 0) {
+		log_index_catch_up();
+	}
+	while (atomic_load_explicit(&log_ring.running, memory_order_acquire)) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (long)LOG_FLUSH_INTERVAL_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		sem_timedwait(&log_ring.wake, &deadline);
+		atomic_store_explicit(&log_ring.kicked, 0, memory_order_release);
+		log_ring_drain();
+	}
+	log_ring_drain();
+	return NULL;
+}
+
+int log_start(const char *log_file) {
+	if (log_claim(log_file) < 0) {
+		fprintf(stderr, "Cannot open log file %s: %s\n", log_file, errno == EINVAL ? "not a log of this program" : strerror(errno));
+		return 0;
+	}
+	log_ring.buffer = malloc(LOG_RING_SIZE);
+	if (!log_ring.buffer) {
+		return 0;
+	}
+	struct stat st;
+	fstat(log_ring.fd, &st);
+	log_ring.file_offset = st.st_size;
+	if (!log_index_open(log_index_path, log_defs_path)) {
+		log_ring.index_fd = -1;
+		log_ring.defs_fd = -1;
+	}
+	atomic_store(&log_ring.head, 0);
+	atomic_store(&log_ring.tail, 0);
+	atomic_store(&log_ring.kicked, 0);
+	log_ring.dropped = 0;
+	atomic_store(&log_ring.lost, 0);
+	sem_init(&log_ring.wake, 0, 0);
+	pthread_mutex_init(&log_ring.flush_lock, NULL);
+	pthread_cond_init(&log_ring.flushed, NULL);
+
+	atomic_store(&log_ring.running, 1);
+	if (pthread_create(&log_ring.writer, NULL, log_writer, NULL) != 0) {
+		atomic_store(&log_ring.running, 0);
+		if (log_ring.index_fd >= 0) {
+			close(log_ring.index_fd);
+		}
+		if (log_ring.defs_fd >= 0) {
+			close(log_ring.defs_fd);
+		}
+		free(log_ring.buffer);
+		log_ring.buffer = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+// blocks until everything logged so far is on disk (e.g. before `monitor` reads the file)
+void log_flush() {
+	if (!atomic_load_explicit(&log_ring.running, memory_order_acquire)) {
+		return;
+	}
+	uint64_t target = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+	pthread_mutex_lock(&log_ring.flush_lock);
+	while (atomic_load_explicit(&log_ring.tail, memory_order_acquire) < target) {
+		log_ring_kick();
+		pthread_cond_wait(&log_ring.flushed, &log_ring.flush_lock);
+	}
+	pthread_mutex_unlock(&log_ring.flush_lock);
+}
+
+void log_stop() {
+	if (!atomic_load_explicit(&log_ring.running, memory_order_acquire)) {
+		return;
+	}
+	log_flush();
+	atomic_store_explicit(&log_ring.running, 0, memory_order_release);
+	sem_post(&log_ring.wake);
+	pthread_join(log_ring.writer, NULL);
+	if (log_ring.index_fd >= 0) {
+		close(log_ring.index_fd);
+	}
+	if (log_ring.defs_fd >= 0) {
+		close(log_ring.defs_fd);
+	}
+	sem_destroy(&log_ring.wake);
+	pthread_mutex_destroy(&log_ring.flush_lock);
+	pthread_cond_destroy(&log_ring.flushed);
+	free(log_ring.buffer);
+	log_ring.buffer = NULL;
+}
+
+// log records - log_event() interns its format, by address as formats are
+// literals, and its string arguments, and writes a fixed header and one 8
+// byte slot per argument. Nothing is formatted until the log is read.
+
+// Writes a record through the ring, or straight into the log file while the
+// logger is not running. Returns 0 if it was dropped.
+static int log_write(const char *record, size_t len, int block) {
+	if (atomic_load_explicit(&log_ring.running, memory_order_acquire)) {
+		return log_ring_push(record, len, block);
+	}
+	int fd = log_claim(log_file_path);
+	if (fd < 0) {
+		return 0;
+	}
+	struct iovec iov = { (void *)record, len };
+	while (iov.iov_len > 0) {
+		ssize_t written = writev(fd, &iov, 1);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			break;
+		}
+		iov.iov_base = (char *)iov.iov_base + written;
+		iov.iov_len -= written;
+	}
+	return iov.iov_len == 0;
+}
+
+// writes the record that gives id its text
+static void log_define(int kind, uint32_t id, const char *text, size_t len) {
+	uint64_t record[(sizeof(struct log_record) + LOG_STRING_MAX) / 8 + 1];
+	struct log_record *header = (struct log_record *)record;
+	size_t size = (len + 1 + 7) & ~(size_t)7;
+	memset((char *)(header + 1) + size - 8, 0, 8);
+	memcpy(header + 1, text, len);
+	header->key = 0;
+	header->id = id;
+	header->size = size;
+	header->kind = kind;
+	header->level = 0;
+	log_write((const char *)record, sizeof(*header) + size, 1);
+}
+
+// Parses the conversion after a '%': sets *type to its LOG_ARG_* (0 for "%%")
+// and returns its length, or 0 if it is not one log_event() supports.
+static size_t log_conversion(const char *p, int *type) {
+	const char *c = p + strspn(p, "-+ #0");
+	while (*c >= '0' && *c <= '9') {
+		c++;
+	}
+	if (*c == '.') {
+		c++;
+		while (*c >= '0' && *c <= '9') {
+			c++;
+		}
+	}
+	int length = 0;
+	if (c[0] == 'h') {
+		c += c[1] == 'h' ? 2 : 1;
+	} else if (c[0] == 'l' && c[1] == 'l') {
+		length = LOG_ARG_LONG_LONG;
+		c += 2;
+	} else if (c[0] == 'l') {
+		length = LOG_ARG_LONG;
+		c++;
+	} else if (c[0] == 'j') {
+		length = LOG_ARG_LONG_LONG;
+		c++;
+	} else if (c[0] == 'z' || c[0] == 't') {
+		length = LOG_ARG_SIZE;
+		c++;
+	}
+	switch (*c) {
+		case '%': *type = 0; break;
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+			*type = length ? length : LOG_ARG_INT;
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			*type = LOG_ARG_DOUBLE;
+			break;
+		case 's': *type = LOG_ARG_STRING; break;
+		case 'p': *type = LOG_ARG_POINTER; break;
+		default: return 0;
+	}
+	return c + 1 - p;
+}
+
+// Forgets everything defined so far, it is defined again (with new ids) when
+// used next; for when definitions may have been lost on the way to the log.
+static void log_intern_clear() {
+	for (uint32_t i = 0; i < LOG_STRING_SLOTS; i++) {
+		free(log_intern.strings[i].text);
+	}
+	memset(log_intern.formats, 0, sizeof(log_intern.formats));
+	log_intern.format_count = 0;
+	memset(log_intern.strings, 0, sizeof(log_intern.strings));
+	log_intern.string_count = 0;
+	memset(log_intern.seen, 0, sizeof(log_intern.seen));
+}
+
+static struct log_format * log_format_intern(const char *format) {
+	uint32_t mask = LOG_FORMAT_SLOTS - 1;
+	uint32_t slot = (uint32_t)(((uintptr_t)format * 0x9e3779b97f4a7c15ULL) >> 40) & mask;
+	while (log_intern.formats[slot].text) {
+		if (log_intern.formats[slot].text == format) {
+			return &log_intern.formats[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	if (log_intern.format_count >= LOG_FORMAT_SLOTS / 4 * 3) {
+		memset(log_intern.formats, 0, sizeof(log_intern.formats));
+		log_intern.format_count = 0;
+		slot = (uint32_t)(((uintptr_t)format * 0x9e3779b97f4a7c15ULL) >> 40) & mask;
+	}
+
+	struct log_format *f = &log_intern.formats[slot];
+	f->text = format;
+	f->id = ++log_intern.next_format;
+	f->argc = 0;
+	for (const char *c = strchr(format, '%'); c && f->argc < LOG_ARGS_MAX; c = strchr(c, '%')) {
+		int type;
+		size_t len = log_conversion(c + 1, &type);
+		if (!len) {
+			// the text is rendered as is from here on
+			break;
+		}
+		if (type) {
+			f->types[f->argc++] = type;
+		}
+		c += 1 + len;
+	}
+	log_intern.format_count++;
+	log_define(LOG_RECORD_FORMAT, f->id, format, strnlen(format, LOG_STRING_MAX - 1));
+	return f;
+}
+
+static uint32_t log_string_find(const char *s, size_t len, uint64_t hash) {
+	uint32_t mask = LOG_STRING_SLOTS - 1;
+	for (uint32_t slot = hash & mask; log_intern.strings[slot].text; slot = (slot + 1) & mask) {
+		struct log_string *e = &log_intern.strings[slot];
+		if (e->hash == hash && strncmp(e->text, s, len) == 0 && e->text[len] == '\0') {
+			return e->id;
+		}
+	}
+	return 0;
+}
+
+static uint32_t log_string_intern(const char *s, size_t len, uint64_t hash) {
+	uint32_t mask = LOG_STRING_SLOTS - 1;
+	if (log_intern.string_count >= LOG_STRING_SLOTS / 4 * 3) {
+		for (uint32_t i = 0; i < LOG_STRING_SLOTS; i++) {
+			free(log_intern.strings[i].text);
+		}
+		memset(log_intern.strings, 0, sizeof(log_intern.strings));
+		log_intern.string_count = 0;
+	}
+	uint32_t slot = hash & mask;
+	while (log_intern.strings[slot].text) {
+		slot = (slot + 1) & mask;
+	}
+	char *text = malloc(len + 1);
+	if (!text) {
+		return 0;
+	}
+	memcpy(text, s, len + 1);
+	struct log_string *e = &log_intern.strings[slot];
+	e->hash = hash;
+	e->id = ++log_intern.next_string;
+	e->text = text;
+	log_intern.string_count++;
+	log_define(LOG_RECORD_STRING, e->id, text, len);
+	return e->id;
+}
+
+// The slot of a string argument. A short string seen before is interned, any
+// other is copied into the payload at *used; what does not fit in the record
+// is replaced by a marker saying how much was left out.
+static uint64_t log_string_slot(const char *s, char *payload, size_t *used) {
+	if (!s) {
+		return 0;
+	}
+	size_t len = strlen(s);
+	if (len < LOG_STRING_MAX) {
+		uint64_t hash = hash_string(s);
+		uint32_t id = log_string_find(s, len, hash);
+		uint64_t *seen = &log_intern.seen[hash & (LOG_SEEN_SLOTS - 1)];
+		if (!id && *seen == hash) {
+			id = log_string_intern(s, len, hash);
+		}
+		if (id) {
+			return id;
+		}
+		*seen = hash;
+	}
+	size_t room = LOG_EVENT_MAX - *used, n = len;
+	char marker[64];
+	int marker_len = 0;
+	if (len > room) {
+		marker_len = snprintf(marker, sizeof(marker), "[... %zu bytes not logged]", len);
+		if ((size_t)marker_len > room) {
+			marker_len = room;
+		}
+		n = room - marker_len;
+		marker_len = snprintf(marker, sizeof(marker), "[... %zu bytes not logged]", len - n);
+		if ((size_t)marker_len > room - n) {
+			marker_len = room - n;
+		}
+	}
+	uint64_t slot = LOG_INLINE_STRING | (uint64_t)(n + marker_len) << 32 | *used;
+	memcpy(payload + *used, s, n);
+	memcpy(payload + *used + n, marker, marker_len);
+	*used += n + marker_len;
+	return slot;
+}
+
+// Builds the event record into out, which must hold a log_record and
+// LOG_EVENT_MAX bytes; definitions of new formats and strings are written
+// first. Returns the length of the record.
+size_t log_build_event(char *out, int64_t key, int level, const char *format, va_list args) {
+	struct log_format *f = log_format_intern(format);
+	struct log_record *record = (struct log_record *)out;
+	char *payload = (char *)(record + 1);
+	uint64_t *slots = (uint64_t *)payload;
+	size_t used = f->argc * sizeof(uint64_t);
+	for (int i = 0; i < f->argc; i++) {
+		switch (f->types[i]) {
+			case LOG_ARG_INT: slots[i] = (int64_t)va_arg(args, int); break;
+			case LOG_ARG_LONG: slots[i] = (int64_t)va_arg(args, long); break;
+			case LOG_ARG_LONG_LONG: slots[i] = (uint64_t)va_arg(args, long long); break;
+			case LOG_ARG_SIZE: slots[i] = va_arg(args, size_t); break;
+			case LOG_ARG_DOUBLE: {
+				double value = va_arg(args, double);
+				memcpy(&slots[i], &value, sizeof(value));
+				break;
+			}
+			case LOG_ARG_STRING: slots[i] = log_string_slot(va_arg(args, const char *), payload, &used); break;
+			case LOG_ARG_POINTER: slots[i] = (uintptr_t)va_arg(args, void *); break;
+		}
+	}
+	size_t size = (used + 7) & ~(size_t)7;
+	memset(payload + used, 0, size - used);
+	record->key = key;
+	record->id = f->id;
+	record->size = size;
+	record->kind = LOG_RECORD_EVENT;
+	record->level = level;
+	return sizeof(*record) + size;
+}
+
+static void log_emit(int level, const char *format, ...) {
+	static uint64_t record[(sizeof(struct log_record) + LOG_EVENT_MAX) / 8];
+	va_list args;
+	va_start(args, format);
+	size_t len = log_build_event((char *)record, log_timestamp_key(), level, format, args);
+	va_end(args);
+	log_write((const char *)record, len, 1);
+}
+
+void log_event(const char *log_file, int level, const char *format, ...) {
+	if (log_ring.dropped && atomic_load_explicit(&log_ring.running, memory_order_acquire)) {
+		uint64_t dropped = log_ring.dropped;
+		log_ring.dropped = 0;
+		log_emit(LOG_LEVEL_ERROR, "Logger dropped %llu records, ring buffer full", (unsigned long long)dropped);
+	}
+	if (atomic_load_explicit(&log_ring.lost, memory_order_relaxed)) {
+		uint64_t lost = atomic_exchange_explicit(&log_ring.lost, 0, memory_order_relaxed);
+		log_intern_clear();
+		log_emit(LOG_LEVEL_ERROR, "Logger lost %llu bytes of records, writing the log failed", (unsigned long long)lost);
+	}
+
+	static uint64_t record[(sizeof(struct log_record) + LOG_EVENT_MAX) / 8];
+	va_list args;
+	va_start(args, format);
+	size_t len = log_build_event((char *)record, log_timestamp_key(), level, format, args);
+	va_end(args);
+
+	int important = (level == LOG_LEVEL_ERROR || level == LOG_LEVEL_RESULT);
+	if (!log_write((const char *)record, len, important) && atomic_load_explicit(&log_ring.running, memory_order_acquire)) {
+		log_ring.dropped++;
+	}
+}
+
+// Looks up the part of the log holding the records logged between from and to
+// (inclusive). Returns 0 if there is no usable index and the whole log has to be read.
+static int log_index_lookup(int64_t from, int64_t to, uint64_t log_size, uint64_t *lo, uint64_t *hi) {
+	struct stat st;
+	int fd = open(log_index_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct log_index_header)) {
+		close(fd);
+		return 0;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+
+	const struct log_index_header *header = map;
+	const struct log_index_entry *entries = (const struct log_index_entry *)(header + 1);
+	size_t count = (st.st_size - sizeof(*header)) / sizeof(*entries);
+	int usable = memcmp(header->magic, LOG_INDEX_MAGIC, sizeof(header->magic)) == 0
+		&& !(header->flags & LOG_INDEX_UNORDERED) && count > 0 && entries[count - 1].offset <= log_size;
+
+	if (usable) {
+		size_t first = 0, last = count;
+		// first entry with key >= from
+		for (size_t l = 0, r = count; l < r; ) {
+			size_t m = l + (r - l) / 2;
+			if (entries[m].key < from) l = m + 1; else r = m;
+			first = l;
+		}
+		// first entry with key > to
+		for (size_t l = first, r = count; l < r; ) {
+			size_t m = l + (r - l) / 2;
+			if (entries[m].key <= to) l = m + 1; else r = m;
+			last = l;
+		}
+		// from can be within the second of the entry before the first one, whose
+		// records start there; records past the last entry may not be indexed
+		// yet (synchronous fallback), keep them in range
+		*lo = first > 0 ? entries[first - 1].offset : 0;
+		*hi = last < count ? entries[last].offset : log_size;
+	}
+	munmap(map, st.st_size);
+	return usable;
+}
+
+// log rendering - turns the records back into the text lines log_event() used to write
+
+// Returns 0 if not everything could be written.
+static int write_all(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error writing log records");
+			return 0;
+		}
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 1;
+}
+
+static const char * log_level_name(int level) {
+	switch (level) {
+		case LOG_LEVEL_INFO: return "INFO";
+		case LOG_LEVEL_ERROR: return "ERROR";
+		case LOG_LEVEL_SUCCESS: return "SUCCESS";
+		case LOG_LEVEL_EVENT_RECEIVED: return "EVENT";
+		case LOG_LEVEL_REQUEST_SENT: return "REQUEST";
+		case LOG_LEVEL_RESULT: return "RESULT";
+		default: return "UNKNOWN";
+	}
+}
+
+static void log_reader_flush(struct log_reader *reader) {
+	struct iovec iov = { reader->out, reader->out_len };
+	write_all(reader->out_fd, &iov, 1);
+	reader->out_len = 0;
+}
+
+// records the text of a definition, by id
+static int log_reader_define(struct log_reader *reader, const struct log_record *record) {
+	const char *text = (const char *)(record + 1);
+	if (record->size == 0 || !memchr(text, '\0', record->size)) {
+		return 0;
+	}
+	const char ***table = record->kind == LOG_RECORD_FORMAT ? &reader->formats : &reader->strings;
+	uint32_t *size = record->kind == LOG_RECORD_FORMAT ? &reader->format_size : &reader->string_size;
+	if (record->id >= *size) {
+		uint32_t new_size = *size ? *size : 256;
+		while (new_size <= record->id) {
+			new_size *= 2;
+		}
+		const char **grown = realloc(*table, new_size * sizeof(char *));
+		if (!grown) {
+			return 0;
+		}
+		memset(grown + *size, 0, (new_size - *size) * sizeof(char *));
+		*table = grown;
+		*size = new_size;
+	}
+	(*table)[record->id] = text;
+	return 1;
+}
+
+// "YYYY-MM-DD::HH:MM:SS.nnnnnnnnn": the date, hour and minute are rendered
+// again only when the minute changes, the seconds and fraction every time
+static const char * log_reader_timestamp(struct log_reader *reader, int64_t key) {
+	int64_t minute = key >= 0 ? key / 60000000000LL : -((-key + 59999999999LL) / 60000000000LL);
+	int64_t within = key - minute * 60000000000LL;
+	if (minute != reader->minute) {
+		time_t t = minute * 60;
+		struct tm tm_info;
+		gmtime_r(&t, &tm_info);
+		strftime(reader->timestamp, sizeof(reader->timestamp), "%Y-%m-%d::%H:%M:", &tm_info);
+		reader->timestamp[LOG_TIMESTAMP_LEN] = '.';
+		reader->timestamp[LOG_TIMESTAMP_MAX] = '\0';
+		reader->minute = minute;
+	}
+	char *digit = reader->timestamp + LOG_TIMESTAMP_MAX;
+	for (int i = 0; i < LOG_TIMESTAMP_FRACTION; i++) {
+		*--digit = '0' + within % 10;
+		within /= 10;
+	}
+	reader->timestamp[LOG_TIMESTAMP_PREFIX + 1] = '0' + within % 10;
+	reader->timestamp[LOG_TIMESTAMP_PREFIX] = '0' + within / 10;
+	return reader->timestamp;
+}
+
+static void log_reader_append(struct log_reader *reader, const char *text, size_t len) {
+	while (len > 0) {
+		if (reader->out_len == LOG_RENDER_BUFFER) {
+			log_reader_flush(reader);
+		}
+		size_t n = LOG_RENDER_BUFFER - reader->out_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(reader->out + reader->out_len, text, n);
+		reader->out_len += n;
+		text += n;
+		len -= n;
+	}
+}
+
+// appends part of a record's text, which ends at its first newline for first_line
+static void log_reader_put(struct log_reader *reader, const char *text, size_t len) {
+	if (reader->line_done) {
+		return;
+	}
+	const char *newline = reader->first_line ? memchr(text, '\n', len) : NULL;
+	if (newline) {
+		len = newline - text;
+		reader->line_done = 1;
+	}
+	log_reader_append(reader, text, len);
+}
+
+// the text of a string slot, which is not NUL terminated when inline
+static const char * log_reader_string(struct log_reader *reader, const struct log_record *record, uint64_t slot, size_t *len) {
+	const char *s;
+	if (slot == 0) {
+		s = "(null)";
+	} else if (slot & LOG_INLINE_STRING) {
+		uint64_t offset = (uint32_t)slot, length = (slot >> 32) & 0x7fffffff;
+		if (offset + length <= record->size) {
+			*len = length;
+			return (const char *)(record + 1) + offset;
+		}
+		s = "(string not in record)";
+	} else if (slot < reader->string_size && reader->strings[slot]) {
+		s = reader->strings[slot];
+	} else {
+		s = "(string not defined)";
+	}
+	*len = strlen(s);
+	return s;
+}
+
+// Renders an event as one text line: the timestamp and level, then the format
+// with the slots put in.
+static void log_render_event(struct log_reader *reader, const struct log_record *record) {
+	const char *level = log_level_name(record->level);
+	char text[LOG_STRING_MAX + 64];
+	int written = 0;
+	reader->line_done = 0;
+	log_reader_put(reader, "[", 1);
+	log_reader_put(reader, log_reader_timestamp(reader, record->key), LOG_TIMESTAMP_MAX);
+	log_reader_put(reader, "]  [", 4);
+	log_reader_put(reader, level, strlen(level));
+	log_reader_put(reader, "]  ", 3);
+	const char *format = record->id < reader->format_size ? reader->formats[record->id] : NULL;
+	const uint64_t *slots = (const uint64_t *)(record + 1);
+	uint32_t argc = record->size / sizeof(uint64_t), arg = 0;
+	if (!format) {
+		written = snprintf(text, sizeof(text), "(format %u not defined)", record->id);
+		log_reader_put(reader, text, written);
+	}
+	for (const char *c = format; c && *c; ) {
+		if (*c != '%') {
+			const char *next = strchr(c, '%');
+			size_t n = next ? (size_t)(next - c) : strlen(c);
+			log_reader_put(reader, c, n);
+			c += n;
+			continue;
+		}
+		int type;
+		size_t n = log_conversion(c + 1, &type);
+		char spec[32];
+		if (!n || (type && arg == argc) || n + 2 > sizeof(spec)) {
+			// not a conversion log_event() knows, or an argument missing: the rest as is
+			log_reader_put(reader, c, strlen(c));
+			break;
+		}
+		memcpy(spec, c, n + 1);
+		spec[n + 1] = '\0';
+		c += n + 1;
+		uint64_t slot = type ? slots[arg++] : 0;
+		switch (type) {
+			case 0: written = snprintf(text, sizeof(text), "%%"); break;
+			case LOG_ARG_INT: written = snprintf(text, sizeof(text), spec, (int)slot); break;
+			case LOG_ARG_LONG: written = snprintf(text, sizeof(text), spec, (long)slot); break;
+			case LOG_ARG_LONG_LONG: written = snprintf(text, sizeof(text), spec, (long long)slot); break;
+			case LOG_ARG_SIZE: written = snprintf(text, sizeof(text), spec, (size_t)slot); break;
+			case LOG_ARG_DOUBLE: {
+				double value;
+				memcpy(&value, &slot, sizeof(value));
+				written = snprintf(text, sizeof(text), spec, value);
+				break;
+			}
+			case LOG_ARG_STRING: {
+				size_t len;
+				const char *s = log_reader_string(reader, record, slot, &len);
+				if (n == 1 || len >= LOG_STRING_MAX) {
+					// plain %s, by far the most common; a long one skips width and precision
+					log_reader_put(reader, s, len);
+					written = 0;
+					break;
+				}
+				char copy[LOG_STRING_MAX];
+				memcpy(copy, s, len);
+				copy[len] = '\0';
+				written = snprintf(text, sizeof(text), spec, copy);
+				break;
+			}
+			case LOG_ARG_POINTER: written = snprintf(text, sizeof(text), spec, (void *)(uintptr_t)slot); break;
+		}
+		if (written > 0) {
+			log_reader_put(reader, text, (size_t)written < sizeof(text) ? (size_t)written : sizeof(text) - 1);
+		}
+	}
+	log_reader_append(reader, "\n", 1);
+}
+
+// Gives the reader the definitions made before lo by the run lo belongs to
+// (ids start over with every run, its first format is id 1), as listed in the
+// definitions sidecar. Returns 0 if the sidecar is not usable.
+static int log_reader_load_definitions(struct log_reader *reader, const char *log, uint64_t size, uint64_t lo) {
+	struct stat st;
+	int fd = open(log_defs_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < 8) {
+		close(fd);
+		return 0;
+	}
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+	const uint64_t *offsets = (const uint64_t *)(map + 8);
+	size_t count = (st.st_size - 8) / sizeof(uint64_t);
+	int usable = memcmp(map, LOG_DEFS_MAGIC, 8) == 0;
+
+	// definitions before lo, back to the first one of the run
+	size_t end = 0, start;
+	for (size_t l = 0, r = count; l < r; ) {
+		size_t m = l + (r - l) / 2;
+		if (offsets[m] < lo) l = m + 1; else r = m;
+		end = l;
+	}
+	for (start = end; usable && start > 0; start--) {
+		uint64_t offset = offsets[start - 1];
+		const struct log_record *record = (const struct log_record *)(log + offset);
+		if (offset < LOG_FILE_MAGIC_LEN || size - offset < sizeof(*record) || !log_record_valid(record)
+			|| record->kind == LOG_RECORD_EVENT || record->size > size - offset - sizeof(*record)) {
+			usable = 0;
+		} else if (record->kind == LOG_RECORD_FORMAT && record->id == 1) {
+			start--;
+			break;
+		}
+	}
+	for (size_t i = start; usable && i < end; i++) {
+		log_reader_define(reader, (const struct log_record *)(log + offsets[i]));
+	}
+	munmap((void *)map, st.st_size);
+	return usable;
+}
+
+// Renders the events in [lo, hi) of the mapped log whose key is within
+// [from, to]; lo is 0 or the start of a record. The reader must already hold
+// the definitions made before lo. Returns 0 if the log is not a binary log.
+int render_log_range(const char *log, uint64_t size, uint64_t lo, uint64_t hi, int64_t from, int64_t to, struct log_reader *reader) {
+	if (size < LOG_FILE_MAGIC_LEN || memcmp(log, LOG_FILE_MAGIC, LOG_FILE_MAGIC_LEN) != 0) {
+		return 0;
+	}
+	uint64_t pos = lo > LOG_FILE_MAGIC_LEN ? lo : LOG_FILE_MAGIC_LEN;
+	while (pos < hi && size - pos >= sizeof(struct log_record)) {
+		const struct log_record *record = (const struct log_record *)(log + pos);
+		if (!log_record_valid(record) || record->size > size - pos - sizeof(struct log_record)) {
+			// a record cut short by a crash, the logger cuts it off at its next start
+			break;
+		}
+		if (record->kind != LOG_RECORD_EVENT) {
+			log_reader_define(reader, record);
+		} else if (record->key >= from && record->key <= to) {
+			log_render_event(reader, record);
+		}
+		pos += sizeof(struct log_record) + record->size;
+	}
+	log_reader_flush(reader);
+	return 1;
+}
+
+static int print_log_range(int fd, int64_t from, int64_t to, int use_index, int first_line, int out_fd) {
+	struct stat st;
+	uint64_t lo = 0, hi;
+
+	if (fstat(fd, &st) < 0) {
+		return 0;
+	}
+	if (st.st_size == 0) {
+		return 1;
+	}
+	const char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (log == MAP_FAILED) {
+		return 0;
+	}
+	struct log_reader * reader = calloc(1, sizeof(struct log_reader));
+	if (!reader) {
+		munmap((void *)log, st.st_size);
+		return 0;
+	}
+	hi = st.st_size;
+	if (use_index && log_index_lookup(from, to, st.st_size, &lo, &hi) && lo > LOG_FILE_MAGIC_LEN
+		&& !log_reader_load_definitions(reader, log, st.st_size, lo)) {
+		// without the definitions the range needs, read the log from the start
+		lo = 0;
+	}
+	reader->minute = INT64_MIN;
+	reader->first_line = first_line;
+	reader->out_fd = out_fd;
+	int ok = render_log_range(log, st.st_size, lo, hi, from, to, reader);
+	if (!ok) {
+		errno = EINVAL;
+	}
+
+	free(reader->formats);
+	free(reader->strings);
+	free(reader);
+	munmap((void *)log, st.st_size);
+	return ok;
+}
+
+// prints the records logged between two timestamps (inclusive), rendering only the indexed range
+int print_log_records(int fd, const char *from, const char *to, int out_fd) {
+	int64_t from_key, to_key, span;
+	if (!parse_timestamp_key(from, strlen(from), &from_key, &span) || !parse_timestamp_key(to, strlen(to), &to_key, &span)) {
+		errno = EINVAL;
+		return 0;
+	}
+	// to covers all of its last digit (a whole second without a fraction);
+	// like on the text log, only the timestamped line of each record is printed
+	return print_log_range(fd, from_key, to_key + span - 1, 1, 1, out_fd);
+}
+
+int print_log_all(int fd, int out_fd) {
+	return print_log_range(fd, INT64_MIN, INT64_MAX, 0, 0, out_fd);
+}
+
+// --export-log: the log as text on stdout
+int export_log(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("Cannot open log");
+		return 0;
+	}
+	int ok = print_log_all(fd, STDOUT_FILENO);
+	close(fd);
+	if (!ok) {
+		fprintf(stderr, "%s is not a log of this program\n", path);
+	}
+	return ok;
+}
+
+void handle_print_outputs(struct wl_list *heads) {
+    struct local_head *lh;
+    wl_list_for_each(lh, heads, link) {
+        printf("Output: %s\n", lh->name ? lh->name : "(unknown)");
+        printf("  Description      : %s\n", lh->description ? lh->description : "(none)");
+        printf("  Make             : %s\n", lh->make ? lh->make : "(unknown)");
+        printf("  Model            : %s\n", lh->model ? lh->model : "(unknown)");
+        printf("  Serial Number    : %s\n", lh->serial_number ? lh->serial_number : "(unknown)");
+        printf("  Physical Size    : %dmm x %dmm\n", lh->physical_width, lh->physical_height);
+        printf("  Enabled          : %s\n", lh->enabled ? "Yes" : "No");
+        printf("  Position         : (%d, %d)\n", lh->pos_x, lh->pos_y);
+        printf("  Transform        : %d\n", lh->transform);
+        printf("  Scale Factor     : %.3f\n", wl_fixed_to_double(lh->scale));
+        printf("  Adaptive Sync    : %s\n", lh->adaptive_sync_state ? "Enabled" : "Disabled");
+        printf("  Available Modes:\n");
+        const struct mode_table *modes = &lh->modes;
+        for (uint32_t row = 0; row < modes->count; row++) {
+            const char *status_desc = "Normal";
+            if (modes->flags[row] == (MODE_CURRENT | MODE_PREFERRED)) status_desc = "Current+Preferred";
+            else if (modes->flags[row] & MODE_CURRENT) status_desc = "Current";
+            else if (modes->flags[row] & MODE_PREFERRED) status_desc = "Preferred";
+
+            printf("    %dx%d @ %dHz [%s]\n",
+                   modes->width[row],
+                   modes->height[row],
+                   modes->refresh[row],
+                   status_desc);
+        }
+        printf("--------------------------------------------------------\n\n");
+    }
+}
+
+// Machine readable list_outputs. The whole model is rendered into one buffer,
+// sized up front from the head and mode counts, and emitted with a single
+// write. Numbers are formatted by hand, printf costs more than the rest of the
+// serialization together.
+
+static struct output_buffer output_buffer;
+
+static char * put_bytes(char *p, const char *s, size_t len) {
+	memcpy(p, s, len);
+	return p + len;
+}
+
+#define PUT_LITERAL(p, lit) put_bytes(p, lit, sizeof(lit) - 1)
+
+static char * put_int(char *p, int64_t value) {
+	char digits[20];
+	int n = 0;
+	uint64_t u = value < 0 ? -(uint64_t)value : (uint64_t)value;
+	if (value < 0) {
+		*p++ = '-';
+	}
+	do {
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	while (n) {
+		*p++ = digits[--n];
+	}
+	return p;
+}
+
+// wl_fixed_t with three decimals, as in the text output
+static char * put_fixed(char *p, wl_fixed_t value) {
+	int64_t milli = ((int64_t)value * 1000 + (value < 0 ? -128 : 128)) / 256;
+	if (milli < 0) {
+		*p++ = '-';
+		milli = -milli;
+	}
+	p = put_int(p, milli / 1000);
+	*p++ = '.';
+	*p++ = '0' + milli / 100 % 10;
+	*p++ = '0' + milli / 10 % 10;
+	*p++ = '0' + milli % 10;
+	return p;
+}
+
+// quoted and escaped, or null
+static char * put_string(char *p, const char *s) {
+	static const char hex[] = "0123456789abcdef";
+	if (!s) {
+		return PUT_LITERAL(p, "null");
+	}
+	*p++ = '"';
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c < 0x20) {
+			p = PUT_LITERAL(p, "\\u00");
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 15];
+		} else {
+			*p++ = c;
+		}
+	}
+	*p++ = '"';
+	return p;
+}
+
+static char * put_mode(char *p, const struct mode_table *modes, uint32_t row) {
+	p = put_int(p, modes->width[row]);
+	*p++ = 'x';
+	p = put_int(p, modes->height[row]);
+	*p++ = '@';
+	return put_int(p, modes->refresh[row]);
+}
+
+static size_t string_bound(const char *s) {
+	return s ? strlen(s) * 6 + 2 : 4;
+}
+
+// upper bound of the rendered size in either format
+static size_t outputs_size_bound(struct wl_list *heads) {
+	size_t size = OUTPUT_TEXT_HEADER_MAX;
+	struct local_head *lh;
+	wl_list_for_each(lh, heads, link) {
+		size += OUTPUT_TEXT_HEAD_MAX + (size_t)lh->modes.count * OUTPUT_TEXT_MODE_MAX;
+		size += string_bound(lh->name) + string_bound(lh->description) + string_bound(lh->make)
+			+ string_bound(lh->model) + string_bound(lh->serial_number);
+	}
+	return size;
+}
+
+static char * format_outputs_json(char *p, struct wl_list *heads) {
+	p = PUT_LITERAL(p, "{\"serial\":");
+	p = put_int(p, current_serial);
+	p = heads == &state_cache.heads ? PUT_LITERAL(p, ",\"cached\":true") : PUT_LITERAL(p, ",\"cached\":false");
+	p = PUT_LITERAL(p, ",\"outputs\":[");
+	struct local_head *lh;
+	int first = 1;
+	wl_list_for_each(lh, heads, link) {
+		const struct mode_table *modes = &lh->modes;
+		if (!first) {
+			*p++ = ',';
+		}
+		first = 0;
+		p = PUT_LITERAL(p, "{\"name\":");
+		p = put_string(p, lh->name);
+		p = PUT_LITERAL(p, ",\"description\":");
+		p = put_string(p, lh->description);
+		p = PUT_LITERAL(p, ",\"make\":");
+		p = put_string(p, lh->make);
+		p = PUT_LITERAL(p, ",\"model\":");
+		p = put_string(p, lh->model);
+		p = PUT_LITERAL(p, ",\"serial_number\":");
+		p = put_string(p, lh->serial_number);
+		p = PUT_LITERAL(p, ",\"physical_size\":{\"width\":");
+		p = put_int(p, lh->physical_width);
+		p = PUT_LITERAL(p, ",\"height\":");
+		p = put_int(p, lh->physical_height);
+		p = PUT_LITERAL(p, "},\"enabled\":");
+		p = lh->enabled ? PUT_LITERAL(p, "true") : PUT_LITERAL(p, "false");
+		p = PUT_LITERAL(p, ",\"position\":{\"x\":");
+		p = put_int(p, lh->pos_x);
+		p = PUT_LITERAL(p, ",\"y\":");
+		p = put_int(p, lh->pos_y);
+		p = PUT_LITERAL(p, "},\"transform\":");
+		p = put_int(p, lh->transform);
+		p = PUT_LITERAL(p, ",\"scale\":");
+		p = put_fixed(p, lh->scale);
+		p = PUT_LITERAL(p, ",\"adaptive_sync\":");
+		p = lh->adaptive_sync_state ? PUT_LITERAL(p, "true") : PUT_LITERAL(p, "false");
+		p = PUT_LITERAL(p, ",\"modes\":[");
+		for (uint32_t row = 0; row < modes->count; row++) {
+			if (row) {
+				*p++ = ',';
+			}
+			p = PUT_LITERAL(p, "{\"width\":");
+			p = put_int(p, modes->width[row]);
+			p = PUT_LITERAL(p, ",\"height\":");
+			p = put_int(p, modes->height[row]);
+			p = PUT_LITERAL(p, ",\"refresh\":");
+			p = put_int(p, modes->refresh[row]);
+			p = PUT_LITERAL(p, ",\"current\":");
+			p = modes->flags[row] & MODE_CURRENT ? PUT_LITERAL(p, "true") : PUT_LITERAL(p, "false");
+			p = PUT_LITERAL(p, ",\"preferred\":");
+			p = modes->flags[row] & MODE_PREFERRED ? PUT_LITERAL(p, "true}") : PUT_LITERAL(p, "false}");
+		}
+		p = PUT_LITERAL(p, "]}");
+	}
+	return PUT_LITERAL(p, "]}\n");
+}
+
+// one line per output: name, then key=value fields; the mode list ends the line
+static char * format_outputs_compact(char *p, struct wl_list *heads) {
+	struct local_head *lh;
+	wl_list_for_each(lh, heads, link) {
+		const struct mode_table *modes = &lh->modes;
+		const char *name = lh->name ? lh->name : "(unknown)";
+		p = put_bytes(p, name, strlen(name));
+		p = PUT_LITERAL(p, " enabled=");
+		*p++ = lh->enabled ? '1' : '0';
+		p = PUT_LITERAL(p, " pos=");
+		p = put_int(p, lh->pos_x);
+		*p++ = ',';
+		p = put_int(p, lh->pos_y);
+		p = PUT_LITERAL(p, " transform=");
+		p = put_int(p, lh->transform);
+		p = PUT_LITERAL(p, " scale=");
+		p = put_fixed(p, lh->scale);
+		p = PUT_LITERAL(p, " adaptivesync=");
+		*p++ = lh->adaptive_sync_state ? '1' : '0';
+		for (uint32_t row = 0; row < modes->count; row++) {
+			if (modes->flags[row] & MODE_CURRENT) {
+				p = PUT_LITERAL(p, " current=");
+				p = put_mode(p, modes, row);
+			}
+		}
+		for (uint32_t row = 0; row < modes->count; row++) {
+			if (modes->flags[row] & MODE_PREFERRED) {
+				p = PUT_LITERAL(p, " preferred=");
+				p = put_mode(p, modes, row);
+			}
+		}
+		p = PUT_LITERAL(p, " make=");
+		p = put_string(p, lh->make);
+		p = PUT_LITERAL(p, " model=");
+		p = put_string(p, lh->model);
+		p = PUT_LITERAL(p, " serial=");
+		p = put_string(p, lh->serial_number);
+		p = PUT_LITERAL(p, " modes=");
+		for (uint32_t row = 0; row < modes->count; row++) {
+			if (row) {
+				*p++ = ',';
+			}
+			p = put_mode(p, modes, row);
+		}
+		*p++ = '\n';
+	}
+	return p;
+}
+
+// renders the heads into output_buffer, returns the length or -1
+ssize_t format_outputs(struct wl_list *heads, int format) {
+	size_t bound = outputs_size_bound(heads);
+	if (bound > output_buffer.capacity) {
+		char *data = realloc(output_buffer.data, bound);
+		if (!data) {
+			return -1;
+		}
+		output_buffer.data = data;
+		output_buffer.capacity = bound;
+	}
+	char *end = format == OUTPUT_FORMAT_JSON ? format_outputs_json(output_buffer.data, heads)
+		: format_outputs_compact(output_buffer.data, heads);
+	return end - output_buffer.data;
+}
+
+int handle_print_outputs_format(struct wl_list *heads, int format) {
+	ssize_t len = format_outputs(heads, format);
+	if (len < 0) {
+		return 0;
+	}
+	// anything printf() buffered goes first
+	fflush(stdout);
+	struct iovec iov = { output_buffer.data, len };
+	write_all(STDOUT_FILENO, &iov, 1);
+	return 1;
+}
+
+// watch - writes the change sets recorded since *seen, each as it is printed
+// by changes. Returns 0 if sets were lost because the reader fell behind.
+int watch_write(int fd, uint64_t *seen) {
+	int complete = 1;
+	if (change_history.total - *seen > CHANGE_HISTORY) {
+		*seen = change_history.total - CHANGE_HISTORY;
+		complete = 0;
+	}
+	for (; *seen < change_history.total; (*seen)++) {
+		struct change_set *set = &change_history.sets[*seen % CHANGE_HISTORY];
+		char header[32];
+		int header_len = snprintf(header, sizeof(header), "serial %u\n", set->serial);
+		struct iovec iov[2] = { { header, header_len }, { set->text, set->len } };
+		write_all(fd, iov, 2);
+	}
+	return complete;
+}
+
+// state cache - the heads as of the last change, saved to a binary file and
+// mapped at the next start, so list_outputs can answer before the compositor
+// has enumerated anything. The mode arrays of the cached heads point straight
+// into the mapping. Once the live enumeration is complete the cache is
+// compared with it, stale entries are reported and the mapping is dropped.
+
+static uint32_t cache_string(char *strings, uint32_t *size, const char *s) {
+	if (!s) {
+		return STATE_CACHE_NO_STRING;
+	}
+	uint32_t offset = *size;
+	size_t len = strlen(s) + 1;
+	memcpy(strings + offset, s, len);
+	*size += len;
+	return offset;
+}
+
+int state_cache_save() {
+	if (!state_cache.path[0]) {
+		return 0;
+	}
+	uint32_t head_count = 0, mode_count = 0;
+	size_t strings_bound = 0;
+	struct local_head *lh;
+	wl_list_for_each(lh, &heads, link) {
+		head_count++;
+		mode_count += lh->modes.count;
+		const char *strings[] = { lh->name, lh->description, lh->make, lh->model, lh->serial_number, lh->identity };
+		for (int i = 0; i < 6; i++) {
+			strings_bound += strings[i] ? strlen(strings[i]) + 1 : 0;
+		}
+	}
+	size_t size = sizeof(struct state_cache_header) + head_count * sizeof(struct state_cache_head)
+		+ mode_count * (3 * sizeof(int32_t) + sizeof(uint8_t)) + strings_bound;
+	char *data = malloc(size);
+	if (!data) {
+		return 0;
+	}
+
+	struct state_cache_header *header = (struct state_cache_header *)data;
+	struct state_cache_head *records = (struct state_cache_head *)(header + 1);
+	int32_t *width = (int32_t *)(records + head_count);
+	int32_t *height = width + mode_count;
+	int32_t *refresh = height + mode_count;
+	uint8_t *flags = (uint8_t *)(refresh + mode_count);
+	char *strings = (char *)(flags + mode_count);
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, STATE_CACHE_MAGIC, 4);
+	header->version = STATE_CACHE_VERSION;
+	header->head_count = head_count;
+	header->mode_count = mode_count;
+	header->saved_at = time(NULL);
+
+	uint32_t strings_size = 0, first_mode = 0;
+	struct state_cache_head *record = records;
+	wl_list_for_each(lh, &heads, link) {
+		const struct mode_table *modes = &lh->modes;
+		record->name = cache_string(strings, &strings_size, lh->name);
+		record->description = cache_string(strings, &strings_size, lh->description);
+		record->make = cache_string(strings, &strings_size, lh->make);
+		record->model = cache_string(strings, &strings_size, lh->model);
+		record->serial_number = cache_string(strings, &strings_size, lh->serial_number);
+		record->identity = cache_string(strings, &strings_size, lh->identity);
+		record->physical_width = lh->physical_width;
+		record->physical_height = lh->physical_height;
+		record->enabled = lh->enabled;
+		record->pos_x = lh->pos_x;
+		record->pos_y = lh->pos_y;
+		record->transform = lh->transform;
+		record->scale = lh->scale;
+		record->adaptive_sync = lh->adaptive_sync_state;
+		record->first_mode = first_mode;
+		record->mode_count = modes->count;
+		memcpy(width + first_mode, modes->width, modes->count * sizeof(int32_t));
+		memcpy(height + first_mode, modes->height, modes->count * sizeof(int32_t));
+		memcpy(refresh + first_mode, modes->refresh, modes->count * sizeof(int32_t));
+		memcpy(flags + first_mode, modes->flags, modes->count);
+		first_mode += modes->count;
+		record++;
+	}
+	header->strings_size = strings_size;
+	size = (strings + strings_size) - data;
+
+	// written next to the cache, synced and renamed over it: a reader never
+	// sees half a file, not even after a crash
+	char tmp_path[sizeof(state_cache.path) + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state_cache.path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	int ok = fd >= 0;
+	if (ok) {
+		struct iovec iov = { data, size };
+		ok = write_all(fd, &iov, 1) && fsync(fd) == 0;
+		ok = close(fd) == 0 && ok && rename(tmp_path, state_cache.path) == 0;
+	}
+	free(data);
+	if (!ok) {
+		log_event(log_file_path, 2, "State cache - cannot write %s\n", state_cache.path);
+		unlink(tmp_path);
+		return 0;
+	}
+	log_event(log_file_path, 1, "State cache - saved %u heads\n", head_count);
+	return 1;
+}
+
+static const char * cached_string(const char *strings, uint32_t size, uint32_t offset, int *valid) {
+	if (offset == STATE_CACHE_NO_STRING) {
+		return NULL;
+	}
+	if (offset >= size) {
+		*valid = 0;
+		return NULL;
+	}
+	return strings + offset;
+}
+
+// maps the cache and builds the cached heads, returns 0 if there is no usable cache
+int state_cache_load() {
+	if (!state_cache.path[0]) {
+		return 0;
+	}
+	int fd = open(state_cache.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct state_cache_header)) {
+		close(fd);
+		return 0;
+	}
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+
+	const struct state_cache_header *header = (const struct state_cache_header *)data;
+	uint64_t expected = sizeof(*header) + (uint64_t)header->head_count * sizeof(struct state_cache_head)
+		+ (uint64_t)header->mode_count * (3 * sizeof(int32_t) + sizeof(uint8_t)) + header->strings_size;
+	const struct state_cache_head *records = (const struct state_cache_head *)(header + 1);
+	const int32_t *width = (const int32_t *)(records + header->head_count);
+	const int32_t *height = width + header->mode_count;
+	const int32_t *refresh = height + header->mode_count;
+	const uint8_t *flags = (const uint8_t *)(refresh + header->mode_count);
+	const char *strings = (const char *)(flags + header->mode_count);
+	int valid = memcmp(header->magic, STATE_CACHE_MAGIC, 4) == 0 && header->version == STATE_CACHE_VERSION
+		&& expected == (uint64_t)st.st_size && (header->strings_size == 0 || strings[header->strings_size - 1] == '\0');
+
+	struct local_head *cached = valid && header->head_count ? calloc(header->head_count, sizeof(struct local_head)) : NULL;
+	if (valid && header->head_count && !cached) {
+		valid = 0;
+	}
+	wl_list_init(&state_cache.heads);
+	for (uint32_t i = 0; valid && i < header->head_count; i++) {
+		const struct state_cache_head *record = &records[i];
+		struct local_head *lh = &cached[i];
+		if ((uint64_t)record->first_mode + record->mode_count > header->mode_count) {
+			valid = 0;
+			break;
+		}
+		lh->name = (char *)cached_string(strings, header->strings_size, record->name, &valid);
+		lh->description = (char *)cached_string(strings, header->strings_size, record->description, &valid);
+		lh->make = (char *)cached_string(strings, header->strings_size, record->make, &valid);
+		lh->model = (char *)cached_string(strings, header->strings_size, record->model, &valid);
+		lh->serial_number = (char *)cached_string(strings, header->strings_size, record->serial_number, &valid);
+		lh->identity = (char *)cached_string(strings, header->strings_size, record->identity, &valid);
+		lh->physical_width = record->physical_width;
+		lh->physical_height = record->physical_height;
+		lh->enabled = record->enabled;
+		lh->pos_x = record->pos_x;
+		lh->pos_y = record->pos_y;
+		lh->transform = record->transform;
+		lh->scale = record->scale;
+		lh->adaptive_sync_state = record->adaptive_sync;
+		lh->modes.count = lh->modes.capacity = record->mode_count;
+		lh->modes.width = (int32_t *)width + record->first_mode;
+		lh->modes.height = (int32_t *)height + record->first_mode;
+		lh->modes.refresh = (int32_t *)refresh + record->first_mode;
+		lh->modes.flags = (uint8_t *)flags + record->first_mode;
+		wl_list_insert(state_cache.heads.prev, &lh->link);
+	}
+	if (!valid) {
+		log_event(log_file_path, 2, "State cache - %s is not a valid cache, ignored\n", state_cache.path);
+		free(cached);
+		munmap(data, st.st_size);
+		wl_list_init(&state_cache.heads);
+		return 0;
+	}
+	state_cache.data = data;
+	state_cache.size = st.st_size;
+	state_cache.cached_heads = cached;
+	state_cache.head_count = header->head_count;
+	state_cache.saved_at = header->saved_at;
+	state_cache.loaded = 1;
+	log_event(log_file_path, 1, "State cache - mapped %u heads\n", header->head_count);
+	return 1;
+}
+
+void state_cache_unload() {
+	if (!state_cache.loaded) {
+		return;
+	}
+	free(state_cache.cached_heads);
+	munmap(state_cache.data, state_cache.size);
+	state_cache.cached_heads = NULL;
+	state_cache.data = NULL;
+	wl_list_init(&state_cache.heads);
+	state_cache.loaded = 0;
+}
+
+// The cached head's monitor among the live heads: on the same connector if it
+// is still there, else wherever its make|model|serial is now plugged in.
+static struct local_head * find_live_head(const struct local_head *cached) {
+	struct local_head *lh = cached->name ? head_index_find(&heads_by_name, cached->name) : NULL;
+	if (lh && cached->identity && lh->identity && strcmp(cached->identity, lh->identity) == 0) {
+		return lh;
+	}
+	int ambiguous;
+	return cached->identity ? head_index_find_unique(&heads_by_identity, cached->identity, &ambiguous) : NULL;
+}
+
+static int cached_head_differs(const struct local_head *cached, const struct local_head *lh) {
+	if (cached->enabled != lh->enabled || cached->pos_x != lh->pos_x || cached->pos_y != lh->pos_y
+			|| cached->transform != lh->transform || cached->scale != lh->scale
+			|| cached->adaptive_sync_state != lh->adaptive_sync_state || cached->modes.count != lh->modes.count
+			|| !cached->name || !lh->name || strcmp(cached->name, lh->name) != 0) {
+		return 1;
+	}
+	uint32_t count = lh->modes.count;
+	return memcmp(cached->modes.width, lh->modes.width, count * sizeof(int32_t)) != 0
+		|| memcmp(cached->modes.height, lh->modes.height, count * sizeof(int32_t)) != 0
+		|| memcmp(cached->modes.refresh, lh->modes.refresh, count * sizeof(int32_t)) != 0
+		|| memcmp(cached->modes.flags, lh->modes.flags, count) != 0;
+}
+
+// Called at the first done, once the live state is complete. Cached heads
+// that are gone or differ are stale, as are live heads the cache did not
+// have; they are logged, and reported if list_outputs was answered from the
+// cache. The cache is rewritten unless it matched.
+void state_cache_reconcile() {
+	int stale = 0;
+	if (state_cache.loaded) {
+		uint32_t live_count = 0, matched = 0;
+		struct local_head *lh;
+		wl_list_for_each(lh, &heads, link) {
+			live_count++;
+		}
+		for (uint32_t i = 0; i < state_cache.head_count; i++) {
+			const struct local_head *cached = &state_cache.cached_heads[i];
+			struct local_head *live = find_live_head(cached);
+			const char *name = cached->name ? cached->name : "(unknown)";
+			const char *reason = !live ? "removed" : cached_head_differs(cached, live) ? "changed" : NULL;
+			matched += live != NULL;
+			if (reason) {
+				stale++;
+				log_event(log_file_path, 1, "State cache - %s is stale (%s)\n", name, reason);
+				if (state_cache.answered) {
+					fprintf(stderr, "Cached state of %s was stale: %s\n", name, reason);
+				}
+			}
+		}
+		if (live_count > matched) {
+			stale++;
+			log_event(log_file_path, 1, "State cache - %u outputs were not cached\n", live_count - matched);
+			if (state_cache.answered) {
+				fprintf(stderr, "Cached state was missing %u outputs\n", live_count - matched);
+			}
+		}
+		if (!stale) {
+			log_event(log_file_path, 1, "State cache - matches the live state\n");
+		}
+	}
+	if (!state_cache.loaded || stale) {
+		state_cache_save();
+	}
+	state_cache_unload();
+}
+
+// event trace - with --record every event of the registry, the output manager,
+// the heads and the modes goes through trace_dispatch(), which appends it to
+// the trace and then calls the listener. --replay feeds a trace to the same
+// listeners, on a display with no compositor behind it, as fast as possible or
+// at the recorded pace.
+
+static const struct wl_interface * const trace_interfaces[TRACE_INTERFACES] = {
+	[TRACE_REGISTRY] = &wl_registry_interface,
+	[TRACE_OUTPUT_MANAGER] = &zwlr_output_manager_v1_interface,
+	[TRACE_HEAD] = &zwlr_output_head_v1_interface,
+	[TRACE_MODE] = &zwlr_output_mode_v1_interface,
+};
+
+static void trace_flush() {
+	if (trace_recorder->len > 0) {
+		struct iovec iov = { trace_recorder->buffer, trace_recorder->len };
+		write_all(trace_recorder->fd, &iov, 1);
+		trace_recorder->len = 0;
+	}
+}
+
+int trace_open(const char *path) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return 0;
+	}
+	trace_recorder = malloc(sizeof(struct trace_recorder));
+	if (!trace_recorder) {
+		close(fd);
+		return 0;
+	}
+	trace_recorder->fd = fd;
+	trace_recorder->start_ns = monotonic_ns();
+	trace_recorder->events = 0;
+	struct trace_header header = { .version = TRACE_VERSION, .recorded_at = time(NULL) };
+	memcpy(header.magic, TRACE_MAGIC, 4);
+	memcpy(trace_recorder->buffer, &header, sizeof(header));
+	trace_recorder->len = sizeof(header);
+	log_event(log_file_path, 1, "Recording events to %s\n", path);
+	return 1;
+}
+
+void trace_close() {
+	if (!trace_recorder) {
+		return;
+	}
+	trace_flush();
+	close(trace_recorder->fd);
+	log_event(log_file_path, 1, "Recorded %llu events\n", (unsigned long long)trace_recorder->events);
+	free(trace_recorder);
+	trace_recorder = NULL;
+}
+
+// the argument types of a message, without the version and nullable marks;
+// returns 0 if it has more than TRACE_MAX_ARGS
+static int trace_signature(const struct wl_message *msg, char *sig) {
+	int count = 0;
+	for (const char *c = msg->signature; *c; c++) {
+		if (*c == '?' || (*c >= '0' && *c <= '9')) {
+			continue;
+		}
+		if (count == TRACE_MAX_ARGS) {
+			return 0;
+		}
+		sig[count++] = *c;
+	}
+	sig[count] = '\0';
+	return 1;
+}
+
+static size_t trace_string_len(const char *s) {
+	if (!s) {
+		return 0;
+	}
+	size_t len = strnlen(s, TRACE_STRING_MAX - 1);
+	return len + 1;
+}
+
+static void trace_write_event(struct wl_proxy *proxy, int interface, uint32_t opcode, const char *sig, const union wl_argument *args) {
+	size_t size = 0;
+	for (int i = 0; sig[i]; i++) {
+		size += sig[i] == 's' ? sizeof(uint16_t) + trace_string_len(args[i].s) : sizeof(uint32_t);
+	}
+	if (trace_recorder->len + sizeof(struct trace_record) + size > TRACE_BUFFER_SIZE) {
+		trace_flush();
+	}
+	struct trace_record record = {
+		.ns = monotonic_ns() - trace_recorder->start_ns,
+		.object = wl_proxy_get_id(proxy),
+		.interface = interface,
+		.opcode = opcode,
+		.size = size,
+	};
+	char *p = trace_recorder->buffer + trace_recorder->len;
+	memcpy(p, &record, sizeof(record));
+	p += sizeof(record);
+	for (int i = 0; sig[i]; i++) {
+		uint32_t value;
+		if (sig[i] == 's') {
+			uint16_t len = trace_string_len(args[i].s);
+			memcpy(p, &len, sizeof(len));
+			p += sizeof(len);
+			if (len) {
+				// a string cut at TRACE_STRING_MAX still ends with its NUL
+				memcpy(p, args[i].s, len - 1);
+				p[len - 1] = '\0';
+				p += len;
+			}
+			continue;
+		}
+		if (sig[i] == 'o' || sig[i] == 'n') {
+			value = args[i].o ? wl_proxy_get_id((struct wl_proxy *)args[i].o) : 0;
+		} else {
+			value = args[i].u;
+		}
+		memcpy(p, &value, sizeof(value));
+		p += sizeof(value);
+	}
+	trace_recorder->len = p - trace_recorder->buffer;
+	trace_recorder->events++;
+}
+
+// Calls the listener's handler for the event. Every event of the traced
+// interfaces has one of these signatures; integers, fixed point numbers and
+// uint32_t are passed the same way.
+static int trace_invoke(const void *listener, struct wl_proxy *proxy, uint32_t opcode, const char *sig, const union wl_argument *args) {
+	void (*handler)(void) = ((void (* const *)(void))listener)[opcode];
+	void *data = wl_proxy_get_user_data(proxy);
+	if (!handler) {
+		return 1;
+	}
+	if (sig[0] == '\0') {
+		((void (*)(void *, struct wl_proxy *))handler)(data, proxy);
+	} else if (strcmp(sig, "i") == 0 || strcmp(sig, "u") == 0 || strcmp(sig, "f") == 0) {
+		((void (*)(void *, struct wl_proxy *, uint32_t))handler)(data, proxy, args[0].u);
+	} else if (strcmp(sig, "s") == 0) {
+		((void (*)(void *, struct wl_proxy *, const char *))handler)(data, proxy, args[0].s);
+	} else if (strcmp(sig, "o") == 0 || strcmp(sig, "n") == 0) {
+		((void (*)(void *, struct wl_proxy *, void *))handler)(data, proxy, args[0].o);
+	} else if (strcmp(sig, "ii") == 0) {
+		((void (*)(void *, struct wl_proxy *, int32_t, int32_t))handler)(data, proxy, args[0].i, args[1].i);
+	} else if (strcmp(sig, "usu") == 0) {
+		((void (*)(void *, struct wl_proxy *, uint32_t, const char *, uint32_t))handler)(data, proxy, args[0].u, args[1].s, args[2].u);
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+static int trace_dispatch(const void *listener, void *target, uint32_t opcode, const struct wl_message *msg, union wl_argument *args) {
+	struct wl_proxy *proxy = target;
+	const char *class = wl_proxy_get_class(proxy);
+	char sig[TRACE_MAX_ARGS + 1];
+	if (!trace_signature(msg, sig)) {
+		return 0;
+	}
+	for (int i = 0; trace_recorder && i < TRACE_INTERFACES; i++) {
+		if (strcmp(class, trace_interfaces[i]->name) == 0) {
+			trace_write_event(proxy, i, opcode, sig, args);
+			break;
+		}
+	}
+	if (!trace_invoke(listener, proxy, opcode, sig, args)) {
+		log_event(log_file_path, 2, "Trace - no handler for %s event %s\n", class, msg->name);
+	}
+	return 0;
+}
+
+// adds the listener, through the recorder while a trace is recorded
+void trace_add_listener(void *proxy, const void *listener, void *data) {
+	if (trace_recorder) {
+		wl_proxy_add_dispatcher(proxy, trace_dispatch, listener, data);
+	} else {
+		wl_proxy_add_listener(proxy, (void (**)(void))listener, data);
+	}
+}
+
+static struct wl_proxy ** trace_proxy_slot(struct trace_proxies *proxies, uint32_t id, int grow) {
+	if (id < TRACE_SERVER_ID_START) {
+		return NULL;
+	}
+	uint32_t index = id - TRACE_SERVER_ID_START;
+	if (index >= proxies->size) {
+		if (!grow) {
+			return NULL;
+		}
+		uint32_t size = proxies->size ? proxies->size : 64;
+		while (size <= index) {
+			size *= 2;
+		}
+		struct wl_proxy **proxy = realloc(proxies->proxy, size * sizeof(struct wl_proxy *));
+		if (!proxy) {
+			return NULL;
+		}
+		memset(proxy + proxies->size, 0, (size - proxies->size) * sizeof(struct wl_proxy *));
+		proxies->proxy = proxy;
+		proxies->size = size;
+	}
+	return &proxies->proxy[index];
+}
+
+// decodes one record and calls its listener, returns 0 if it could not be replayed
+static int trace_replay_event(struct trace_proxies *proxies, const struct trace_record *record, const char *p) {
+	const struct wl_interface *interface = trace_interfaces[record->interface];
+	if (record->opcode >= interface->event_count) {
+		return 0;
+	}
+	const struct wl_message *msg = &interface->events[record->opcode];
+	char sig[TRACE_MAX_ARGS + 1];
+	if (!trace_signature(msg, sig)) {
+		return 0;
+	}
+	struct wl_proxy *target = NULL;
+	if (record->interface == TRACE_REGISTRY) {
+		target = (struct wl_proxy *)registry;
+	} else if (record->interface == TRACE_OUTPUT_MANAGER) {
+		target = (struct wl_proxy *)output_manager;
+	} else {
+		struct wl_proxy **slot = trace_proxy_slot(proxies, record->object, 0);
+		target = slot ? *slot : NULL;
+	}
+	if (!target || !wl_proxy_get_listener(target)) {
+		return 0;
+	}
+
+	const char *end = p + record->size;
+	union wl_argument args[TRACE_MAX_ARGS];
+	for (int i = 0; sig[i]; i++) {
+		if (sig[i] == 's') {
+			uint16_t len;
+			if (end - p < (ptrdiff_t)sizeof(len)) {
+				return 0;
+			}
+			memcpy(&len, p, sizeof(len));
+			p += sizeof(len);
+			if (end - p < len || (len && p[len - 1] != '\0')) {
+				return 0;
+			}
+			args[i].s = len ? p : NULL;
+			p += len;
+			continue;
+		}
+		uint32_t value;
+		if (end - p < (ptrdiff_t)sizeof(value)) {
+			return 0;
+		}
+		memcpy(&value, p, sizeof(value));
+		p += sizeof(value);
+		if (sig[i] == 'n') {
+			struct wl_proxy **slot = trace_proxy_slot(proxies, value, 1);
+			if (!slot) {
+				return 0;
+			}
+			*slot = wl_proxy_create(target, msg->types[i]);
+			args[i].o = (struct wl_object *)*slot;
+		} else if (sig[i] == 'o') {
+			struct wl_proxy **slot = trace_proxy_slot(proxies, value, 0);
+			args[i].o = slot ? (struct wl_object *)*slot : NULL;
+		} else {
+			args[i].u = value;
+		}
+	}
+	return trace_invoke(wl_proxy_get_listener(target), target, record->opcode, sig, args);
+}
+
+// Feeds the recorded events to the listeners, speed times faster than they
+// were recorded or as fast as possible if speed is 0. Returns 0 if the trace
+// cannot be read.
+int trace_replay(struct wl_display *display, const char *path, uint32_t speed) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("Cannot open trace");
+		return 0;
+	}
+	struct stat st;
+	char *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct trace_header)) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	struct trace_header header;
+	if (data != MAP_FAILED) {
+		memcpy(&header, data, sizeof(header));
+	}
+	if (data == MAP_FAILED || memcmp(header.magic, TRACE_MAGIC, 4) != 0 || header.version != TRACE_VERSION) {
+		fprintf(stderr, "%s is not an event trace\n", path);
+		if (data != MAP_FAILED) {
+			munmap(data, st.st_size);
+		}
+		return 0;
+	}
+	log_event(log_file_path, 1, "Replaying events from %s\n", path);
+
+	struct trace_proxies proxies = { 0 };
+	uint64_t events = 0, skipped = 0, first_ns = 0;
+	uint64_t start_ns = monotonic_ns();
+	const char *p = data + sizeof(header), *end = data + st.st_size;
+	while (end - p >= (ptrdiff_t)sizeof(struct trace_record)) {
+		struct trace_record record;
+		memcpy(&record, p, sizeof(record));
+		p += sizeof(record);
+		if (end - p < record.size || record.interface >= TRACE_INTERFACES) {
+			p = end + 1;
+			break;
+		}
+		if (speed) {
+			// at the recorded pace, relative to the first event
+			if (events + skipped == 0) {
+				first_ns = record.ns;
+			}
+			uint64_t due_ns = start_ns + (record.ns - first_ns) / speed;
+			struct timespec due = { due_ns / 1000000000ULL, due_ns % 1000000000ULL };
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+		}
+		if (trace_replay_event(&proxies, &record, p)) {
+			events++;
+		} else {
+			skipped++;
+		}
+		p += record.size;
+	}
+	uint64_t elapsed_ns = monotonic_ns() - start_ns;
+	free(proxies.proxy);
+	munmap(data, st.st_size);
+	wl_display_flush(display);
+
+	if (p != end) {
+		fprintf(stderr, "Trace %s is truncated\n", path);
+	}
+	if (skipped) {
+		fprintf(stderr, "%llu events were for unknown objects and skipped\n", (unsigned long long)skipped);
+	}
+	printf("Replayed %llu events in %.2f ms (%.0f events/s)\n", (unsigned long long)events,
+		elapsed_ns / 1e6, elapsed_ns ? events * 1e9 / elapsed_ns : 0.0);
+	log_event(log_file_path, 1, "Replayed %llu events, %llu skipped\n", (unsigned long long)events, (unsigned long long)skipped);
+	return 1;
+}
+
+// whether the command line starts with the given command word
+static int is_command(const char *line, const char *command) {
+	size_t len = strlen(command);
+	line += strspn(line, " \t");
+	return strncmp(line, command, len) == 0 && (line[len] == '\0' || line[len] == ' ' || line[len] == '\t');
+}
+
+// Until the first done only what does not need the heads runs, and
+// list_outputs if the cache can answer it.
+int command_ready(const char *line) {
+	return state_ready || is_command(line, "monitor") || is_command(line, "stats") || is_command(line, "profiles")
+		|| is_command(line, "results") || is_command(line, "exit")
+		|| (state_cache.loaded && is_command(line, "list_outputs"));
+}
+
+struct command_result * fill_res (struct command_result * res, int cmd, int val, int err){
+	res->command = cmd;
+	res->validity = val;
+	res->error_code = err;
+	return res;
+}
+
+// One "keyword value" pair of a set_output line or a profile output into
+// settings. Returns 0 or the error code of the property; mode and cmode
+// exclude each other and every property may be given once.
+int parse_output_setting(struct output_settings *settings, int keyword, const struct token *value) {
+	struct output_settings *s = settings;
+	uint32_t bit;
+	int error, ok;
+	switch (keyword) {
+		case KEYWORD_MODE:
+		case KEYWORD_CMODE:
+			bit = keyword == KEYWORD_MODE ? OUTPUT_SET_MODE : OUTPUT_SET_CMODE;
+			error = keyword == KEYWORD_MODE ? 8 : 9;
+			ok = !(s->set & (OUTPUT_SET_MODE | OUTPUT_SET_CMODE))
+				&& parse_mode(value->text, value->len, &s->width, &s->height, &s->refresh);
+			break;
+		case KEYWORD_POS:
+			bit = OUTPUT_SET_POSITION;
+			error = 10;
+			ok = parse_int_pair(value->text, value->len, ',', &s->x, &s->y);
+			break;
+		case KEYWORD_TRANSFORM: {
+			int32_t transform;
+			bit = OUTPUT_SET_TRANSFORM;
+			error = 11;
+			ok = parse_int(value->text, value->len, &transform) && transform >= 0 && transform <= 7;
+			if (ok) {
+				s->transform = transform;
+			}
+			break;
+		}
+		case KEYWORD_SCALE:
+			bit = OUTPUT_SET_SCALE;
+			error = 12;
+			ok = parse_fixed(value->text, value->len, &s->scale) && s->scale > 0;
+			break;
+		case KEYWORD_ADAPTIVE_SYNC: {
+			int32_t adaptive_sync;
+			bit = OUTPUT_SET_ADAPTIVE_SYNC;
+			error = 13;
+			ok = parse_int(value->text, value->len, &adaptive_sync) && (adaptive_sync == 0 || adaptive_sync == 1);
+			if (ok) {
+				s->adaptive_sync = adaptive_sync;
+			}
+			break;
+		}
+		case KEYWORD_ENABLED:
+			bit = OUTPUT_SET_ENABLED;
+			error = 19;
+			ok = parse_int(value->text, value->len, &s->enabled) && (s->enabled == 0 || s->enabled == 1);
+			break;
+		default:
+			return 6;
+	}
+	if (!ok || (s->set & bit)) {
+		return error;
+	}
+	s->set |= bit;
+	return 0;
+}
+
+// set_output / test_output HEAD followed by up to MAX_SUBCMDS "property value" pairs
+static struct command_result * parse_set_output(struct command_result * res, int command, struct tokenizer * tk){
+	struct set_output_parser * change = &res->change;
+	struct token name, subcmd, value;
+	memset(change, 0, sizeof(struct set_output_parser));
+	if (!next_token(tk, &name)){
+		return fill_res(res, command, 0, 2);
+	}
+	int ambiguous;
+	struct local_head * lh = find_head(name.text, &ambiguous);
+	if (!lh){
+		return fill_res(res, command, 0, ambiguous ? 33 : 3);
+	}
+	change->head = lh;
+
+	int num_subcommands = 0;
+	while (next_token(tk, &subcmd)){
+		if (++num_subcommands > MAX_SUBCMDS){
+			return fill_res(res, command, 0, 4);
+		}
+		if (!next_token(tk, &value)){
+			return fill_res(res, command, 0, 6);
+		}
+		int keyword = keyword_lookup(&subcmd);
+		int error = parse_output_setting(&change->settings, keyword, &value);
+		if (error){
+			return fill_res(res, command, 0, error);
+		}
+		if (keyword == KEYWORD_MODE){
+			const struct output_settings * s = &change->settings;
+			int row = mode_table_find(&lh->modes, s->width, s->height, s->refresh);
+			if (row < 0){
+				return fill_res(res, command, 0, 8);
+			}
+			change->mode = lh->modes.proxy[row];
+		}
+	}
+	if (num_subcommands == 0){
+		return fill_res(res, command, 0, 5);
+	}
+
+	const struct output_settings * s = &change->settings;
+	// a disabled output only accepts changes together with enabled 1
+	if (!lh->enabled && !((s->set & OUTPUT_SET_ENABLED) && s->enabled)){
+		return fill_res(res, command, 0, 3);
+	}
+	log_event(log_file_path, 1 , "Valid set_output subcommands found\n");
+	return fill_res(res, command, 1, 0);
+}
+
+// Parses and, for the commands that only print, runs one command line. The
+// result goes into res, which is returned; nothing is allocated.
+struct command_result * parse_command(char * cmd, struct command_result * res){
+
+	struct tokenizer tk = { cmd };
+	struct token param_one, param_two, param_three, param_four;
+	res->tag[0] = '\0';
+	res->request = NULL;
+
+	// CASE - NO COMMAND
+	if (!next_token(&tk, &param_one)) {
+		return fill_res(res, 0, 0, 1);
+	}
+
+	// "@tag" in front of a configuration command
+	int keyword = keyword_lookup(&param_one);
+	if (param_one.text[0] == '@') {
+		if (param_one.len < 2 || param_one.len > CONFIG_TAG_MAX || !next_token(&tk, &param_two)) {
+			return fill_res(res, 0, 0, 30);
+		}
+		memcpy(res->tag, param_one.text + 1, param_one.len);
+		param_one = param_two;
+		keyword = keyword_lookup(&param_one);
+		if (keyword != KEYWORD_SET_OUTPUT && keyword != KEYWORD_TEST_OUTPUT && keyword != KEYWORD_COMMIT) {
+			return fill_res(res, 0, 0, 30);
+		}
+	}
+
+	switch (keyword){
+
+	// CASE - LIST_OUTPUTS
+	case KEYWORD_LIST_OUTPUTS: {
+		int has_format = next_token(&tk, &param_two);
+		int format = has_format ? keyword_lookup(&param_two) : KEYWORD_NONE;
+		if (has_format && ((format != KEYWORD_JSON && format != KEYWORD_COMPACT) || next_token(&tk, &param_three))){
+			return fill_res(res, 1, 0, 26);
+		}
+		// before the first done the cache answers, if there is one
+		struct wl_list * source = &heads;
+		if (!state_ready && state_cache.loaded){
+			source = &state_cache.heads;
+			state_cache.answered = 1;
+			char saved[32];
+			time_t saved_at = state_cache.saved_at;
+			strftime(saved, sizeof(saved), "%Y-%m-%d %H:%M:%S", localtime(&saved_at));
+			fprintf(stderr, "Outputs as cached at %s, not yet confirmed by the compositor\n", saved);
+		}
+		if (!has_format){
+			handle_print_outputs(source);
+		} else if (!handle_print_outputs_format(source, format == KEYWORD_JSON ? OUTPUT_FORMAT_JSON : OUTPUT_FORMAT_COMPACT)){
+			return fill_res(res, 1, 0, 7);
+		}
+		return fill_res(res, 1, 1, 0);
+	}
+
+	// CASE - SET_OUTPUT / TEST_OUTPUT
+	case KEYWORD_SET_OUTPUT:
+		// inside a transaction the tag goes on the commit
+		if (res->tag[0] && transaction_open){
+			return fill_res(res, 2, 0, 30);
+		}
+		return parse_set_output(res, 2, &tk);
+
+	case KEYWORD_TEST_OUTPUT:
+		return parse_set_output(res, 8, &tk);
+
+	// CASE - MONITOR
+	case KEYWORD_MONITOR: {
+		int has_mode = next_token(&tk, &param_two);
+		int mode = has_mode ? keyword_lookup(&param_two) : KEYWORD_NONE;
+		const char *from = NULL, *to = NULL;
+		if (mode == KEYWORD_SINGLE){
+			if (!next_token(&tk, &param_three)){
+				return fill_res(res, 3, 0, 16);
+			}
+			from = to = param_three.text;
+		} else if (mode == KEYWORD_PERIOD){
+			if (!next_token(&tk, &param_three) || !next_token(&tk, &param_four)){
+				return fill_res(res, 3, 0, 17);
+			}
+			from = param_three.text;
+			to = param_four.text;
+		} else if (has_mode){
+			return fill_res(res, 3, 0, 14);
+		}
+		int64_t key, span;
+		if (from && (!parse_timestamp_key(from, strlen(from), &key, &span) || !parse_timestamp_key(to, strlen(to), &key, &span))){
+			return fill_res(res, 3, 0, mode == KEYWORD_SINGLE ? 16 : 17);
+		}
+
+		log_flush();
+		int fd = open(log_file_path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			perror("Error opening log file for reading");
+			return fill_res(res, 3, 0, 15);
+		}
+		// records go straight to the stdout descriptor, don't let them overtake buffered output
+		fflush(stdout);
+		int printed = from ? print_log_records(fd, from, to, STDOUT_FILENO) : print_log_all(fd, STDOUT_FILENO);
+		close(fd);
+		if (!printed) {
+			perror("Error reading log file");
+			return fill_res(res, 3, 0, 15);
+		}
+		return fill_res(res, 3, 1, 0);
+	}
+
+	// CASE - TRANSACTIONS
+	case KEYWORD_BEGIN:
+		return transaction_open ? fill_res(res, 5, 0, 20) : fill_res(res, 5, 1, 0);
+
+	case KEYWORD_COMMIT:
+		return !transaction_open ? fill_res(res, 6, 0, 21) : fill_res(res, 6, 1, 0);
+
+	case KEYWORD_ABORT:
+		return !transaction_open ? fill_res(res, 7, 0, 21) : fill_res(res, 7, 1, 0);
+
+	// CASE - CHANGES
+	case KEYWORD_CHANGES: {
+		int32_t count = 1;
+		if (next_token(&tk, &param_two)){
+			if (!parse_int(param_two.text, param_two.len, &count) || count <= 0 || next_token(&tk, &param_three)){
+				return fill_res(res, 10, 0, 27);
+			}
+			if (count > CHANGE_HISTORY){
+				count = CHANGE_HISTORY;
+			}
+		}
+		handle_print_changes(count);
+		return fill_res(res, 10, 1, 0);
+	}
+
+	// CASE - WATCH / UNWATCH
+	case KEYWORD_WATCH:
+	case KEYWORD_UNWATCH: {
+		int command = keyword_lookup(&param_one) == KEYWORD_WATCH ? 11 : 12;
+		if (next_token(&tk, &param_two)){
+			return fill_res(res, command, 0, 28);
+		}
+		return fill_res(res, command, 1, 0);
+	}
+
+	// CASE - STATS
+	case KEYWORD_STATS:
+		if (!next_token(&tk, &param_two)){
+			handle_print_stats();
+		} else if (keyword_lookup(&param_two) == KEYWORD_RESET){
+			memset(&latency_stats, 0, sizeof(latency_stats));
+		} else {
+			return fill_res(res, 9, 0, 23);
+		}
+		return fill_res(res, 9, 1, 0);
+
+	// CASE - PROFILES
+	case KEYWORD_PROFILES:
+		if (next_token(&tk, &param_two)){
+			return fill_res(res, 13, 0, 29);
+		}
+		handle_print_profiles();
+		return fill_res(res, 13, 1, 0);
+
+	// CASE - RESULTS / WAIT
+	case KEYWORD_RESULTS:
+		if (next_token(&tk, &param_two)){
+			const char * tag = param_two.text + (param_two.text[0] == '@');
+			if (strlen(tag) == 0 || strlen(tag) >= CONFIG_TAG_MAX || next_token(&tk, &param_three)){
+				return fill_res(res, 14, 0, 32);
+			}
+			snprintf(res->tag, sizeof(res->tag), "%s", tag);
+		}
+		handle_print_results(res->tag);
+		return fill_res(res, 14, 1, 0);
+
+	case KEYWORD_WAIT:
+		// waits for one tag, or for every tagged configuration; run_command() waits
+		if (next_token(&tk, &param_two)){
+			const char * tag = param_two.text + (param_two.text[0] == '@');
+			if (strlen(tag) == 0 || strlen(tag) >= CONFIG_TAG_MAX || next_token(&tk, &param_three)){
+				return fill_res(res, 15, 0, 32);
+			}
+			if (!config_tag_known(tag)){
+				return fill_res(res, 15, 0, 31);
+			}
+			snprintf(res->tag, sizeof(res->tag), "%s", tag);
+		}
+		return fill_res(res, 15, 1, 0);
+
+	case KEYWORD_EXIT:
+		return fill_res(res, 4, 1, 0);
+
+	default:
+		return fill_res(res, 0, 0, 1);
+	}
+}
+
+const char* get_error_message(uint32_t error_code) {
+    switch (error_code) {
+        case 0: return "NO_ERROR";
+        case 1: return "INVALID_MAIN_COMMAND";
+        case 2: return "COMMAND_INCOMPLETE";
+        case 3: return "INVALID_OUTPUT_HEAD";
+        case 4: return "EXCEEDED_MAX_SUBCMDS";
+        case 5: return "NO_SUBCOMMANDS";
+        case 6: return "INVALID_SUBCOMMAND";
+        case 7: return "MEMORY_NOT_ALLOCATED";
+        case 8: return "INVALID_SUBCOMMAND_MODE";
+        case 9: return "INVALID_SUBCOMMAND_CMODE";
+        case 10: return "INVALID_SUBCOMMAND_POS";
+        case 11: return "INVALID_SUBCOMMAND_TRANSFORM";
+        case 12: return "INVALID_SUBCOMMAND_SCALE";
+        case 13: return "INVALID_SUBCOMMAND_ADAPTIVE_SYNC";
+        case 14: return "INVALID_MONITOR_COMMAND";
+        case 15: return "LOG_FILE_ERROR";
+        case 16: return "INVALID_MONITOR_SINGLE";
+        case 17: return "INVALID_MONITOR_PERIOD";
+        case 18: return "INVALID_MONITOR_MULTIPLE";
+        case 19: return "INVALID_SUBCOMMAND_ENABLED";
+        case 20: return "TRANSACTION_ALREADY_OPEN";
+        case 21: return "NO_OPEN_TRANSACTION";
+        case 22: return "NO_OUTPUT_MANAGER";
+        case 23: return "INVALID_STATS_COMMAND";
+        case 24: return "NOT_AVAILABLE_IN_DAEMON";
+        case 25: return "REQUEST_TOO_LONG";
+        case 26: return "INVALID_LIST_OUTPUTS";
+        case 27: return "INVALID_CHANGES_COMMAND";
+        case 28: return "INVALID_WATCH_COMMAND";
+        case 29: return "INVALID_PROFILES_COMMAND";
+        case 30: return "INVALID_TAG";
+        case 31: return "UNKNOWN_TAG";
+        case 32: return "INVALID_RESULTS_COMMAND";
+        case 33: return "AMBIGUOUS_OUTPUT_HEAD";
+        default: return "UNKNOWN_ERROR";
+    }
+}
+
+	
+
+// Changes are parsed into the command result; only those that outlive the
+// line are copied into a list node.
+
+struct set_output_parser * change_node(const struct set_output_parser *change) {
+	struct set_output_parser *sop = malloc(sizeof(struct set_output_parser));
+	if (!sop) {
+		return NULL;
+	}
+	*sop = *change;
+	wl_list_init(&sop->link);
+	return sop;
+}
+
+// Changes queued between begin and commit, at most one per head: a second
+// set_output for the same head replaces the first.
+
+int queue_output_change(const struct set_output_parser *change) {
+	struct set_output_parser *queued, *tmp;
+	wl_list_for_each_safe(queued, tmp, &pending_outputs, link) {
+		if (queued->head == change->head) {
+			wl_list_remove(&queued->link);
+			free(queued);
+			log_event(log_file_path, 1, "Queued change replaced by a later set_output\n");
+		}
+	}
+	struct set_output_parser *sop = change_node(change);
+	if (!sop) {
+		return 0;
+	}
+	wl_list_insert(pending_outputs.prev, &sop->link);
+	return 1;
+}
+
+// Batch mode merges consecutive set_output lines for the same head property by
+// property, a later value wins. mode and cmode exclude each other.
+
+int merge_output_change(struct wl_list *changes, const struct set_output_parser *change) {
+	struct set_output_parser *queued;
+	wl_list_for_each(queued, changes, link) {
+		if (queued->head != change->head) {
+			continue;
+		}
+		struct output_settings *to = &queued->settings;
+		const struct output_settings *from = &change->settings;
+		if (from->set & (OUTPUT_SET_MODE | OUTPUT_SET_CMODE)) {
+			to->set &= ~(OUTPUT_SET_MODE | OUTPUT_SET_CMODE);
+			to->width = from->width;
+			to->height = from->height;
+			to->refresh = from->refresh;
+			queued->mode = change->mode;
+		}
+		if (from->set & OUTPUT_SET_POSITION) {
+			to->x = from->x;
+			to->y = from->y;
+		}
+		if (from->set & OUTPUT_SET_TRANSFORM) {
+			to->transform = from->transform;
+		}
+		if (from->set & OUTPUT_SET_SCALE) {
+			to->scale = from->scale;
+		}
+		if (from->set & OUTPUT_SET_ADAPTIVE_SYNC) {
+			to->adaptive_sync = from->adaptive_sync;
+		}
+		if (from->set & OUTPUT_SET_ENABLED) {
+			to->enabled = from->enabled;
+		}
+		to->set |= from->set;
+		log_event(log_file_path, 1, "Set Output merged into the queued change\n");
+		return 1;
+	}
+	struct set_output_parser *sop = change_node(change);
+	if (!sop) {
+		return 0;
+	}
+	wl_list_insert(changes->prev, &sop->link);
+	return 1;
+}
+
+void free_changes(struct wl_list *changes) {
+	struct set_output_parser *sop, *tmp;
+	wl_list_for_each_safe(sop, tmp, changes, link) {
+		wl_list_remove(&sop->link);
+		free(sop);
+	}
+}
+
+void transaction_discard() {
+	free_changes(&pending_outputs);
+}
+
+// A head or mode can go away while a transaction is open or a request is in
+// flight. A queued change that refers to it is dropped rather than left
+// dangling; a sent one is only detached, as the configuration will be
+// cancelled and its retry looks the head and mode up again.
+
+static void drop_changes(struct wl_list *changes, struct local_head *lh, struct zwlr_output_mode_v1 *lm, int detach) {
+	struct set_output_parser *sop, *tmp;
+	wl_list_for_each_safe(sop, tmp, changes, link) {
+		if (lh && sop->head == lh && detach) {
+			const char *target = head_lookup_name(lh);
+			snprintf(sop->target, sizeof(sop->target), "%s", target ? target : "");
+			sop->head = NULL;
+			sop->mode = NULL;
+		} else if (lm && sop->mode == lm && detach) {
+			sop->mode = NULL;
+		} else if ((lh && sop->head == lh) || (lm && sop->mode == lm)) {
+			wl_list_remove(&sop->link);
+			free(sop);
+			log_event(log_file_path, 2, "%s removed, its change is dropped\n", lh ? "Output" : "Mode");
+		}
+	}
+}
+
+static void forget_in_requests(struct local_head *lh, struct zwlr_output_mode_v1 *lm) {
+	struct config_request *req;
+	wl_list_for_each(req, &config_requests, link) {
+		drop_changes(&req->changes, lh, lm, 1);
+	}
+}
+
+void transaction_forget_head(struct local_head *lh) {
+	drop_changes(&pending_outputs, lh, NULL, 0);
+	forget_in_requests(lh, NULL);
+}
+
+void transaction_forget_mode(struct zwlr_output_mode_v1 *lm) {
+	drop_changes(&pending_outputs, NULL, lm, 0);
+	forget_in_requests(NULL, lm);
+}
+
+void free_config_request(struct config_request *req) {
+	free_changes(&req->changes);
+	free(req);
+}
+
+static void set_head_properties(struct zwlr_output_configuration_head_v1 *head_config, const struct set_output_parser *sop) {
+	const struct output_settings *s = &sop->settings;
+	if ((s->set & OUTPUT_SET_MODE) && sop->mode){
+		zwlr_output_configuration_head_v1_set_mode(head_config, sop->mode);
+		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_mode\n");
+	}
+	if (s->set & OUTPUT_SET_POSITION){
+		zwlr_output_configuration_head_v1_set_position(head_config, s->x, s->y);
+		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_position\n");
+	}
+	if (s->set & OUTPUT_SET_CMODE){
+		zwlr_output_configuration_head_v1_set_custom_mode(head_config, s->width, s->height, s->refresh);
+		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_custom_mode\n");
+	}
+	if (s->set & OUTPUT_SET_TRANSFORM){
+		zwlr_output_configuration_head_v1_set_transform(head_config, s->transform);
+		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_transform\n");
+	}
+	if (s->set & OUTPUT_SET_SCALE){
+		zwlr_output_configuration_head_v1_set_scale(head_config, s->scale);
+		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_scale\n");
+	}
+	if (s->set & OUTPUT_SET_ADAPTIVE_SYNC){
+		zwlr_output_configuration_head_v1_set_adaptive_sync(head_config, s->adaptive_sync);
+		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_head_v1 - set_adaptive_sync\n");
+	}
+}
+
+// Builds a single configuration for the whole layout, so any number of
+// changed heads costs one modeset. The protocol requires every head to appear
+// in the configuration: heads without a change are enabled or disabled as they
+// are now and keep their other properties.
+
+struct zwlr_output_configuration_v1 * build_configuration(struct config_request *req) {
+	struct zwlr_output_configuration_v1 *config = zwlr_output_manager_v1_create_configuration(output_manager, current_serial);
+	req->serial = current_serial;
+	log_event(log_file_path, 5 , "SENT: zwlr_output_manager_v1 - create_configuration\n");
+	zwlr_output_configuration_v1_add_listener(config, &configuration_object_listener, req);
+	log_event(log_file_path, 1 , "Local reference to configuration object - created\n");
+	log_event(log_file_path, 1 , "Local reference to configuration object - listeners added\n");
+
+	struct local_head *lh;
+	wl_list_for_each(lh, &heads, link){
+		struct set_output_parser *sop = NULL, *change;
+		wl_list_for_each(change, &req->changes, link){
+			if (change->head == lh){
+				sop = change;
+				break;
+			}
+		}
+
+		int enable = lh->enabled;
+		if (sop && (sop->settings.set & OUTPUT_SET_ENABLED)){
+			enable = sop->settings.enabled;
+		}
+
+		if (enable){
+			struct zwlr_output_configuration_head_v1 *head_config = zwlr_output_configuration_v1_enable_head(config, lh->head);
+			log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_v1 - enable_head\n");
+			log_event(log_file_path, 1 , "Local reference to head config - created\n");
+			if (sop){
+				set_head_properties(head_config, sop);
+			}
+			// the protocol has no destructor request, the proxy is only needed for the setters
+			zwlr_output_configuration_head_v1_destroy(head_config);
+		} else {
+			zwlr_output_configuration_v1_disable_head(config, lh->head);
+			log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_v1 - disable_head\n");
+		}
+	}
+	return config;
+}
+
+static void send_configuration(struct wl_display * display, struct config_request * req) {
+	req->config = build_configuration(req);
+	if (req->mode == CONFIG_APPLY){
+		zwlr_output_configuration_v1_apply(req->config);
+		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_v1 - apply\n");
+	} else {
+		zwlr_output_configuration_v1_test(req->config);
+		log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_v1 - test\n");
+	}
+	req->sent_ns = monotonic_ns();
+	// the result arrives through the event loop, no need to block on it
+	wl_display_flush(display);
+}
+
+// Sends the changes as one configuration. CONFIG_TEST only asks the compositor
+// whether it would accept them, CONFIG_TEST_THEN_APPLY applies them once the
+// test has succeeded. The changes move into the request, which is returned so
+// the caller can set done; it is freed after the result. Any number of
+// requests can be in flight, a tagged one keeps its result for results/wait.
+
+struct config_request * apply_output_changes(struct wl_display * display, struct wl_list * changes, int mode, const char * tag) {
+	if (!output_manager){
+		return NULL;
+	}
+	struct config_request *req = calloc(1, sizeof(struct config_request));
+	if (!req){
+		return NULL;
+	}
+	req->id = next_config_id++;
+	snprintf(req->tag, sizeof(req->tag), "%s", tag ? tag : "");
+	req->mode = mode;
+	req->requested_mode = mode;
+	req->outcome = -1;
+	wl_list_init(&req->changes);
+	wl_list_insert_list(&req->changes, changes);
+	wl_list_init(changes);
+	req->kinds = config_request_kinds(req);
+	req->submitted_ns = monotonic_ns();
+	wl_list_insert(config_requests.prev, &req->link);
+	send_configuration(display, req);
+	return req;
+}
+
+const char * config_outcome_name(int outcome, int mode) {
+	switch (outcome) {
+		case OUTCOME_SUCCEEDED: return mode == CONFIG_TEST ? "passed" : "applied";
+		case OUTCOME_FAILED: return "failed";
+		case OUTCOME_CANCELLED: return "cancelled";
+		default: return "pending";
+	}
+}
+
+// a tagged request's result, kept for results / wait; the oldest is overwritten
+static void config_result_record(const struct config_request * req) {
+	struct config_result *r = &config_results[config_results_next++ % CONFIG_RESULTS_MAX];
+	memcpy(r->tag, req->tag, sizeof(r->tag));
+	r->id = req->id;
+	r->mode = req->requested_mode;
+	r->outcome = req->outcome;
+	r->attempts = req->attempts;
+	r->elapsed_us = (monotonic_ns() - req->submitted_ns) / 1000;
+	r->reported = 0;
+}
+
+// the result of the request arrived: hand it to done and free the request
+void config_request_finish(struct config_request * req, int outcome) {
+	req->outcome = outcome;
+	wl_list_remove(&req->link);
+	log_event(log_file_path, 1, "Configuration %u%s%s %s\n", req->id, req->tag[0] ? " @" : "", req->tag,
+		config_outcome_name(outcome, req->requested_mode));
+	if (req->tag[0]) {
+		config_result_record(req);
+	}
+	if (req->done) {
+		req->done(req);
+	}
+	free_config_request(req);
+}
+
+// the owner of data is going away, its requests complete without callback
+void config_requests_forget_data(void * data) {
+	struct config_request *req;
+	wl_list_for_each(req, &config_requests, link) {
+		if (req->done_data == data) {
+			req->done = NULL;
+			req->done_data = NULL;
+		}
+	}
+}
+
+// at exit, whatever is still in flight is dropped
+void config_requests_free() {
+	struct config_request *req, *tmp;
+	wl_list_for_each_safe(req, tmp, &config_requests, link) {
+		if (req->config) {
+			zwlr_output_configuration_v1_destroy(req->config);
+			log_event(log_file_path, 5 , "SENT: zwlr_output_configuration_v1 - destroy\n");
+		}
+		wl_list_remove(&req->link);
+		free_config_request(req);
+	}
+}
+
+// whether a configuration is in flight or waiting to be sent again
+int configuration_pending() {
+	return !wl_list_empty(&config_requests);
+}
+
+// whether an untagged configuration is outstanding, the commands after it
+// wait for its result
+int configuration_blocking() {
+	struct config_request *req;
+	wl_list_for_each(req, &config_requests, link) {
+		if (!req->tag[0]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int config_tag_matches(const char * tag, const char * wanted) {
+	return tag[0] && (!wanted[0] || strcmp(tag, wanted) == 0);
+}
+
+// whether a tagged configuration, the one tagged so or any if tag is empty,
+// has not got its result yet
+int config_tag_pending(const char * tag) {
+	struct config_request *req;
+	wl_list_for_each(req, &config_requests, link) {
+		if (config_tag_matches(req->tag, tag)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// whether the tag is in flight or has a result not reported yet
+int config_tag_known(const char * tag) {
+	if (config_tag_pending(tag)) {
+		return 1;
+	}
+	for (uint32_t i = 0; i < CONFIG_RESULTS_MAX; i++) {
+		if (!config_results[i].reported && config_tag_matches(config_results[i].tag, tag)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Prints the tagged configurations still in flight and the results not
+// reported yet, oldest first, for one tag or all. Printed results are dropped.
+void handle_print_results(const char * tag) {
+	int printed = 0;
+	uint32_t first = config_results_next > CONFIG_RESULTS_MAX ? config_results_next - CONFIG_RESULTS_MAX : 0;
+	for (uint32_t n = first; n < config_results_next; n++) {
+		struct config_result *r = &config_results[n % CONFIG_RESULTS_MAX];
+		if (r->reported || !config_tag_matches(r->tag, tag)) {
+			continue;
+		}
+		if (!printed++) {
+			printf("%-20s %6s  %-9s %8s %10s\n", "tag", "id", "result", "retries", "ms");
+		}
+		printf("@%-19s %6u  %-9s %8u %10.2f\n", r->tag, r->id, config_outcome_name(r->outcome, r->mode),
+			r->attempts, r->elapsed_us / 1e3);
+		r->reported = 1;
+	}
+	uint64_t now = monotonic_ns();
+	struct config_request *req;
+	wl_list_for_each(req, &config_requests, link) {
+		if (!config_tag_matches(req->tag, tag)) {
+			continue;
+		}
+		if (!printed++) {
+			printf("%-20s %6s  %-9s %8s %10s\n", "tag", "id", "result", "retries", "ms");
+		}
+		printf("@%-19s %6u  %-9s %8u %10.2f\n", req->tag, req->id, "pending", req->attempts,
+			(now - req->submitted_ns) / 1e6);
+	}
+	if (!printed) {
+		printf("No tagged configurations\n");
+	}
+}
+
+static int apply_in_flight() {
+	struct config_request *req;
+	wl_list_for_each(req, &config_requests, link) {
+		if (req->config && req->mode == CONFIG_APPLY) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// retry - a configuration cancelled because the outputs changed under it
+// (hotplug, a flaky link, another configuration applied first) is sent again
+// against the state of a later done, after an exponential backoff and at most
+// retry_attempts times. The changes are kept as values: the heads and modes
+// are looked up again before every attempt.
+
+// A retry is due once its backoff has passed and a done has refreshed the
+// state. A compositor that cancelled without a new serial gets the same
+// configuration again after CONFIG_RETRY_MAX_MS more.
+static uint64_t config_retry_due_ns(const struct config_request *req) {
+	return req->retry_ns + (current_serial == req->serial ? (uint64_t)CONFIG_RETRY_MAX_MS * 1000000 : 0);
+}
+
+// poll() timeout until the next waiting configuration is due, -1 if there is none
+int config_retry_timeout() {
+	uint64_t now = monotonic_ns(), due = UINT64_MAX;
+	struct config_request *req;
+	wl_list_for_each(req, &config_requests, link) {
+		if (!req->config && config_retry_due_ns(req) < due) {
+			due = config_retry_due_ns(req);
+		}
+	}
+	if (due == UINT64_MAX) {
+		return -1;
+	}
+	return due <= now ? 0 : (int)((due - now + 999999) / 1000000);
+}
+
+// Checks the changes against the refreshed heads: a head that went away must
+// be back, a mode must still be advertised and a disabled output must be
+// enabled by the change. Returns NULL, or why the retry is given up.
+static const char * config_retry_revalidate(struct config_request *req) {
+	if (wl_list_empty(&req->changes)) {
+		return "nothing left to change";
+	}
+	struct set_output_parser *sop;
+	wl_list_for_each(sop, &req->changes, link) {
+		int ambiguous;
+		if (!sop->head && !(sop->head = find_head(sop->target, &ambiguous))) {
+			return ambiguous ? "output ambiguous" : "output gone";
+		}
+		const struct output_settings *s = &sop->settings;
+		if (s->set & OUTPUT_SET_MODE) {
+			int row = mode_table_find(&sop->head->modes, s->width, s->height, s->refresh);
+			if (row < 0) {
+				return "mode no longer advertised";
+			}
+			sop->mode = sop->head->modes.proxy[row];
+		}
+		if (!sop->head->enabled && !(s->set & OUTPUT_SET_ENABLED && s->enabled) && (s->set & ~OUTPUT_SET_ENABLED)) {
+			return "output disabled";
+		}
+	}
+	return NULL;
+}
+
+// sends the waiting configurations that are due, one at a time while an
+// apply is in flight, as its result changes the serial again
+void config_retry_run(struct wl_display * display) {
+	struct config_request *req, *tmp;
+	uint64_t now = monotonic_ns();
+	wl_list_for_each_safe(req, tmp, &config_requests, link) {
+		if (req->config || now < config_retry_due_ns(req)) {
+			continue;
+		}
+		if (apply_in_flight()) {
+			return;
+		}
+		const char *reason = output_manager ? config_retry_revalidate(req) : "no output manager";
+		if (reason) {
+			log_event(log_file_path, 2, "Configuration %u retry given up: %s\n", req->id, reason);
+			if (req->mode != CONFIG_APPLY && !req->tag[0]) {
+				printf("Test cancelled: the output state changed, nothing was applied\n");
+			}
+			config_request_finish(req, OUTCOME_CANCELLED);
+			continue;
+		}
+		log_event(log_file_path, 1, "Configuration %u retry %u against serial %u\n", req->id, req->attempts, current_serial);
+		req->mode = req->requested_mode;
+		send_configuration(display, req);
+	}
+}
+
+// wl_display_dispatch() that also wakes up for, and sends, a configuration
+// due to be retried
+int dispatch_display(struct wl_display * display) {
+	struct pollfd pfd = { .fd = wl_display_get_fd(display), .events = POLLIN };
+	while (wl_display_prepare_read(display) != 0) {
+		if (wl_display_dispatch_pending(display) < 0) {
+			return -1;
+		}
+	}
+	wl_display_flush(display);
+	int ready = poll(&pfd, 1, config_retry_timeout());
+	if (ready <= 0) {
+		wl_display_cancel_read(display);
+		if (ready < 0 && errno != EINTR) {
+			return -1;
+		}
+	} else if (wl_display_read_events(display) < 0) {
+		return -1;
+	}
+	int dispatched = wl_display_dispatch_pending(display);
+	if (dispatched >= 0) {
+		config_retry_run(display);
+	}
+	return dispatched;
+}
+
+// set_output and test_output outside a transaction
+
+static void run_output_change(struct wl_display * display, struct command_result * cmd, int mode) {
+	struct set_output_parser * sop = change_node(&cmd->change);
+	if (!sop){
+		perror("Cannot allocate the change");
+		return;
+	}
+	struct wl_list changes;
+	wl_list_init(&changes);
+	wl_list_insert(&changes, &sop->link);
+	cmd->request = apply_output_changes(display, &changes, mode, cmd->tag);
+	if (!cmd->request){
+		perror("No output manager to configure outputs");
+		wl_list_remove(&sop->link);
+		free(sop);
+	}
+}
+
+// profiles - layouts applied on their own when the outputs they describe are
+// connected. The profile file holds
+//     profile NAME
+//     output "make|model|serial" [connector NAME] [mode W,H@R | cmode W,H@R] [pos X,Y] [transform T] [scale S] [adaptivesync 0|1] [enabled 0|1]
+// lines, a profile's outputs being the exact set of heads it is for. An
+// identity listed more than once (identical monitors without a serial number)
+// tells them apart by connector. Each
+// profile is keyed by an order independent hash of that set, the sum of the
+// mixed hashes of its identities, so a done costs one pass over the heads and
+// one table lookup however many profiles there are.
+
+static struct profile_set profiles = { .active = -1 };
+
+static uint64_t profile_identity_key(const char *identity) {
+	// FNV-1a alone mixes the high bits poorly for a sum, finish with splitmix64
+	uint64_t h = hash_string(identity);
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static const char * profile_add(const struct token *name) {
+	if (name->len >= PROFILE_NAME_MAX) {
+		return "profile name too long";
+	}
+	if (profiles.count == profiles.capacity) {
+		uint32_t capacity = profiles.capacity ? profiles.capacity * 2 : PROFILE_MIN_SLOTS;
+		struct profile *grown = realloc(profiles.profiles, capacity * sizeof(struct profile));
+		if (!grown) {
+			return "out of memory";
+		}
+		profiles.profiles = grown;
+		profiles.capacity = capacity;
+	}
+	struct profile *p = &profiles.profiles[profiles.count++];
+	memset(p, 0, sizeof(*p));
+	memcpy(p->name, name->text, name->len + 1);
+	p->first_output = profiles.output_count;
+	return NULL;
+}
+
+// the output line after "output": the identity and its settings, added to the last profile
+static const char * profile_add_output(const char *identity, struct tokenizer *tk) {
+	const char *bar = strchr(identity, '|');
+	if (!bar || !strchr(bar + 1, '|') || strchr(strchr(bar + 1, '|') + 1, '|')) {
+		return "output is not \"make|model|serial\"";
+	}
+	struct profile *p = &profiles.profiles[profiles.count - 1];
+	if (profiles.output_count == profiles.output_capacity) {
+		uint32_t capacity = profiles.output_capacity ? profiles.output_capacity * 2 : PROFILE_MIN_SLOTS;
+		struct profile_output *grown = realloc(profiles.outputs, capacity * sizeof(struct profile_output));
+		if (!grown) {
+			return "out of memory";
+		}
+		profiles.outputs = grown;
+		profiles.output_capacity = capacity;
+	}
+	struct profile_output *out = &profiles.outputs[profiles.output_count];
+	struct token connector = { NULL, 0 };
+	memset(out, 0, sizeof(*out));
+	for (struct token setting, value; next_token(tk, &setting); ) {
+		if (!next_token(tk, &value)) {
+			return "setting without value";
+		}
+		int keyword = keyword_lookup(&setting);
+		if (keyword == KEYWORD_CONNECTOR) {
+			if (connector.text) {
+				return "connector given twice";
+			}
+			connector = value;
+			continue;
+		}
+		int error = parse_output_setting(&out->settings, keyword, &value);
+		if (error) {
+			return get_error_message(error);
+		}
+	}
+	// the same identity twice is told apart by connector, each needs its own
+	for (uint32_t i = p->first_output; i < profiles.output_count; i++) {
+		const struct profile_output *other = &profiles.outputs[i];
+		if (strcmp(other->identity, identity) == 0
+			&& (!connector.text || !other->connector || strcmp(other->connector, connector.text) == 0)) {
+			return "output listed twice without a connector of its own";
+		}
+	}
+	out->identity = strdup(identity);
+	out->connector = connector.text ? strdup(connector.text) : NULL;
+	if (!out->identity || (connector.text && !out->connector)) {
+		free(out->identity);
+		free(out->connector);
+		return "out of memory";
+	}
+	profiles.output_count++;
+	p->output_count++;
+	return NULL;
+}
+
+// keys every profile and fills the lookup table, two profiles may not have the same outputs
+static int profiles_compile() {
+	uint32_t capacity = PROFILE_MIN_SLOTS;
+	while (capacity < profiles.count * 2) {
+		capacity *= 2;
+	}
+	profiles.slots = calloc(capacity, sizeof(uint32_t));
+	if (!profiles.slots) {
+		fprintf(stderr, "%s: out of memory\n", profiles.path);
+		return 0;
+	}
+	profiles.slot_mask = capacity - 1;
+	for (uint32_t i = 0; i < profiles.count; i++) {
+		struct profile *p = &profiles.profiles[i];
+		if (p->output_count == 0) {
+			fprintf(stderr, "%s: profile %s has no outputs\n", profiles.path, p->name);
+			return 0;
+		}
+		for (uint32_t o = 0; o < p->output_count; o++) {
+			p->key += profile_identity_key(profiles.outputs[p->first_output + o].identity);
+		}
+		uint32_t slot = p->key & profiles.slot_mask;
+		for (; profiles.slots[slot]; slot = (slot + 1) & profiles.slot_mask) {
+			struct profile *other = &profiles.profiles[profiles.slots[slot] - 1];
+			if (other->key == p->key && other->output_count == p->output_count) {
+				fprintf(stderr, "%s: profiles %s and %s are for the same outputs\n", profiles.path, other->name, p->name);
+				return 0;
+			}
+		}
+		profiles.slots[slot] = i + 1;
+	}
+	return 1;
+}
+
+// Reads and compiles the profile file. A missing file is only an error if
+// required, returns 0 on errors, which are printed with their line.
+int profiles_load(const char *path, int required) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		if (!required && errno == ENOENT) {
+			return 1;
+		}
+		fprintf(stderr, "Cannot open profiles %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	snprintf(profiles.path, sizeof(profiles.path), "%s", path);
+	char line[PROFILE_LINE_MAX];
+	int line_number = 0;
+	const char *error = NULL;
+	while (!error && fgets(line, sizeof(line), file)) {
+		line_number++;
+		line[strcspn(line, "\r\n")] = '\0';
+		struct tokenizer tk = { line };
+		struct token word, name, extra;
+		if (!next_token(&tk, &word) || word.text[0] == '#') {
+			continue;
+		}
+		switch (keyword_lookup(&word)) {
+			case KEYWORD_PROFILE:
+				error = !next_token(&tk, &name) || next_token(&tk, &extra) ? "profile takes one name" : profile_add(&name);
+				break;
+			case KEYWORD_OUTPUT:
+				error = profiles.count == 0 ? "output before the first profile"
+					: !next_token(&tk, &name) ? "output without \"make|model|serial\"" : profile_add_output(name.text, &tk);
+				break;
+			default:
+				error = "expected profile or output";
+		}
+	}
+	fclose(file);
+	if (error) {
+		fprintf(stderr, "%s:%d: %s\n", path, line_number, error);
+		profiles_free();
+		return 0;
+	}
+	if (!profiles_compile()) {
+		profiles_free();
+		return 0;
+	}
+	log_event(log_file_path, 1, "Profiles - %u profiles loaded from %s\n", profiles.count, path);
+	return 1;
+}
+
+void profiles_free() {
+	for (uint32_t i = 0; i < profiles.output_count; i++) {
+		free(profiles.outputs[i].identity);
+		free(profiles.outputs[i].connector);
+	}
+	free(profiles.outputs);
+	free(profiles.profiles);
+	free(profiles.slots);
+	memset(&profiles, 0, sizeof(profiles));
+	profiles.active = -1;
+}
+
+// whether the head differs from what the profile gives it
+static int profile_output_differs(struct local_head *lh, const struct profile_output *out) {
+	const struct output_settings *s = &out->settings;
+	int enabled = s->set & OUTPUT_SET_ENABLED ? s->enabled : lh->enabled;
+	if (enabled != lh->enabled) {
+		return 1;
+	}
+	if (!enabled) {
+		return 0;
+	}
+	int current = -1;
+	for (uint32_t row = 0; row < lh->modes.count; row++) {
+		if (lh->modes.flags[row] & MODE_CURRENT) {
+			current = row;
+			break;
+		}
+	}
+	return ((s->set & (OUTPUT_SET_MODE | OUTPUT_SET_CMODE)) && (current < 0 || lh->modes.width[current] != s->width
+			|| lh->modes.height[current] != s->height || lh->modes.refresh[current] != s->refresh))
+		|| ((s->set & OUTPUT_SET_POSITION) && (lh->pos_x != s->x || lh->pos_y != s->y))
+		|| ((s->set & OUTPUT_SET_TRANSFORM) && lh->transform != (int32_t)s->transform)
+		|| ((s->set & OUTPUT_SET_SCALE) && lh->scale != s->scale)
+		|| ((s->set & OUTPUT_SET_ADAPTIVE_SYNC) && lh->adaptive_sync_state != s->adaptive_sync);
+}
+
+// the change set_output would make for the profile's output, NULL if the mode is not advertised
+static struct set_output_parser * profile_output_change(struct local_head *lh, const struct profile_output *out) {
+	struct set_output_parser change = { .head = lh, .settings = out->settings };
+	if (out->settings.set & OUTPUT_SET_MODE) {
+		int row = mode_table_find(&lh->modes, out->settings.width, out->settings.height, out->settings.refresh);
+		if (row < 0) {
+			return NULL;
+		}
+		change.mode = lh->modes.proxy[row];
+	}
+	return change_node(&change);
+}
+
+// The head the profile's output is for: the one with its identity or, when
+// identical monitors share it, the one on the output's connector. NULL with
+// *ambiguous set if the identity is shared and the output has no connector.
+static struct local_head * profile_output_head(const struct profile_output *out, int *ambiguous) {
+	struct local_head *lh = head_index_find_unique(&heads_by_identity, out->identity, ambiguous);
+	if (*ambiguous && out->connector) {
+		*ambiguous = 0;
+		lh = head_index_find(&heads_by_name, out->connector);
+		if (lh && (!lh->identity || strcmp(lh->identity, out->identity) != 0)) {
+			lh = NULL;
+		}
+	}
+	return lh;
+}
+
+// Called at every done once the state is ready. The connected heads are only
+// looked at again once their set changed, so a layout the user changes by
+// hand is left alone until the next hotplug. While a configuration is in
+// flight the match waits for the done that follows its result.
+void profiles_match(struct wl_display *display, uint64_t done_ns) {
+	if (profiles.count == 0 || configuration_pending()) {
+		return;
+	}
+	uint64_t key = 0;
+	uint32_t count = 0;
+	struct local_head *lh;
+	wl_list_for_each(lh, &heads, link) {
+		if (lh->identity) {
+			key += profile_identity_key(lh->identity);
+		}
+		count++;
+	}
+	if (key == profiles.topology && count == profiles.topology_count) {
+		return;
+	}
+	profiles.topology = key;
+	profiles.topology_count = count;
+	profiles.active = -1;
+
+	struct profile *p = NULL;
+	for (uint32_t slot = key & profiles.slot_mask; profiles.slots[slot]; slot = (slot + 1) & profiles.slot_mask) {
+		struct profile *candidate = &profiles.profiles[profiles.slots[slot] - 1];
+		if (candidate->key == key && candidate->output_count == count) {
+			p = candidate;
+			break;
+		}
+	}
+	if (!p) {
+		log_event(log_file_path, 1, "Profiles - no profile for the %u connected outputs\n", count);
+		return;
+	}
+
+	// the key only says which profile to try, the identities decide
+	struct wl_list changes;
+	wl_list_init(&changes);
+	int differs = 0;
+	const char *error = NULL;
+	for (uint32_t o = 0; o < p->output_count && !error; o++) {
+		const struct profile_output *out = &profiles.outputs[p->first_output + o];
+		int ambiguous;
+		lh = profile_output_head(out, &ambiguous);
+		struct set_output_parser *sop = lh ? profile_output_change(lh, out) : NULL;
+		if (!lh) {
+			error = ambiguous ? "outputs ambiguous" : "outputs differ";
+		} else if (!sop) {
+			error = "mode not available";
+		} else {
+			differs |= profile_output_differs(lh, out);
+			wl_list_insert(changes.prev, &sop->link);
+		}
+	}
+	if (error || !differs) {
+		free_changes(&changes);
+		if (error) {
+			log_event(log_file_path, 2, "Profiles - %s not applied: %s\n", p->name, error);
+		} else {
+			log_event(log_file_path, 1, "Profiles - %s already in place\n", p->name);
+			profiles.active = p - profiles.profiles;
+		}
+		return;
+	}
+	if (!apply_output_changes(display, &changes, apply_mode, NULL)) {
+		free_changes(&changes);
+		log_event(log_file_path, 2, "Profiles - %s not applied: no output manager\n", p->name);
+		return;
+	}
+	uint64_t elapsed = monotonic_ns() - done_ns;
+	latency_record(&profiles.latency, elapsed, OUTCOME_SUCCEEDED);
+	p->applied++;
+	profiles.active = p - profiles.profiles;
+	log_event(log_file_path, 1, "Profiles - %s matched, configuration sent %.1f us after done\n", p->name, elapsed / 1e3);
+	printf("Profile %s applied\n", p->name);
+	fflush(stdout);
+}
+
+void handle_print_profiles() {
+	if (profiles.count == 0) {
+		printf("No profiles loaded\n");
+		return;
+	}
+	printf("%u profiles from %s\n", profiles.count, profiles.path);
+	for (uint32_t i = 0; i < profiles.count; i++) {
+		const struct profile *p = &profiles.profiles[i];
+		printf("  %-24s %3u outputs, applied %llu times%s\n", p->name, p->output_count,
+			(unsigned long long)p->applied, (int)i == profiles.active ? " (active)" : "");
+	}
+	const struct latency_histogram *hist = &profiles.latency;
+	if (hist->count) {
+		printf("Done to configuration sent (microseconds): count %llu, min %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+			(unsigned long long)hist->count, hist->min / 1e3, latency_percentile(hist, 50) / 1e3,
+			latency_percentile(hist, 99) / 1e3, hist->max / 1e3);
+	}
+}
+
+// runs one command line, returns 0 once the user asked to exit
+
+int handle_command(struct wl_display * display, char * input){
+	struct command_result res;
+	return run_command(display, parse_command(input, &res));
+}
+
+int run_command(struct wl_display * display, struct command_result * cmd){
+
+	if (cmd->validity == 0) {
+		log_event(log_file_path, 1, "Invalid Command");
+		log_event(log_file_path, 7, "Error: %s", get_error_message(cmd->error_code));
+		perror("Invalid Command\n");
+	}
+
+	else if (cmd->command == 1){
+		log_event(log_file_path, 1, "List Output command received");
+		log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
+	}
+
+	else if (cmd->command == 2){
+		log_event(log_file_path, 1, "Set Output command received");
+		if (!transaction_open){
+			run_output_change(display, cmd, apply_mode);
+		} else if (queue_output_change(&cmd->change)){
+			log_event(log_file_path, 1, "Set Output queued until commit");
+		} else {
+			perror("Cannot queue the change");
+		}
+	}
+
+	else if (cmd->command == 8){
+		log_event(log_file_path, 1, "Test Output command received");
+		run_output_change(display, cmd, CONFIG_TEST);
+	}
+
+	else if (cmd->command == 5){
+		log_event(log_file_path, 1, "Begin command received");
+		transaction_open = 1;
+	}
+
+	else if (cmd->command == 6){
+		log_event(log_file_path, 1, "Commit command received");
+		transaction_open = 0;
+		if (wl_list_empty(&pending_outputs)){
+			log_event(log_file_path, 1, "Nothing to commit");
+		} else if (!(cmd->request = apply_output_changes(display, &pending_outputs, apply_mode, cmd->tag))){
+			perror("No output manager to configure outputs");
+		}
+		transaction_discard();
+	}
+
+	else if (cmd->command == 7){
+		log_event(log_file_path, 1, "Abort command received");
+		transaction_open = 0;
+		transaction_discard();
+	}
+
+	else if (cmd->command == 11){
+		log_event(log_file_path, 1, "Watch command received");
+		// only changes from now on
+		watching = 1;
+		watch_seen = change_history.total;
+	}
+
+	else if (cmd->command == 12){
+		log_event(log_file_path, 1, "Unwatch command received");
+		watching = 0;
+	}
+
+	else if (cmd->command == 10){
+		log_event(log_file_path, 1, "Changes command received");
+		log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
+	}
+
+	else if (cmd->command == 13){
+		log_event(log_file_path, 1, "Profiles command received");
+		log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
+	}
+
+	else if (cmd->command == 14){
+		log_event(log_file_path, 1, "Results command received");
+		log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
+	}
+
+	else if (cmd->command == 15){
+		log_event(log_file_path, 1, "Wait command received");
+		while (config_tag_pending(cmd->tag) && dispatch_display(display) >= 0);
+		handle_print_results(cmd->tag);
+	}
+
+	else if (cmd->command == 9){
+		log_event(log_file_path, 1, "Stats command received");
+		log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
+	}
+
+	else if (cmd->command == 3){
+		log_event(log_file_path, 1, "Monitor command received");
+		log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
+	}
+
+	else if (cmd->command == 4){
+		log_event(log_file_path, 1, "Exit command received");
+		log_event(log_file_path, 7, "%s", get_error_message(cmd->error_code));
+		if (transaction_open){
+			log_event(log_file_path, 1, "Open transaction discarded");
+			transaction_open = 0;
+			transaction_discard();
+		}
+		return 0;
+	}
+
+	else {
+		log_event(log_file_path, 1, "Invalid command");
+		perror("Please type 'exit' to exit the program");
+	}
+
+	return 1;
+}
+
+// Runs the complete lines buffered from stdin. A line that applies a
+// configuration holds back the following ones until its result has been
+// dispatched, so they see the new state and serial. Returns 0 on `exit` or
+// once the input has ended and everything in it has run.
+
+static int run_buffered_commands(struct wl_display * display, struct command_input * in){
+	while (!configuration_blocking()){
+		char * newline = memchr(in->buffer, '\n', in->len);
+		size_t line_len;
+		if (newline){
+			*newline = '\0';
+			line_len = newline - in->buffer + 1;
+		} else if (in->len == sizeof(in->buffer) - 1 || (in->eof && in->len > 0)){
+			// line longer than the buffer runs as far as it fits, as with fgets(),
+			// and a last line without newline still runs
+			in->buffer[in->len] = '\0';
+			line_len = in->len;
+		} else {
+			break;
+		}
+		if (!command_ready(in->buffer)){
+			// runs once the first done has been dispatched
+			if (newline){
+				*newline = '\n';
+			}
+			break;
+		}
+
+		int keep_running = handle_command(display, in->buffer);
+		in->len -= line_len;
+		memmove(in->buffer, in->buffer + line_len, in->len);
+		if (!keep_running){
+			return 0;
+		}
+		printf("$ ");
+		fflush(stdout);
+	}
+	return !in->eof || in->len > 0 || configuration_blocking();
+}
+
+// dispatches until the first done, returns 0 if the connection is lost first
+int wait_for_state(struct wl_display * display){
+	while (!state_ready){
+		if (wl_display_dispatch(display) < 0){
+			log_event(log_file_path, 2, "Connection to Wayland display lost\n");
+			fprintf(stderr, "Connection to Wayland display lost\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int read_commands(struct wl_display * display, struct command_input * in){
+	ssize_t got = read(STDIN_FILENO, in->buffer + in->len, sizeof(in->buffer) - 1 - in->len);
+	if (got < 0){
+		return errno == EINTR || errno == EAGAIN;
+	}
+	if (got == 0){
+		in->eof = 1;
+	}
+	in->len += got;
+	return run_buffered_commands(display, in);
+}
+
+// Waits on the Wayland socket and stdin together, so compositor events are
+// dispatched as they arrive instead of only between two typed commands.
+
+void run_event_loop(struct wl_display * display){
+	struct command_input in = { .len = 0, .eof = 0 };
+	struct pollfd fds[2] = {
+		{ .fd = wl_display_get_fd(display), .events = POLLIN },
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+	};
+
+	printf("$ ");
+	fflush(stdout);
+
+	while (1){
+		while (wl_display_prepare_read(display) != 0){
+			wl_display_dispatch_pending(display);
+		}
+		fds[0].events = POLLIN;
+		if (wl_display_flush(display) < 0 && errno == EAGAIN){
+			fds[0].events |= POLLOUT;
+		}
+		// stdin waits while a configuration result or a full buffer is outstanding
+		int want_input = !in.eof && !configuration_blocking() && in.len < sizeof(in.buffer) - 1;
+		fds[1].events = want_input ? POLLIN : 0;
+
+		if (poll(fds, 2, config_retry_timeout()) < 0){
+			wl_display_cancel_read(display);
+			if (errno == EINTR){
+				continue;
+			}
+			perror("Error waiting for events");
+			return;
+		}
+
+		if (fds[0].revents & POLLIN){
+			if (wl_display_read_events(display) < 0){
+				log_event(log_file_path, 2, "Connection to Wayland display lost\n");
+				perror("Connection to Wayland display lost");
+				return;
+			}
+		} else {
+			wl_display_cancel_read(display);
+		}
+		if (wl_display_dispatch_pending(display) < 0 || (fds[0].revents & (POLLERR | POLLHUP))){
+			log_event(log_file_path, 2, "Connection to Wayland display lost\n");
+			fprintf(stderr, "Connection to Wayland display lost\n");
+			return;
+		}
+		config_retry_run(display);
+
+		if (watching){
+			fflush(stdout);
+			watch_write(STDOUT_FILENO, &watch_seen);
+		}
+
+		if (want_input && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))){
+			if (!read_commands(display, &in)){
+				return;
+			}
+		} else if (!run_buffered_commands(display, &in)){
+			return;
+		}
+	}
+}
+
+// Batch mode - the whole script (-f or piped stdin) is read before anything
+// runs. Consecutive set_output lines are merged into one configuration, which
+// is only sent and waited for when a line needs its result: any other command
+// or the end of the script. A summary with the outcome and time of every line
+// follows.
+
+static const char * batch_status_names[] = {
+	"pending", "waiting", "done", "invalid", "applied", "passed", "failed", "cancelled", "aborted", "not run", "submitted",
+};
+
+// SIGINT and SIGTERM end the daemon and a batch that is still watching
+// cleanly, so the log is flushed and the socket removed.
+
+static void stop_signal(int sig) {
+	(void)sig;
+	stop_requested = 1;
+}
+
+static void install_stop_handlers() {
+	struct sigaction sa = { .sa_handler = stop_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static char * read_script(int fd) {
+	size_t capacity = 4096, len = 0;
+	char *script = malloc(capacity);
+	while (script) {
+		if (len + 1 == capacity) {
+			char *grown = realloc(script, capacity * 2);
+			if (!grown) {
+				break;
+			}
+			script = grown;
+			capacity *= 2;
+		}
+		ssize_t got = read(fd, script + len, capacity - 1 - len);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			if (got < 0) {
+				break;
+			}
+			script[len] = '\0';
+			return script;
+		}
+		len += got;
+	}
+	free(script);
+	return NULL;
+}
+
+static int batch_outcome_status(const struct config_request * req) {
+	if (req->outcome == OUTCOME_SUCCEEDED) {
+		return req->requested_mode == CONFIG_TEST ? BATCH_PASSED : BATCH_APPLIED;
+	}
+	return req->outcome == OUTCOME_FAILED ? BATCH_FAILED : BATCH_CANCELLED;
+}
+
+// done of a configuration the batch waits for, done_data is the status to set
+static void batch_config_done(struct config_request * req) {
+	*(int *)req->done_data = batch_outcome_status(req);
+}
+
+// done of a tagged configuration, done_data is its line
+static void batch_entry_done(struct config_request * req) {
+	struct batch_entry *e = req->done_data;
+	e->status = batch_outcome_status(req);
+	e->finished_ns = monotonic_ns();
+}
+
+// waits for the configuration just sent, the lines waiting on it get its result
+static int batch_wait(struct wl_display * display, struct config_request * req, struct batch_entry * entries, int count) {
+	int status = BATCH_WAITING;
+	req->done = batch_config_done;
+	req->done_data = &status;
+	while (status == BATCH_WAITING) {
+		if (dispatch_display(display) < 0) {
+			config_requests_forget_data(&status);
+			log_event(log_file_path, 2, "Connection to Wayland display lost\n");
+			fprintf(stderr, "Connection to Wayland display lost\n");
+			return 0;
+		}
+	}
+	if (status == BATCH_APPLIED) {
+		// the new state and serial follow the result
+		wl_display_roundtrip(display);
+	}
+	if (watching) {
+		watch_write(STDOUT_FILENO, &watch_seen);
+	}
+	uint64_t now = monotonic_ns();
+	for (int i = 0; i < count; i++) {
+		if (entries[i].status == BATCH_WAITING) {
+			entries[i].status = status;
+			entries[i].finished_ns = now;
+		}
+	}
+	return 1;
+}
+
+static void batch_settle(struct batch_entry * entries, int count, int status) {
+	uint64_t now = monotonic_ns();
+	for (int i = 0; i < count; i++) {
+		if (entries[i].status == BATCH_WAITING) {
+			entries[i].status = status;
+			entries[i].finished_ns = now;
+		}
+	}
+}
+
+// sends the merged set_output lines, if any
+static int batch_flush(struct wl_display * display, struct batch_entry * entries, int count) {
+	if (transaction_open || wl_list_empty(&pending_outputs)) {
+		return 1;
+	}
+	struct config_request *req = apply_output_changes(display, &pending_outputs, apply_mode, NULL);
+	if (!req) {
+		perror("No output manager to configure outputs");
+		transaction_discard();
+		batch_settle(entries, count, BATCH_FAILED);
+		return 1;
+	}
+	return batch_wait(display, req, entries, count);
+}
+
+static void print_batch_summary(struct batch_entry * entries, int count, uint64_t started_ns, int configurations) {
+	int failed = 0;
+	for (int i = 0; i < count; i++) {
+		failed += entries[i].status != BATCH_DONE && entries[i].status != BATCH_APPLIED && entries[i].status != BATCH_PASSED;
+	}
+	printf("\nBatch summary: %d commands, %d configurations, %d not successful, %.1f ms\n",
+		count, configurations, failed, (monotonic_ns() - started_ns) / 1e6);
+	printf("%6s  %-9s %9s  %s\n", "line", "result", "ms", "command");
+	for (int i = 0; i < count; i++) {
+		struct batch_entry *e = &entries[i];
+		const char *status = batch_status_names[e->status];
+		if (e->status == BATCH_NOT_RUN) {
+			printf("%6d  %-9s %9s  %s\n", e->line, status, "-", e->text);
+		} else if (e->status == BATCH_INVALID) {
+			printf("%6d  %-9s %9.2f  %s  [%s]\n", e->line, status, (e->finished_ns - e->started_ns) / 1e6,
+				e->text, get_error_message(e->error_code));
+		} else {
+			printf("%6d  %-9s %9.2f  %s\n", e->line, status, (e->finished_ns - e->started_ns) / 1e6, e->text);
+		}
+	}
+}
+
+// runs a whole script, returns the number of lines that did not succeed or -1
+int run_batch(struct wl_display * display, int fd) {
+	uint64_t started_ns = monotonic_ns();
+	char *script = read_script(fd);
+	if (!script) {
+		perror("Error reading commands");
+		return -1;
+	}
+
+	// one entry per line holding a command; the summary keeps a copy of each
+	// line since parse_command() cuts its input into tokens
+	size_t len = strlen(script);
+	char *text = malloc(len + 1);
+	int count = 1;
+	for (char *c = script; *c; c++) {
+		count += *c == '\n';
+	}
+	struct batch_entry *entries = calloc(count, sizeof(struct batch_entry));
+	char **lines = calloc(count, sizeof(char *));
+	if (!text || !entries || !lines) {
+		perror("Error reading commands");
+		free(script);
+		free(text);
+		free(entries);
+		free(lines);
+		return -1;
+	}
+	memcpy(text, script, len + 1);
+
+	count = 0;
+	int line_number = 0;
+	for (char *line = script, *next; line; line = next) {
+		char *newline = strchr(line, '\n');
+		next = newline ? newline + 1 : NULL;
+		if (newline) {
+			*newline = '\0';
+			text[newline - script] = '\0';
+		}
+		line_number++;
+		size_t line_len = strlen(line);
+		if (line_len > 0 && line[line_len - 1] == '\r') {
+			line[--line_len] = '\0';
+			text[line - script + line_len] = '\0';
+		}
+		char *start = line + strspn(line, " \t");
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+		lines[count] = start;
+		entries[count].line = line_number;
+		entries[count].text = text + (start - script);
+		count++;
+	}
+	log_event(log_file_path, 1, "Batch of %d commands read\n", count);
+
+	int configurations = 0;
+	int i = 0;
+	for (; i < count; i++) {
+		struct batch_entry *e = &entries[i];
+
+		// a profile applied on hotplug may still be in flight
+		while (configuration_blocking() && dispatch_display(display) >= 0);
+
+		// everything else sees the result of the merged set_output lines; this
+		// happens before parsing, as list_outputs and the like print while parsed
+		if (!is_command(lines[i], "set_output")) {
+			if (!wl_list_empty(&pending_outputs) && !transaction_open) {
+				configurations++;
+			}
+			if (!batch_flush(display, entries, i)) {
+				break;
+			}
+		}
+		if (!command_ready(lines[i]) && !wait_for_state(display)) {
+			break;
+		}
+		e->started_ns = monotonic_ns();
+		struct command_result res;
+		struct command_result *cmd = parse_command(lines[i], &res);
+
+		if (cmd->validity && cmd->command == 2 && !transaction_open && !cmd->tag[0]) {
+			log_event(log_file_path, 1, "Set Output command received");
+			if (!merge_output_change(&pending_outputs, &cmd->change)) {
+				perror("Cannot queue the change");
+				e->status = BATCH_INVALID;
+				e->error_code = 7;
+				continue;
+			}
+			e->status = BATCH_WAITING;
+			continue;
+		}
+
+		int command = cmd->validity ? (int)cmd->command : 0;
+		e->status = command == 2 || command == 6 || command == 8 ? BATCH_WAITING : BATCH_DONE;
+		e->error_code = cmd->error_code;
+		if (!cmd->validity) {
+			e->status = BATCH_INVALID;
+		}
+		int keep_running = run_command(display, cmd);
+		e->finished_ns = monotonic_ns();
+
+		if (cmd->request && cmd->tag[0]) {
+			// runs in the background, its line gets the result when it arrives
+			configurations++;
+			e->status = BATCH_SUBMITTED;
+			cmd->request->done = batch_entry_done;
+			cmd->request->done_data = e;
+			if (command == 6) {
+				batch_settle(entries, i, BATCH_SUBMITTED);
+			}
+		} else if (cmd->request) {
+			configurations++;
+			if (!batch_wait(display, cmd->request, entries, i + 1)) {
+				break;
+			}
+		} else if (command == 6) {
+			// nothing queued to commit
+			e->status = BATCH_DONE;
+		} else if (command == 7 || command == 4) {
+			// abort, or exit with a transaction still open
+			batch_settle(entries, i, BATCH_ABORTED);
+		}
+		if (!keep_running) {
+			i++;
+			break;
+		}
+	}
+	if (i == count) {
+		if (!wl_list_empty(&pending_outputs) && !transaction_open) {
+			configurations++;
+		}
+		batch_flush(display, entries, count);
+	}
+	if (transaction_open) {
+		// a transaction left open at the end of the script is not committed
+		log_event(log_file_path, 1, "Open transaction discarded");
+		transaction_open = 0;
+		transaction_discard();
+	}
+	batch_settle(entries, count, BATCH_ABORTED);
+	for (int j = i; j < count; j++) {
+		if (entries[j].status == BATCH_PENDING) {
+			entries[j].status = BATCH_NOT_RUN;
+		}
+	}
+	// tagged lines still running get their results before the summary
+	while (configuration_pending() && dispatch_display(display) >= 0);
+	if (configuration_pending()) {
+		for (int j = 0; j < count; j++) {
+			config_requests_forget_data(&entries[j]);
+		}
+	}
+
+	print_batch_summary(entries, count, started_ns, configurations);
+	if (watching) {
+		// a script that ends watching streams changes until it is stopped
+		fflush(stdout);
+		install_stop_handlers();
+		struct pollfd pfd = { .fd = wl_display_get_fd(display), .events = POLLIN };
+		while (!stop_requested) {
+			// wl_display_dispatch() would retry the poll after a signal
+			while (wl_display_prepare_read(display) != 0) {
+				wl_display_dispatch_pending(display);
+			}
+			wl_display_flush(display);
+			if (poll(&pfd, 1, config_retry_timeout()) < 0) {
+				wl_display_cancel_read(display);
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			if (!(pfd.revents & POLLIN)) {
+				// woken for a configuration retry
+				wl_display_cancel_read(display);
+			} else if (wl_display_read_events(display) < 0) {
+				break;
+			}
+			if (wl_display_dispatch_pending(display) < 0) {
+				break;
+			}
+			config_retry_run(display);
+			watch_write(STDOUT_FILENO, &watch_seen);
+		}
+	}
+	int failed = 0;
+	for (int j = 0; j < count; j++) {
+		failed += entries[j].status != BATCH_DONE && entries[j].status != BATCH_APPLIED && entries[j].status != BATCH_PASSED;
+	}
+	free(script);
+	free(text);
+	free(entries);
+	free(lines);
+	return failed;
+}
+
+// Daemon mode - stays connected with the heads kept up to date by the event
+// listeners and answers requests on a SOCK_SEQPACKET unix socket. A request is
+// one packet holding one command line. The reply is the command's output in
+// packets of at most DAEMON_PACKET_MAX bytes, then one packet starting with a
+// NUL byte and holding the status: ok, error <name>, applied, passed, failed
+// or cancelled. Clients are served in turn; a client's next request is read
+// once its reply has gone out, and configuration requests from all clients
+// queue for the single configuration in flight.
+
+int daemon_listen(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Cannot create control socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if (errno != EADDRINUSE) {
+			perror("Cannot bind control socket");
+			close(fd);
+			return -1;
+		}
+		// a socket left behind by a daemon that is gone is replaced
+		int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		int alive = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+		if (probe >= 0) {
+			close(probe);
+		}
+		if (alive) {
+			fprintf(stderr, "A daemon is already listening on %s\n", path);
+			close(fd);
+			return -1;
+		}
+		unlink(path);
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			perror("Cannot bind control socket");
+			close(fd);
+			return -1;
+		}
+	}
+	if (listen(fd, SOMAXCONN) < 0) {
+		perror("Cannot listen on control socket");
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	return fd;
+}
+
+static struct daemon_client * daemon_add_client(struct daemon *d, int fd) {
+	if (d->count == d->capacity) {
+		int capacity = d->capacity ? d->capacity * 2 : DAEMON_MIN_CLIENTS;
+		struct daemon_client **clients = realloc(d->clients, capacity * sizeof(*clients));
+		if (!clients) {
+			return NULL;
+		}
+		d->clients = clients;
+		d->capacity = capacity;
+	}
+	struct daemon_client *client = calloc(1, sizeof(struct daemon_client));
+	if (!client) {
+		return NULL;
+	}
+	client->fd = fd;
+	client->reply_fd = -1;
+	d->clients[d->count++] = client;
+	log_event(log_file_path, 1, "Daemon client connected\n");
+	return client;
+}
+
+static void daemon_close_client(struct daemon *d, struct daemon_client *client) {
+	if (d->config_owner == client) {
+		d->config_owner = NULL;
+	}
+	config_requests_forget_data(client);
+	if (client->reply_fd >= 0) {
+		close(client->reply_fd);
+	}
+	close(client->fd);
+	client->fd = -1;
+	log_event(log_file_path, 1, "Daemon client disconnected\n");
+}
+
+static void daemon_set_status(struct daemon_client *client, const char *status, const char *detail) {
+	client->status[0] = '\0';
+	client->status_len = 1 + snprintf(client->status + 1, sizeof(client->status) - 1, "%s%s%s",
+		status, detail ? " " : "", detail ? detail : "");
+	if (client->status_len > sizeof(client->status)) {
+		client->status_len = sizeof(client->status);
+	}
+}
+
+// sends as much of the reply as the socket takes, returns 0 if the client is gone
+static int daemon_send(struct daemon_client *client) {
+	char packet[DAEMON_PACKET_MAX];
+	while (client->reply_fd >= 0) {
+		ssize_t got = pread(client->reply_fd, packet, sizeof(packet), client->reply_sent);
+		if (got <= 0) {
+			close(client->reply_fd);
+			client->reply_fd = -1;
+			break;
+		}
+		if (send(client->fd, packet, got, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		client->reply_sent += got;
+	}
+	if (client->status_len > 0 && !client->awaiting_result) {
+		if (send(client->fd, client->status, client->status_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		client->status_len = 0;
+	}
+	return 1;
+}
+
+static int daemon_reply_pending(struct daemon_client *client) {
+	return client->reply_fd >= 0 || client->status_len > 0;
+}
+
+// Pushes the change sets a watching client has not seen yet, one packet each
+// (split if longer than DAEMON_PACKET_MAX). Returns 0 if the client is gone or
+// fell more than CHANGE_HISTORY sets behind.
+static int daemon_send_changes(struct daemon_client *client) {
+	char packet[DAEMON_PACKET_MAX];
+	while (client->watch_seen < change_history.total) {
+		if (change_history.total - client->watch_seen > CHANGE_HISTORY) {
+			log_event(log_file_path, 2, "Daemon watcher fell behind, disconnected\n");
+			return 0;
+		}
+		struct change_set *set = &change_history.sets[client->watch_seen % CHANGE_HISTORY];
+		char header[32];
+		size_t header_len = snprintf(header, sizeof(header), "serial %u\n", set->serial);
+		size_t total = header_len + set->len;
+		while (client->watch_sent < total) {
+			size_t offset = client->watch_sent, len = 0;
+			if (offset < header_len) {
+				len = header_len - offset;
+				memcpy(packet, header + offset, len);
+				offset = header_len;
+			}
+			size_t text_len = set->len - (offset - header_len);
+			if (text_len > sizeof(packet) - len) {
+				text_len = sizeof(packet) - len;
+			}
+			memcpy(packet + len, set->text + offset - header_len, text_len);
+			len += text_len;
+			if (send(client->fd, packet, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			}
+			client->watch_sent += len;
+		}
+		client->watch_sent = 0;
+		client->watch_seen++;
+	}
+	return 1;
+}
+
+static void daemon_flush_client(struct daemon *d, struct daemon_client *client) {
+	int alive = daemon_send(client);
+	if (alive && client->watching && !daemon_reply_pending(client)) {
+		alive = daemon_send_changes(client);
+	}
+	if (!alive || (client->closing && !daemon_reply_pending(client))) {
+		daemon_close_client(d, client);
+	}
+}
+
+// done of a client's configuration, its reply gets the result
+static void daemon_config_done(struct config_request *req) {
+	struct daemon_client *client = req->done_data;
+	client->awaiting_result = 0;
+	daemon_set_status(client, config_outcome_name(req->outcome, req->requested_mode), NULL);
+}
+
+static int is_configuration_command(const char *line) {
+	return is_command(line, "set_output") || is_command(line, "test_output");
+}
+
+// Runs the client's request with stdout and stderr going into a memfd, which
+// becomes the reply.
+static void daemon_run_request(struct daemon *d, struct wl_display *display, struct daemon_client *client) {
+	int out = memfd_create("daemon-reply", MFD_CLOEXEC);
+	if (out < 0) {
+		client->request_len = 0;
+		daemon_set_status(client, "error", get_error_message(7));
+		daemon_flush_client(d, client);
+		return;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	dup2(out, STDOUT_FILENO);
+	dup2(out, STDERR_FILENO);
+
+	struct command_result res;
+	struct command_result *cmd = parse_command(client->request, &res);
+	client->request_len = 0;
+	int command = cmd->validity ? (int)cmd->command : 0;
+	uint32_t error_code = cmd->error_code;
+	if (command == 5 || command == 6 || command == 7 || command == 15) {
+		// transactions and waiting belong to an interactive session
+		command = 0;
+		error_code = 24;
+	} else if (command == 11) {
+		// from now on the connection only carries change sets
+		client->watching = 1;
+		client->watch_seen = change_history.total;
+		client->watch_sent = 0;
+		log_event(log_file_path, 1, "Daemon client watching\n");
+	} else if (command != 4 && command != 12) {
+		run_command(display, cmd);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(d->stdout_fd, STDOUT_FILENO);
+	dup2(d->stderr_fd, STDERR_FILENO);
+
+	client->reply_fd = out;
+	client->reply_sent = 0;
+	if (command == 4) {
+		// exit ends this client's connection, not the daemon
+		client->closing = 1;
+		daemon_set_status(client, "ok", NULL);
+	} else if (command == 0) {
+		daemon_set_status(client, "error", get_error_message(error_code));
+	} else if (cmd->request && !cmd->tag[0]) {
+		client->awaiting_result = 1;
+		cmd->request->done = daemon_config_done;
+		cmd->request->done_data = client;
+		d->config_owner = client;
+	} else {
+		daemon_set_status(client, "ok", NULL);
+	}
+	daemon_flush_client(d, client);
+}
+
+static void daemon_read_request(struct daemon *d, struct wl_display *display, struct daemon_client *client) {
+	ssize_t got = recv(client->fd, client->request, sizeof(client->request), MSG_DONTWAIT | MSG_TRUNC);
+	if (got < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			daemon_close_client(d, client);
+		}
+		return;
+	}
+	if (got == 0) {
+		daemon_close_client(d, client);
+		return;
+	}
+	if ((size_t)got >= sizeof(client->request)) {
+		daemon_set_status(client, "error", get_error_message(25));
+		daemon_flush_client(d, client);
+		return;
+	}
+	while (got > 0 && (client->request[got - 1] == '\n' || client->request[got - 1] == '\0')) {
+		got--;
+	}
+	client->request[got] = '\0';
+	client->request_len = got + 1;
+	client->ticket = d->next_ticket++;
+	// a configuration request waits while another one is in flight
+	if (!is_configuration_command(client->request) || !(configuration_blocking() || d->config_owner)) {
+		daemon_run_request(d, display, client);
 	}
+}
+
+// The configuration in flight got its result: its client's reply is complete,
+// and the longest waiting configuration request runs next.
+static void daemon_schedule(struct daemon *d, struct wl_display *display) {
+	if (d->config_owner && !d->config_owner->awaiting_result) {
+		struct daemon_client *client = d->config_owner;
+		d->config_owner = NULL;
+		daemon_flush_client(d, client);
+	}
+	if (d->config_owner || configuration_blocking()) {
+		return;
+	}
+	struct daemon_client *next = NULL;
+	for (int i = 0; i < d->count; i++) {
+		struct daemon_client *client = d->clients[i];
+		if (client->fd >= 0 && client->request_len > 0 && (!next || client->ticket < next->ticket)) {
+			next = client;
+		}
+	}
+	if (next) {
+		daemon_run_request(d, display, next);
+	}
+}
+
+int run_daemon(struct wl_display *display, const char *path) {
+	// clients only ever see the live state
+	if (!wait_for_state(display)) {
+		return 0;
+	}
+	struct daemon d = { .stdout_fd = dup(STDOUT_FILENO), .stderr_fd = dup(STDERR_FILENO) };
+	d.listen_fd = daemon_listen(path);
+	if (d.listen_fd < 0) {
+		return 0;
+	}
+
+	install_stop_handlers();
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Listening on %s\n", path);
+	fflush(stdout);
+	log_event(log_file_path, 1, "Daemon listening on %s\n", path);
+
+	struct pollfd *fds = NULL;
+	int fds_capacity = 0;
+	int ok = 1;
+	while (!stop_requested) {
+		if (fds_capacity < d.count + 2) {
+			fds_capacity = d.capacity + 2;
+			struct pollfd *grown = realloc(fds, fds_capacity * sizeof(struct pollfd));
+			if (!grown) {
+				perror("Error waiting for events");
+				ok = 0;
+				break;
+			}
+			fds = grown;
+		}
+		fds[0] = (struct pollfd){ .fd = wl_display_get_fd(display), .events = POLLIN };
+		fds[1] = (struct pollfd){ .fd = d.listen_fd, .events = POLLIN };
+		for (int i = 0; i < d.count; i++) {
+			struct daemon_client *client = d.clients[i];
+			short events = 0;
+			if (daemon_reply_pending(client)) {
+				events = client->awaiting_result && client->reply_fd < 0 ? 0 : POLLOUT;
+			} else if (client->watching) {
+				events = client->watch_seen < change_history.total ? POLLOUT : 0;
+			} else if (client->request_len == 0) {
+				events = POLLIN;
+			}
+			fds[i + 2] = (struct pollfd){ .fd = client->fd, .events = events };
+		}
+
+		while (wl_display_prepare_read(display) != 0) {
+			wl_display_dispatch_pending(display);
+		}
+		if (wl_display_flush(display) < 0 && errno == EAGAIN) {
+			fds[0].events |= POLLOUT;
+		}
+		if (poll(fds, d.count + 2, config_retry_timeout()) < 0) {
+			wl_display_cancel_read(display);
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error waiting for events");
+			ok = 0;
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(display) < 0) {
+				ok = 0;
+			}
+		} else {
+			wl_display_cancel_read(display);
+		}
+		if (!ok || wl_display_dispatch_pending(display) < 0 || (fds[0].revents & (POLLERR | POLLHUP))) {
+			log_event(log_file_path, 2, "Connection to Wayland display lost\n");
+			fprintf(stderr, "Connection to Wayland display lost\n");
+			ok = 0;
+			break;
+		}
+		config_retry_run(display);
+
+		int polled = d.count;
+		for (int i = 0; i < polled; i++) {
+			struct daemon_client *client = d.clients[i];
+			short revents = fds[i + 2].revents;
+			if (client->fd < 0 || revents == 0) {
+				continue;
+			}
+			if (revents & POLLOUT) {
+				daemon_flush_client(&d, client);
+			} else if (revents & POLLIN) {
+				daemon_read_request(&d, display, client);
+			} else if (revents & (POLLHUP | POLLERR)) {
+				daemon_close_client(&d, client);
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			int fd;
+			while ((fd = accept4(d.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				if (!daemon_add_client(&d, fd)) {
+					close(fd);
+				}
+			}
+		}
+		daemon_schedule(&d, display);
+
+		// change sets go out to the watchers as soon as they are recorded
+		for (int i = 0; i < d.count; i++) {
+			struct daemon_client *client = d.clients[i];
+			if (client->fd >= 0 && client->watching && client->watch_seen < change_history.total) {
+				daemon_flush_client(&d, client);
+			}
+		}
+
+		// drop the clients that are gone
+		for (int i = 0; i < d.count; i++) {
+			if (d.clients[i]->fd < 0) {
+				free(d.clients[i]);
+				d.clients[i--] = d.clients[--d.count];
+			}
+		}
+	}
+
+	log_event(log_file_path, 1, "Daemon stopping\n");
+	for (int i = 0; i < d.count; i++) {
+		daemon_close_client(&d, d.clients[i]);
+		free(d.clients[i]);
+	}
+	free(d.clients);
+	free(fds);
+	close(d.listen_fd);
+	unlink(path);
+	close(d.stdout_fd);
+	close(d.stderr_fd);
+	return ok;
+}
+
+// --request: sends one command to a running daemon and prints the reply,
+// returns 0 if the daemon reported success
+int daemon_request(const char *path, const char *command) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("Cannot connect to the daemon");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 1;
+	}
+	if (send(fd, command, strlen(command), MSG_NOSIGNAL) < 0) {
+		perror("Cannot send request");
+		close(fd);
+		return 1;
+	}
+	char packet[DAEMON_PACKET_MAX];
+	ssize_t got;
+	int watch = is_command(command, "watch");
+	while ((got = recv(fd, packet, sizeof(packet), 0)) > 0) {
+		if (packet[0] == '\0') {
+			packet[got < (ssize_t)sizeof(packet) ? got : got - 1] = '\0';
+			const char *status = packet + 1;
+			if (strncmp(status, "error", 5) == 0 || strcmp(status, "failed") == 0 || strcmp(status, "cancelled") == 0) {
+				fprintf(stderr, "%s\n", status);
+				close(fd);
+				return 1;
+			}
+			if (watch) {
+				// change sets follow until the daemon goes away
+				continue;
+			}
+			if (strcmp(status, "ok") != 0) {
+				printf("%s\n", status);
+			}
+			close(fd);
+			return 0;
+		}
+		fwrite(packet, 1, got, stdout);
+		if (watch) {
+			fflush(stdout);
+		}
+	}
+	close(fd);
+	if (watch) {
+		return 0;
+	}
+	fprintf(stderr, "Daemon closed the connection\n");
+	return 1;
+}
+
+#ifndef NO_MAIN
+
+int main(int argc, char ** argv){
+
+	static const struct option options[] = {
+		{ "dry-run", no_argument, NULL, 'd' },
+		{ "test-first", no_argument, NULL, 't' },
+		{ "file", required_argument, NULL, 'f' },
+		{ "daemon", no_argument, NULL, 'D' },
+		{ "request", required_argument, NULL, 'r' },
+		{ "socket", required_argument, NULL, 's' },
+		{ "cache", required_argument, NULL, 'c' },
+		{ "no-cache", no_argument, NULL, 'n' },
+		{ "profiles", required_argument, NULL, 'p' },
+		{ "retries", required_argument, NULL, 'R' },
+		{ "record", required_argument, NULL, 'T' },
+		{ "replay", required_argument, NULL, 'P' },
+		{ "replay-speed", required_argument, NULL, 'S' },
+		{ "export-log", required_argument, NULL, 'X' },
+		{ 0, 0, 0, 0 },
+	};
+	const char * script_path = NULL;
+	const char * request = NULL;
+	char socket_path[256] = "";
+	int daemon_mode = 0;
+	int use_cache = 1;
+	const char * profiles_path = NULL;
+	const char * record_path = NULL;
+	const char * replay_path = NULL;
+	uint32_t replay_speed = 0;
+	const char * export_path = NULL;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "f:", options, NULL)) != -1){
+		switch (opt){
+			case 'd': apply_mode = CONFIG_TEST; break;
+			case 't': apply_mode = CONFIG_TEST_THEN_APPLY; break;
+			case 'f': script_path = optarg; break;
+			case 'D': daemon_mode = 1; break;
+			case 'r': request = optarg; break;
+			case 's': snprintf(socket_path, sizeof(socket_path), "%s", optarg); break;
+			case 'c': snprintf(state_cache.path, sizeof(state_cache.path), "%s", optarg); break;
+			case 'n': use_cache = 0; break;
+			case 'p': profiles_path = optarg; break;
+			case 'R': {
+				int32_t retries;
+				if (!parse_int(optarg, strlen(optarg), &retries) || retries < 0){
+					fprintf(stderr, "--retries takes a number of attempts, 0 to never retry\n");
+					return -1;
+				}
+				retry_attempts = retries;
+				break;
+			}
+			case 'T': record_path = optarg; break;
+			case 'P': replay_path = optarg; break;
+			case 'S': {
+				int32_t speed;
+				if (!parse_int(optarg, strlen(optarg), &speed) || speed < 0){
+					fprintf(stderr, "--replay-speed takes a factor, 1 for the recorded pace, 0 for as fast as possible\n");
+					return -1;
+				}
+				replay_speed = speed;
+				break;
+			}
+			case 'X': export_path = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [--dry-run | --test-first] [-f script | --daemon | --request command] [--socket path] [--cache path | --no-cache] [--profiles path] [--retries n] [--record trace | --replay trace [--replay-speed n]] [--export-log log]\n", argv[0]);
+				return -1;
+		}
+	}
+	if (export_path){
+		return export_log(export_path) ? 0 : 1;
+	}
+	if (replay_path && (daemon_mode || record_path)){
+		fprintf(stderr, "--replay runs without a compositor, it cannot be combined with --daemon or --record\n");
+		return -1;
+	}
+
+	if ((daemon_mode || request) && socket_path[0] == '\0'){
+		const char * runtime_dir = getenv("XDG_RUNTIME_DIR");
+		if (!runtime_dir){
+			fprintf(stderr, "XDG_RUNTIME_DIR is not set, use --socket\n");
+			return -1;
+		}
+		snprintf(socket_path, sizeof(socket_path), "%s/%s", runtime_dir, DAEMON_SOCKET_NAME);
+	}
+	if (request){
+		return daemon_request(socket_path, request);
+	}
+
+	if (!use_cache || replay_path){
+		// a replayed state is not the one of this machine
+		state_cache.path[0] = '\0';
+	} else if (state_cache.path[0] == '\0'){
+		const char * cache_dir = getenv("XDG_CACHE_HOME");
+		const char * home = getenv("HOME");
+		if (cache_dir && cache_dir[0]){
+			snprintf(state_cache.path, sizeof(state_cache.path), "%s/%s", cache_dir, STATE_CACHE_NAME);
+		} else if (home && home[0]){
+			char dir[192];
+			snprintf(dir, sizeof(dir), "%s/.cache", home);
+			mkdir(dir, 0700);
+			snprintf(state_cache.path, sizeof(state_cache.path), "%s/%s", dir, STATE_CACHE_NAME);
+		}
+	}
+
+	// a script file or piped stdin runs as a batch, a terminal gets the prompt
+	int script_fd = -1;
+	if (script_path){
+		script_fd = strcmp(script_path, "-") == 0 ? STDIN_FILENO : open(script_path, O_RDONLY);
+		if (script_fd < 0){
+			perror("Cannot open script");
+			return -1;
+		}
+	} else if (!daemon_mode && !isatty(STDIN_FILENO)){
+		script_fd = STDIN_FILENO;
+	}
+
+	int lof_file_status = setup_log_file();
+	if (lof_file_status == 0){
+		return -1;
+	}
+	if (!log_start(log_file_path)){
+		fprintf(stderr, "Asynchronous logger unavailable, logging synchronously\n");
+	}
+	log_event(log_file_path, 1, "Log File set up done in CWD.\n");
+
+	if (profiles_path){
+		if (!profiles_load(profiles_path, 1)){
+			log_stop();
+			return -1;
+		}
+	} else {
+		const char * config_dir = getenv("XDG_CONFIG_HOME");
+		const char * home = getenv("HOME");
+		char default_path[256] = "";
+		if (config_dir && config_dir[0]){
+			snprintf(default_path, sizeof(default_path), "%s/%s", config_dir, PROFILES_PATH);
+		} else if (home && home[0]){
+			snprintf(default_path, sizeof(default_path), "%s/.config/%s", home, PROFILES_PATH);
+		}
+		if (default_path[0] && !profiles_load(default_path, 0)){
+			log_stop();
+			return -1;
+		}
+	}
+
+	if (record_path && !trace_open(record_path)){
+		perror("Cannot create trace");
+		log_stop();
+		return -1;
+	}
+
+	struct wl_display * display = NULL;
+	if (replay_path){
+		// the events come from the trace, requests go to a socket nobody reads
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0){
+			close(fds[1]);
+			display = wl_display_connect_to_fd(fds[0]);
+		}
+	} else {
+		display = wl_display_connect(NULL);
+	}
+	if (!display){
+		log_event(log_file_path, 2, "Connection to Wayland display failed");
+		perror("Connection to wayland display failed");
+		trace_close();
+		log_stop();
+		return -1;
+	}
+	if (replay_path){
+		log_event(log_file_path, 1 , "Replaying without a compositor\n");
+	} else {
+		log_event(log_file_path, 1 , "Connected to Wayland Socket: %s\n", getenv("WAYLAND_DISPLAY"));
+	}
+	wl_list_init(&heads);	
+	wl_list_init(&pending_outputs);
+	wl_list_init(&config_requests);
+
+	registry = wl_display_get_registry(display);
+	log_event(log_file_path, 5 , "Local reference to registry - created\n");
+	// the display reaches the output manager events, which apply profiles
+	trace_add_listener(registry, &registry_listener, display);
+	log_event(log_file_path, 1 , "Local reference to registry - listeners added\n");
+
+	// No roundtrips here: the globals, heads and modes are dispatched by the
+	// loops below and the state is ready at the first done. Until then
+	// list_outputs is answered from the cache.
+	if (!replay_path){
+		wl_callback_add_listener(wl_display_sync(display), &registry_sync_listener, NULL);
+	}
+	wl_display_flush(display);
+	state_cache_load();
+
+	int status = 0;
+	if (replay_path && !trace_replay(display, replay_path, replay_speed)){
+		status = 1;
+	} else if (daemon_mode){
+		status = !run_daemon(display, socket_path);
+	} else if (script_fd >= 0){
+		status = run_batch(display, script_fd) != 0;
+		if (script_fd != STDIN_FILENO){
+			close(script_fd);
+		}
+	} else if (!replay_path){
+		run_event_loop(display);
+	}
+
+	// CLEAN UP
+
+	log_event(log_file_path, 1, "Cleaning up...\n");
+	// the trace ends with the session, a replay keeps the outputs it left
+	trace_close();
+
+	// a cached answer is still checked against the live state before exiting,
+	// and a configuration in flight (a profile's) gets its result; a replay
+	// has no more events coming
+	if (!replay_path && wait_for_state(display)){
+		while (configuration_pending() && dispatch_display(display) >= 0);
+	}
+	config_requests_free();
+
+	free_all_heads();
+	state_cache_unload();
+	profiles_free();
+
 	wl_display_roundtrip(display);
-	zwlr_output_manager_v1_stop(output_manager);
-	log_event(log_file_path, 5 , "SENT: zwlr_output_manager_v1 - stop\n");
+	if (output_manager){
+		zwlr_output_manager_v1_stop(output_manager);
+		log_event(log_file_path, 5 , "SENT: zwlr_output_manager_v1 - stop\n");
+	}
 
 
 	wl_display_roundtrip(display);
 	wl_display_disconnect(display);
+	log_stop();
 
-	return 0;
+	return status;
 }
 
+#endif
+
 
 
 
@@ -4,6 +4,10 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>    
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 #include <wayland-client.h> 
 
 struct zwlr_output_manager_v1;
@@ -29,7 +33,134 @@ struct zwlr_output_configuration_head_v1;
  * 11. Main ()
  */
 
-#define MAX_SUBCMDS                        5
+#define MAX_SUBCMDS                        6
+
+#define ARENA_BLOCK_SIZE                4096
+#define ARENA_ALIGN                       16
+
+#define MODE_CURRENT                    0x01
+#define MODE_PREFERRED                  0x02
+#define MODE_TABLE_MIN_CAPACITY           16
+
+#define STAT_MODE                          0
+#define STAT_CMODE                         1
+#define STAT_SCALE                         2
+#define STAT_TRANSFORM                     3
+#define STAT_POSITION                      4
+#define STAT_ADAPTIVE_SYNC                 5
+#define STAT_ENABLED                       6
+#define STAT_KINDS                         7
+
+// one bit per property of output_settings, matching the STAT_* kinds
+#define OUTPUT_SET_MODE             (1 << STAT_MODE)
+#define OUTPUT_SET_CMODE            (1 << STAT_CMODE)
+#define OUTPUT_SET_SCALE            (1 << STAT_SCALE)
+#define OUTPUT_SET_TRANSFORM        (1 << STAT_TRANSFORM)
+#define OUTPUT_SET_POSITION         (1 << STAT_POSITION)
+#define OUTPUT_SET_ADAPTIVE_SYNC    (1 << STAT_ADAPTIVE_SYNC)
+#define OUTPUT_SET_ENABLED          (1 << STAT_ENABLED)
+
+#define KEYWORD_NONE                       0
+#define KEYWORD_LIST_OUTPUTS               1
+#define KEYWORD_SET_OUTPUT                 2
+#define KEYWORD_TEST_OUTPUT                3
+#define KEYWORD_MONITOR                    4
+#define KEYWORD_BEGIN                      5
+#define KEYWORD_COMMIT                     6
+#define KEYWORD_ABORT                      7
+#define KEYWORD_CHANGES                    8
+#define KEYWORD_WATCH                      9
+#define KEYWORD_UNWATCH                   10
+#define KEYWORD_STATS                     11
+#define KEYWORD_PROFILES                  12
+#define KEYWORD_EXIT                      13
+#define KEYWORD_MODE                      14
+#define KEYWORD_CMODE                     15
+#define KEYWORD_POS                       16
+#define KEYWORD_TRANSFORM                 17
+#define KEYWORD_SCALE                     18
+#define KEYWORD_ADAPTIVE_SYNC             19
+#define KEYWORD_ENABLED                   20
+#define KEYWORD_SINGLE                    21
+#define KEYWORD_PERIOD                    22
+#define KEYWORD_RESET                     23
+#define KEYWORD_JSON                      24
+#define KEYWORD_COMPACT                   25
+#define KEYWORD_PROFILE                   26
+#define KEYWORD_OUTPUT                    27
+#define KEYWORD_RESULTS                   28
+#define KEYWORD_WAIT                      29
+#define KEYWORD_CONNECTOR                 30
+
+#define CHANGE_HISTORY                    16
+#define HEAD_SNAPSHOT_NAME_MAX            64
+
+#define OUTPUT_FORMAT_JSON                 1
+#define OUTPUT_FORMAT_COMPACT              2
+#define OUTPUT_TEXT_HEADER_MAX            64
+#define OUTPUT_TEXT_HEAD_MAX             512
+#define OUTPUT_TEXT_MODE_MAX             128
+
+#define STATE_CACHE_NAME "output-manager-state.bin"
+#define STATE_CACHE_MAGIC             "WOMS"
+#define STATE_CACHE_VERSION                1
+#define STATE_CACHE_NO_STRING     0xffffffffu
+
+#define TRACE_MAGIC                   "WOTR"
+#define TRACE_VERSION                      1
+#define TRACE_BUFFER_SIZE              65536
+#define TRACE_STRING_MAX                4096
+#define TRACE_MAX_ARGS                     8
+#define TRACE_SERVER_ID_START     0xff000000u
+#define TRACE_REGISTRY                     0
+#define TRACE_OUTPUT_MANAGER               1
+#define TRACE_HEAD                         2
+#define TRACE_MODE                         3
+#define TRACE_INTERFACES                   4
+
+#define PROFILE_NAME_MAX                  64
+#define PROFILE_LINE_MAX                1024
+#define PROFILE_MIN_SLOTS                 16
+#define PROFILES_PATH "output-manager/profiles"
+
+#define DAEMON_SOCKET_NAME   "output-manager.sock"
+#define DAEMON_REQUEST_MAX               4096
+#define DAEMON_PACKET_MAX               32768
+#define DAEMON_MIN_CLIENTS                  8
+
+#define BATCH_PENDING                      0
+#define BATCH_WAITING                      1
+#define BATCH_DONE                         2
+#define BATCH_INVALID                      3
+#define BATCH_APPLIED                      4
+#define BATCH_PASSED                       5
+#define BATCH_FAILED                       6
+#define BATCH_CANCELLED                    7
+#define BATCH_ABORTED                      8
+#define BATCH_NOT_RUN                      9
+#define BATCH_SUBMITTED                   10
+
+#define OUTCOME_SUCCEEDED                  0
+#define OUTCOME_FAILED                     1
+#define OUTCOME_CANCELLED                  2
+
+#define LATENCY_SUB_BITS                   4
+#define LATENCY_SUB_BUCKETS  (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS      ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+#define HEAD_INDEX_MIN_CAPACITY           16
+#define HEAD_INDEX_TOMBSTONE  ((struct local_head *)1)
+
+#define CONFIG_APPLY                       0
+#define CONFIG_TEST                        1
+#define CONFIG_TEST_THEN_APPLY             2
+
+#define CONFIG_RETRY_ATTEMPTS              5
+#define CONFIG_RETRY_BASE_MS              50
+#define CONFIG_RETRY_MAX_MS             2000
+#define CHANGE_TARGET_MAX                128
+#define CONFIG_TAG_MAX                    32
+#define CONFIG_RESULTS_MAX                64
 
 #define LOG_LEVEL_INFO                     1
 #define LOG_LEVEL_ERROR                    2
@@ -39,6 +170,46 @@ struct zwlr_output_configuration_head_v1;
 #define LOG_LEVEL_UNKNOWN                  6
 #define LOG_LEVEL_RESULT                   7
 
+#define LOG_RING_SIZE                (1 << 20)
+#define LOG_FLUSH_INTERVAL_MS            100
+#define LOG_FLUSH_THRESHOLD    (LOG_RING_SIZE / 4)
+
+#define LOG_FILE_NAME              "log.bin"
+#define LOG_FILE_MAGIC            "WOMLOG01"
+#define LOG_FILE_MAGIC_LEN                 8
+#define LOG_ARGS_MAX                       6
+#define LOG_STRING_MAX                   512
+#define LOG_EVENT_MAX                  65528
+#define LOG_CHUNK_MAX                  32768
+#define LOG_SEEN_SLOTS                  1024
+#define LOG_INLINE_STRING          (1ULL << 63)
+#define LOG_FORMAT_SLOTS                 512
+#define LOG_STRING_SLOTS                4096
+#define LOG_RENDER_BUFFER              65536
+
+#define LOG_RECORD_EVENT                   0
+#define LOG_RECORD_FORMAT                  1
+#define LOG_RECORD_STRING                  2
+
+#define LOG_ARG_INT                        1
+#define LOG_ARG_LONG                       2
+#define LOG_ARG_LONG_LONG                  3
+#define LOG_ARG_SIZE                       4
+#define LOG_ARG_DOUBLE                     5
+#define LOG_ARG_STRING                     6
+#define LOG_ARG_POINTER                    7
+
+#define LOG_TIMESTAMP_LEN                 20
+#define LOG_TIMESTAMP_FRACTION             9
+#define LOG_TIMESTAMP_MAX   (LOG_TIMESTAMP_LEN + 1 + LOG_TIMESTAMP_FRACTION)
+#define LOG_TIMESTAMP_PREFIX              18
+#define LOG_CLOCK_REFRESH_NS  60000000000LL
+#define LOG_CLOCK_STEP_NS      1000000000LL
+#define LOG_INDEX_MAGIC           "WOMLIDX2"
+#define LOG_INDEX_UNORDERED                1
+#define LOG_INDEX_BATCH                  256
+#define LOG_DEFS_MAGIC            "WOMLDEF1"
+
 #define NO_ERROR                           0
 #define INVALID MAIN COMMAND               1
 #define COMMAND_INCOMPLETE                 2
@@ -58,75 +229,122 @@ struct zwlr_output_configuration_head_v1;
 #define INVALID_MONITOR_SINGLE            16
 #define INVALID_MONITOR_PERIOD            17
 #define INVALID_MONITOR_MULTIPLE          18
+#define INVALID_SUBCOMMAND_ENABLED        19
+#define TRANSACTION_ALREADY_OPEN          20
+#define NO_OPEN_TRANSACTION               21
+#define NO_OUTPUT_MANAGER                 22
+#define INVALID_STATS_COMMAND             23
+#define NOT_AVAILABLE_IN_DAEMON           24
+#define REQUEST_TOO_LONG                  25
+#define INVALID_LIST_OUTPUTS              26
+#define INVALID_CHANGES_COMMAND           27
+#define INVALID_WATCH_COMMAND             28
+#define INVALID_PROFILES_COMMAND          29
+#define INVALID_TAG                       30
+#define UNKNOWN_TAG                       31
+#define INVALID_RESULTS_COMMAND           32
+#define AMBIGUOUS_OUTPUT_HEAD             33
 
-struct command_result {
-    uint32_t command;
-	uint32_t validity;
-	uint32_t error_code;
-    void * data;
+// A word of a command line, NUL terminated in place; len is its strlen().
+
+struct token {
+	char * text;
+	size_t len;
 };
 
-struct set_output_parser {
-	struct local_head * head;
-	struct custom_mode * cmode;
-	struct local_mode_modified * mode;
-	struct position * pos;
-	struct transform * transform;
-	struct scale * scale;
-	struct adaptive_sync * adaptive_sync;	
+struct tokenizer {
+	char * cursor;
 };
 
-struct custom_mode {
-	int32_t status;
+// What a set_output line or a profile output gives a head. set holds an
+// OUTPUT_SET_* bit for every property given; mode and cmode share width,
+// height and refresh.
+
+struct output_settings {
+	uint32_t set;
 	int32_t width;
 	int32_t height;
 	int32_t refresh;
+	int32_t x;
+	int32_t y;
+	uint32_t transform;
+	wl_fixed_t scale;
+	uint32_t adaptive_sync;
+	int32_t enabled;
 };
 
-struct local_mode_modified{
-	int32_t status;
-	struct local_mode * mode;
-};
+// One head's change. mode is the advertised mode the settings name when
+// OUTPUT_SET_MODE is set. Parsed on the stack, copied into a list node when
+// it is queued or sent.
 
-struct position {
-	int32_t status;
-	int32_t x;
-	int32_t y;
+struct set_output_parser {
+	struct wl_list link;
+	struct local_head * head;
+	struct zwlr_output_mode_v1 * mode;
+	struct output_settings settings;
+	// identity (or name) of a head that went away while the change was in a
+	// configuration, head is NULL until the retry finds it again
+	char target[CHANGE_TARGET_MAX];
 };
 
-struct transform{
-	int32_t status;
-	uint32_t transform;
+// Filled by parse_command() in storage of the caller, change holds the
+// parsed set_output / test_output.
+
+struct command_result {
+	uint32_t command;
+	uint32_t validity;
+	uint32_t error_code;
+	struct set_output_parser change;
+	// "@tag" in front of set_output, test_output or commit: the configuration
+	// runs in the background and its result is kept for results / wait
+	char tag[CONFIG_TAG_MAX];
+	// the configuration run_command() sent, for the caller to set done on
+	struct config_request * request;
 };
 
-struct scale{
-	int32_t status;
-	wl_fixed_t scale;
+// Memory of one head. blocks is the chain of ARENA_BLOCK_SIZE blocks, the
+// first one being the block allocations are taken from, last its tail for
+// handing the chain back to the pool; large holds oversized allocations.
+
+struct arena_block {
+	struct arena_block * next;
+	size_t used;
+	_Alignas(ARENA_ALIGN) char data[];
 };
 
-struct adaptive_sync{
-	int32_t status;
-	uint32_t adaptive_sync;
+struct arena {
+	struct arena_block * blocks;
+	struct arena_block * last;
+	struct arena_block * large;
 };
 
-struct local_mode{
-	struct zwlr_output_mode_v1 * mode;
-	struct wl_list link;
-	int32_t height;
-	int32_t width;
-	int32_t refresh;
-	char status;
+// Modes of a head, one row per advertised mode. The arrays share a single
+// allocation; slots maps a (width, height, refresh) hash to row + 1.
+
+struct mode_table{
+	uint32_t count;
+	uint32_t capacity;
+	struct zwlr_output_mode_v1 ** proxy;
+	int32_t * width;
+	int32_t * height;
+	int32_t * refresh;
+	uint8_t * flags;
+	uint32_t * slots;
+	uint32_t slot_mask;
+	int slots_valid;
+	uint32_t last;
+	struct arena * arena;
 };
 
 struct local_head{
+	struct arena arena;
 	struct wl_list link;
 	struct zwlr_output_head_v1 * head;
-	struct wl_list available_modes;
+	struct mode_table modes;
 	char * name;
 	char * description;
 	int32_t physical_width;
 	int32_t physical_height;
-	struct local_mode * current_mode;
 	int32_t enabled;
 	int32_t pos_x;
 	int32_t pos_y;
@@ -135,8 +353,447 @@ struct local_head{
 	char * make;
 	char * model;
 	char * serial_number;
+	char * identity;
 	uint32_t adaptive_sync_state;
-	struct zwlr_output_configuration_head_v1 * head_config;
+	uint64_t id;
+};
+
+// Copy of the heads taken at a done, for diffing against the next one. heads
+// is sorted by id, each head's modes are mode_count rows of modes from
+// first_mode on.
+
+struct mode_key {
+	int32_t width;
+	int32_t height;
+	int32_t refresh;
+};
+
+struct head_snapshot {
+	uint64_t id;
+	char name[HEAD_SNAPSHOT_NAME_MAX];
+	int32_t enabled;
+	int32_t pos_x;
+	int32_t pos_y;
+	int32_t transform;
+	wl_fixed_t scale;
+	uint32_t adaptive_sync;
+	struct mode_key current;
+	uint32_t first_mode;
+	uint32_t mode_count;
+};
+
+struct state_snapshot {
+	uint32_t serial;
+	struct head_snapshot * heads;
+	uint32_t count;
+	uint32_t capacity;
+	struct mode_key * modes;
+	uint32_t mode_count;
+	uint32_t mode_capacity;
+};
+
+// What changed at one done, one line per difference.
+
+struct change_set {
+	uint32_t serial;
+	char * text;
+	size_t len;
+	size_t capacity;
+};
+
+// total counts every set ever recorded, set n is sets[n % CHANGE_HISTORY].
+
+struct change_history {
+	struct change_set sets[CHANGE_HISTORY];
+	uint64_t total;
+};
+
+// Open addressing hash table of heads. key points into the head (its name or
+// identity string), head is NULL for a free slot or HEAD_INDEX_TOMBSTONE for a
+// removed entry.
+
+struct head_index_entry {
+	uint64_t hash;
+	const char * key;
+	struct local_head * head;
+};
+
+struct head_index {
+	struct head_index_entry * entries;
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t used;
+};
+
+// A configuration sent to the compositor and the changes it was built from,
+// kept in config_requests until the result arrives (listener data of config).
+// A cancelled one is kept as well, with config NULL, and sent again against
+// the serial of a later done once retry_ns has passed. At the result outcome
+// is set and done, if any, is called with the request before it is freed.
+
+struct config_request {
+	struct wl_list link;
+	struct zwlr_output_configuration_v1 * config;
+	uint32_t id;
+	char tag[CONFIG_TAG_MAX];
+	int mode;
+	int requested_mode;
+	struct wl_list changes;
+	uint32_t kinds;
+	uint32_t serial;
+	uint32_t attempts;
+	uint64_t submitted_ns;
+	uint64_t sent_ns;
+	uint64_t retry_ns;
+	int outcome;
+	void (*done)(struct config_request * req);
+	void * done_data;
+};
+
+// Result of a tagged configuration, kept until results or wait reported it.
+
+struct config_result {
+	char tag[CONFIG_TAG_MAX];
+	uint32_t id;
+	int mode;
+	int outcome;
+	uint32_t attempts;
+	uint64_t elapsed_us;
+	int reported;
+};
+
+// Latency histogram of one request type and property kind, in microseconds.
+// buckets[] is log-linear, see latency_bucket().
+
+struct latency_histogram {
+	uint64_t count;
+	uint64_t outcomes[3];
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	uint32_t buckets[LATENCY_BUCKETS];
+};
+
+struct latency_stats {
+	struct latency_histogram apply[STAT_KINDS];
+	struct latency_histogram test[STAT_KINDS];
+};
+
+// One command line of a batch script and what became of it.
+
+struct batch_entry {
+	int line;
+	const char * text;
+	int status;
+	uint32_t error_code;
+	uint64_t started_ns;
+	uint64_t finished_ns;
+};
+
+// A connection to the daemon's control socket. request holds a configuration
+// command waiting for its turn; the reply is the memfd the command's output
+// went into, then the status packet.
+
+struct daemon_client {
+	int fd;
+	char request[DAEMON_REQUEST_MAX];
+	size_t request_len;
+	uint64_t ticket;
+	int reply_fd;
+	uint64_t reply_sent;
+	char status[64];
+	size_t status_len;
+	int awaiting_result;
+	int closing;
+	int watching;
+	uint64_t watch_seen;
+	size_t watch_sent;
+};
+
+struct daemon {
+	int listen_fd;
+	int stdout_fd;
+	int stderr_fd;
+	struct daemon_client ** clients;
+	int count;
+	int capacity;
+	struct daemon_client * config_owner;
+	uint64_t next_ticket;
+};
+
+// State cache file: the header, head_count head records, then the modes of
+// all heads as width[mode_count], height[], refresh[] and flags[], then
+// strings_size bytes of NUL terminated strings. A head's strings are offsets
+// into them (STATE_CACHE_NO_STRING if unset), its modes mode_count rows from
+// first_mode on.
+
+struct state_cache_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t head_count;
+	uint32_t mode_count;
+	uint32_t strings_size;
+	uint32_t reserved;
+	int64_t saved_at;
+};
+
+struct state_cache_head {
+	uint32_t name;
+	uint32_t description;
+	uint32_t make;
+	uint32_t model;
+	uint32_t serial_number;
+	uint32_t identity;
+	int32_t physical_width;
+	int32_t physical_height;
+	int32_t enabled;
+	int32_t pos_x;
+	int32_t pos_y;
+	int32_t transform;
+	wl_fixed_t scale;
+	uint32_t adaptive_sync;
+	uint32_t first_mode;
+	uint32_t mode_count;
+};
+
+// The mapped cache until the live state is complete. cached_heads are built
+// over the mapping and linked into heads; answered is set once list_outputs
+// was served from them.
+
+struct state_cache {
+	char path[256];
+	char * data;
+	size_t size;
+	struct local_head * cached_heads;
+	uint32_t head_count;
+	int64_t saved_at;
+	struct wl_list heads;
+	int loaded;
+	int answered;
+};
+
+// Event trace file (--record): the header, then one record per event delivered
+// to the registry, output manager, head and mode listeners, ns after the
+// recording started. A record is followed by size bytes of arguments in
+// signature order: integers as 4 bytes, objects and new objects as their id
+// (0 for none), strings as a 2 byte length counting the NUL (0 for null) and
+// the bytes with the NUL.
+
+struct trace_header {
+	char magic[4];
+	uint32_t version;
+	int64_t recorded_at;
+};
+
+struct trace_record {
+	uint64_t ns;
+	uint32_t object;
+	uint8_t interface;
+	uint8_t opcode;
+	uint16_t size;
+};
+
+// The trace being recorded, records are copied into buffer and written out
+// when it is full.
+
+struct trace_recorder {
+	int fd;
+	uint64_t start_ns;
+	uint64_t events;
+	size_t len;
+	char buffer[TRACE_BUFFER_SIZE];
+};
+
+// Proxies of a replay, by the id the compositor gave the head or mode when it
+// was recorded (minus TRACE_SERVER_ID_START). The registry and the output
+// manager are the replay's own.
+
+struct trace_proxies {
+	struct wl_proxy ** proxy;
+	uint32_t size;
+};
+
+// One output of a profile: the head it is for, as "make|model|serial", the
+// connector that tells it apart from identical monitors (NULL if not given),
+// and the properties to give it.
+
+struct profile_output {
+	char * identity;
+	char * connector;
+	struct output_settings settings;
+};
+
+// key is the order independent hash of the profile's identities, its outputs
+// are output_count entries of the outputs array from first_output on.
+
+struct profile {
+	char name[PROFILE_NAME_MAX];
+	uint64_t key;
+	uint32_t first_output;
+	uint32_t output_count;
+	uint64_t applied;
+};
+
+// All profiles, compiled for matching: slots maps a key to profile index + 1.
+// topology is the key of the heads last matched, active the profile in place
+// (-1 if none); latency holds the time from done to the configuration sent,
+// in nanoseconds.
+
+struct profile_set {
+	struct profile * profiles;
+	uint32_t count;
+	uint32_t capacity;
+	struct profile_output * outputs;
+	uint32_t output_count;
+	uint32_t output_capacity;
+	uint32_t * slots;
+	uint32_t slot_mask;
+	uint64_t topology;
+	uint32_t topology_count;
+	int active;
+	char path[256];
+	struct latency_histogram latency;
+};
+
+// Rendered list_outputs --json / --compact, kept between calls.
+
+struct output_buffer {
+	char * data;
+	size_t capacity;
+};
+
+// Lines read from stdin that have not been run yet.
+
+struct command_input {
+	char buffer[256];
+	size_t len;
+	int eof;
+};
+
+// Binary log (log.bin): LOG_FILE_MAGIC, then records, each a log_record
+// followed by size bytes, a multiple of 8 (at most LOG_EVENT_MAX). An event's
+// payload is one 8 byte slot per argument of its format, then the text of its
+// inline string arguments. A string slot is 0 for NULL, LOG_INLINE_STRING |
+// length << 32 | offset in the payload for an inline string, or else the id
+// of a string record. A format or string record defines id as its payload, a
+// NUL terminated text, before the first event that uses it. Ids start over
+// with every run, a later definition replaces an earlier one. key is the
+// local time in nanoseconds, as parse_timestamp_key() turns a timestamp into
+// a number.
+
+struct log_record {
+	int64_t key;
+	uint32_t id;
+	uint16_t size;
+	uint8_t kind;
+	uint8_t level;
+};
+
+// A format interned by log_event(): the address of the literal, its id and
+// the types of its arguments.
+
+struct log_format {
+	const char * text;
+	uint32_t id;
+	uint8_t argc;
+	uint8_t types[LOG_ARGS_MAX];
+};
+
+// A string argument interned by its text, once it was seen a second time.
+// Strings of LOG_STRING_MAX or more are always written inline.
+
+struct log_string {
+	uint64_t hash;
+	uint32_t id;
+	char * text;
+};
+
+// Open addressing tables of what this run has defined in the log. A table
+// three quarters full is emptied, its entries get new ids when used again.
+// seen holds the hashes of strings written inline, by hash.
+
+struct log_intern {
+	struct log_format formats[LOG_FORMAT_SLOTS];
+	uint32_t format_count;
+	uint32_t next_format;
+	struct log_string strings[LOG_STRING_SLOTS];
+	uint32_t string_count;
+	uint32_t next_string;
+	uint64_t seen[LOG_SEEN_SLOTS];
+};
+
+// Sidecar index of the log (log.bin.idx): a header followed by one entry per
+// second, pointing at the first record logged in that second.
+
+struct log_index_header {
+	char magic[8];
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct log_index_entry {
+	int64_t key;
+	uint64_t offset;
+};
+
+// Entries found by the writer, appended to the sidecars together: index
+// entries to log.bin.idx, and the offsets of format and string records to the
+// definitions sidecar (log.bin.defs), which is LOG_DEFS_MAGIC followed by the
+// offset of every definition in the log, in log order. A query that starts in
+// the middle of the log loads the definitions of its run from there instead
+// of reading the log from the start.
+
+struct log_index_batch {
+	struct log_index_entry entries[LOG_INDEX_BATCH];
+	int count;
+	uint64_t definitions[LOG_INDEX_BATCH];
+	int definition_count;
+};
+
+// State of one pass over the binary log: the formats and strings defined so
+// far by id, the last timestamp rendered (its "YYYY-MM-DD::HH:MM:" prefix is
+// only rendered again when the minute changes), and the rendered text not
+// written out yet.
+
+struct log_reader {
+	const char ** formats;
+	uint32_t format_size;
+	const char ** strings;
+	uint32_t string_size;
+	int64_t minute;
+	char timestamp[LOG_TIMESTAMP_MAX + 1];
+	int first_line;
+	int line_done;
+	int out_fd;
+	size_t out_len;
+	char out[LOG_RENDER_BUFFER];
+};
+
+// Single-producer ring buffer between log_event() (Wayland dispatch thread)
+// and the writer thread. head and tail are free-running byte counters, the
+// producer only advances head and the writer only advances tail. fd is the
+// log claimed by log_claim(), kept open (and locked) until the process exits.
+
+struct log_ring {
+	char * buffer;
+	_Atomic uint64_t head;
+	_Atomic uint64_t tail;
+	_Atomic int running;
+	_Atomic int kicked;
+	uint64_t dropped;
+	_Atomic uint64_t lost;
+	int fd;
+	int claimed;
+	int index_fd;
+	int defs_fd;
+	uint64_t file_offset;
+	uint64_t index_from;
+	int64_t last_key;
+	uint32_t index_flags;
+	pthread_t writer;
+	sem_t wake;
+	pthread_mutex_t flush_lock;
+	pthread_cond_t flushed;
 };
 
 struct config_context {
@@ -149,12 +806,14 @@ struct zwlr_output_head_v1_listener head_listener;
 struct zwlr_output_mode_v1_listener mode_listener;
 struct zwlr_output_manager_v1_listener output_manager_listener;
 struct wl_registry_listener registry_listener;
+struct wl_callback_listener registry_sync_listener;
 struct zwlr_output_configuration_v1_listener configuration_object_listener;
 
 // methods
 
 void registry_global(void *data, struct wl_registry *reg, uint32_t name, const char *interface, uint32_t version);
 void registry_global_remove(void *data, struct wl_registry *reg, uint32_t name);
+void registry_synced(void *data, struct wl_callback *callback, uint32_t callback_data);
 
 void output_manager_head(void * data, struct zwlr_output_manager_v1 * output_manager, struct zwlr_output_head_v1 * output_head);
 void output_manager_done(void * data, struct zwlr_output_manager_v1 * output_manager, uint32_t serial);
@@ -181,15 +840,98 @@ void mode_preferred(void * data, struct zwlr_output_mode_v1 * mode);
 void mode_finished(void * data, struct zwlr_output_mode_v1 * mode);
 
 
+uint64_t monotonic_ns();
+struct change_set * record_state_changes(uint32_t serial);
+void handle_print_changes(uint32_t count);
+uint32_t config_request_kinds(struct config_request *req);
+void record_config_latency(struct config_request *req, int outcome);
+void handle_print_stats();
+void * arena_alloc(struct arena *arena, size_t size);
+char * arena_strdup(struct arena *arena, const char *str);
+void arena_release(struct arena *arena);
+void arena_pool_reset();
+void free_head(struct local_head *lh);
+void free_all_heads();
+int mode_table_add(struct mode_table *table, struct zwlr_output_mode_v1 *mode);
+int mode_table_row(struct mode_table *table, struct zwlr_output_mode_v1 *mode);
+void mode_table_remove(struct mode_table *table, uint32_t row);
+void mode_table_set_current(struct mode_table *table, uint32_t row);
+int mode_table_find(struct mode_table *table, int32_t width, int32_t height, int32_t refresh);
+void mode_table_release(struct mode_table *table);
+uint64_t hash_string(const char *str);
+int head_index_insert(struct head_index *index, const char *key, struct local_head *lh);
+void head_index_remove(struct head_index *index, const char *key, struct local_head *lh);
+struct local_head * head_index_find(struct head_index *index, const char *key);
+struct local_head * head_index_find_unique(struct head_index *index, const char *key, int *ambiguous);
+void head_index_clear(struct head_index *index);
+void head_update_identity(struct local_head *lh);
+struct local_head * find_head(const char *name, int *ambiguous);
+int next_token(struct tokenizer *tk, struct token *token);
+int keyword_lookup(const struct token *token);
+int parse_int(const char *s, size_t len, int32_t *value);
+int parse_fixed(const char *s, size_t len, wl_fixed_t *value);
+int parse_output_setting(struct output_settings *settings, int keyword, const struct token *value);
 int setup_log_file();
-const char* get_timestamp();
+int log_start(const char *log_file);
+void log_flush();
+void log_stop();
+int parse_timestamp_key(const char *timestamp, size_t len, int64_t *key, int64_t *span);
+size_t log_build_event(char *out, int64_t key, int level, const char *format, va_list args);
+int render_log_range(const char *log, uint64_t size, uint64_t lo, uint64_t hi, int64_t from, int64_t to, struct log_reader *reader);
+int print_log_records(int fd, const char *from, const char *to, int out_fd);
+int print_log_all(int fd, int out_fd);
+int export_log(const char *path);
 void log_event(const char *log_file, int level, const char *format, ...);
 void handle_print_outputs(struct wl_list *heads);
-void free_sop(struct set_output_parser *sop);
+ssize_t format_outputs(struct wl_list *heads, int format);
+int handle_print_outputs_format(struct wl_list *heads, int format);
+int watch_write(int fd, uint64_t *seen);
+int state_cache_save();
+int state_cache_load();
+void state_cache_unload();
+int trace_open(const char *path);
+void trace_close();
+void trace_add_listener(void *proxy, const void *listener, void *data);
+int trace_replay(struct wl_display *display, const char *path, uint32_t speed);
+void state_cache_reconcile();
+int command_ready(const char *line);
+int wait_for_state(struct wl_display * display);
+int profiles_load(const char *path, int required);
+void profiles_free();
+void profiles_match(struct wl_display *display, uint64_t done_ns);
+void handle_print_profiles();
+void handle_print_results(const char * tag);
+struct set_output_parser * change_node(const struct set_output_parser *change);
+void free_changes(struct wl_list *changes);
 struct command_result * fill_res (struct command_result * res, int cmd, int val, int err);
-void free_res(struct command_result *res);
-struct command_result * parse_command(char * cmd);
+struct command_result * parse_command(char * cmd, struct command_result * res);
 const char* get_error_message(uint32_t error_code);
+int queue_output_change(const struct set_output_parser *change);
+int merge_output_change(struct wl_list *changes, const struct set_output_parser *change);
+void transaction_discard();
+void transaction_forget_head(struct local_head *lh);
+void transaction_forget_mode(struct zwlr_output_mode_v1 *lm);
+void free_config_request(struct config_request *req);
+struct zwlr_output_configuration_v1 * build_configuration(struct config_request *req);
+struct config_request * apply_output_changes(struct wl_display * display, struct wl_list * changes, int mode, const char * tag);
+void config_request_finish(struct config_request * req, int outcome);
+const char * config_outcome_name(int outcome, int mode);
+void config_requests_forget_data(void * data);
+void config_requests_free();
+int configuration_pending();
+int configuration_blocking();
+int config_tag_pending(const char * tag);
+int config_tag_known(const char * tag);
+int config_retry_timeout();
+void config_retry_run(struct wl_display * display);
+int dispatch_display(struct wl_display * display);
+int handle_command(struct wl_display * display, char * input);
+int run_command(struct wl_display * display, struct command_result * cmd);
+int run_batch(struct wl_display * display, int fd);
+int daemon_listen(const char *path);
+int run_daemon(struct wl_display *display, const char *path);
+int daemon_request(const char *path, const char *command);
+void run_event_loop(struct wl_display * display);
 
 
 
@@ -0,0 +1,1080 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include <wayland-server.h>
+#include "protocols/wlr-output-management-server.h"
+#include "protocols/wlr-output-management-protocol.c"
+
+
+/**
+ * Stand-in compositor for the wlr-output-management protocol.
+ *
+ * It advertises zwlr_output_manager_v1 on its own Wayland socket and serves a
+ * scripted set of heads and modes, so the client can be exercised without a
+ * live sway session. The file is structured in the following way:
+ * 1. Structures and global state
+ * 2. Model helpers (heads, modes, script parsing)
+ * 3. Implementation of Mode and Head requests
+ * 4. Implementation of Configuration requests
+ * 5. Implementation of Output Manager requests
+ * 6. Scripted events (hotplug, mode changes)
+ * 7. Main ()
+ *
+ * Usage:
+ *   mock_compositor [-s socket] [-n heads] [-m modes] [-c script]
+ *                   [-r result[,result...]] [-t result[,result...]]
+ *                   [-l latency_ms] [-S] [-v]
+ *
+ * The socket name is printed as "WAYLAND_DISPLAY=<name>" on stdout once the
+ * compositor is ready to accept clients.
+ *
+ * -n synthesizes heads MOCK-1, MOCK-2, ... with -m modes each. A script (-c)
+ * describes heads and a timeline instead, one statement per line:
+ *   head <name> [description=..] [make=..] [model=..] [serial=..] [size=WxH]
+ *               [pos=X,Y] [transform=N] [scale=F] [enabled=0|1]
+ *               [adaptive_sync=0|1] [hidden]
+ *   mode <W>x<H>[@mHz] [preferred] [current]      (belongs to the last head)
+ *   at <ms> plug|unplug|replug <head>
+ *   at <ms> enable <head> 0|1
+ *   at <ms> mode <head> <W>x<H>[@mHz]
+ *   at <ms> quit
+ * Times count from the first client binding the output manager. "hidden"
+ * heads start unplugged. Values with spaces go in "double quotes", # starts a
+ * comment.
+ *
+ * -r and -t give the results of successive apply and test requests, cycled;
+ * "auto" validates the configuration. A configuration created with an old
+ * serial is always cancelled. -l delays every result, -S makes leaving a head
+ * out of a configuration a protocol error, -v logs to stderr.
+ */
+
+#define MOCK_MANAGER_VERSION               4
+#define MOCK_MAX_RESULTS                  32
+#define MOCK_MAX_TOKENS                   16
+
+#define RESULT_AUTO                        0
+#define RESULT_SUCCEEDED                   1
+#define RESULT_FAILED                      2
+#define RESULT_CANCELLED                   3
+
+struct mock_mode {
+	int32_t width;
+	int32_t height;
+	int32_t refresh;
+	int32_t preferred;
+};
+
+struct mock_head {
+	struct wl_list link;
+	char * name;
+	char * description;
+	char * make;
+	char * model;
+	char * serial_number;
+	int32_t physical_width;
+	int32_t physical_height;
+	int32_t enabled;
+	int32_t current_mode;
+	int32_t pos_x;
+	int32_t pos_y;
+	int32_t transform;
+	wl_fixed_t scale;
+	uint32_t adaptive_sync;
+	struct mock_mode * modes;
+	int32_t num_modes;
+	int32_t cap_modes;
+	int32_t connected;
+	struct wl_list bindings;
+};
+
+// one zwlr_output_manager_v1 resource bound by a client
+struct manager_binding {
+	struct wl_list link;
+	struct wl_resource * resource;
+};
+
+// one zwlr_output_head_v1 resource (and its mode resources) sent to a manager
+struct head_binding {
+	struct wl_list link;
+	struct mock_head * head;
+	struct manager_binding * manager;
+	struct wl_resource * resource;
+	struct wl_resource ** modes;
+	int32_t num_modes;
+};
+
+struct mock_config_head {
+	struct wl_list link;
+	struct wl_resource * resource;
+	struct mock_head * head;
+	struct head_binding * binding;
+	int32_t enabled;
+	int32_t mode;
+	int32_t has_custom_mode;
+	int32_t custom_width;
+	int32_t custom_height;
+	int32_t custom_refresh;
+	int32_t has_position;
+	int32_t pos_x;
+	int32_t pos_y;
+	int32_t has_transform;
+	int32_t transform;
+	int32_t has_scale;
+	wl_fixed_t scale;
+	int32_t has_adaptive_sync;
+	uint32_t adaptive_sync;
+};
+
+struct mock_config {
+	struct wl_resource * resource;
+	uint32_t serial;
+	int32_t used;
+	int32_t is_test;
+	struct wl_list heads;
+	struct wl_event_source * timer;
+};
+
+struct script_event {
+	struct wl_list link;
+	uint32_t at_ms;
+	char action[16];
+	char target[64];
+	char arg[64];
+	struct wl_event_source * timer;
+};
+
+
+// global state
+
+static struct wl_display * display;
+static struct wl_list heads;
+static struct wl_list managers;
+static struct wl_list script_events;
+static uint32_t serial = 1;
+static int verbose = 0;
+static int strict = 0;
+static uint32_t latency_ms = 0;
+static int apply_results[MOCK_MAX_RESULTS];
+static int num_apply_results = 0;
+static int apply_count = 0;
+static int test_results[MOCK_MAX_RESULTS];
+static int num_test_results = 0;
+static int test_count = 0;
+static int script_armed = 0;
+
+static const struct zwlr_output_manager_v1_interface manager_impl;
+static const struct zwlr_output_head_v1_interface head_impl;
+static const struct zwlr_output_mode_v1_interface mode_impl;
+static const struct zwlr_output_configuration_v1_interface config_impl;
+static const struct zwlr_output_configuration_head_v1_interface config_head_impl;
+static void arm_script(void);
+
+static void mock_log(const char * format, ...) {
+	if (!verbose) return;
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "[mock] ");
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+
+// model helpers
+
+static struct mock_head * head_create(const char * name) {
+	struct mock_head * head = calloc(1, sizeof(struct mock_head));
+	head->name = strdup(name);
+	head->description = strdup(name);
+	head->make = strdup("Mock");
+	head->model = strdup("Virtual Display");
+	head->serial_number = strdup(name);
+	head->physical_width = 600;
+	head->physical_height = 340;
+	head->enabled = 1;
+	head->current_mode = -1;
+	head->scale = wl_fixed_from_int(1);
+	head->connected = 1;
+	wl_list_init(&head->bindings);
+	wl_list_insert(heads.prev, &head->link);
+	return head;
+}
+
+static void head_add_mode(struct mock_head * head, int32_t width, int32_t height, int32_t refresh, int32_t preferred) {
+	if (head->num_modes == head->cap_modes) {
+		head->cap_modes = head->cap_modes ? head->cap_modes * 2 : 8;
+		head->modes = realloc(head->modes, head->cap_modes * sizeof(struct mock_mode));
+	}
+	struct mock_mode * mode = &head->modes[head->num_modes++];
+	mode->width = width;
+	mode->height = height;
+	mode->refresh = refresh;
+	mode->preferred = preferred;
+}
+
+static struct mock_head * head_find(const char * name) {
+	struct mock_head * head;
+	wl_list_for_each(head, &heads, link) {
+		if (strcmp(head->name, name) == 0) {
+			return head;
+		}
+	}
+	return NULL;
+}
+
+static void replace_string(char ** field, const char * value) {
+	free(*field);
+	*field = strdup(value);
+}
+
+static void synthesize_heads(int num_heads, int num_modes) {
+	static const int32_t sizes[][2] = {
+		{3840, 2160}, {2560, 1440}, {1920, 1200}, {1920, 1080}, {1680, 1050},
+		{1600, 900}, {1440, 900}, {1366, 768}, {1280, 1024}, {1280, 720},
+		{1024, 768}, {800, 600}, {720, 480}, {640, 480},
+	};
+	static const int32_t refreshes[] = {
+		60000, 59940, 50000, 75000, 120000, 144000, 165000, 30000,
+	};
+	const int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	const int num_refreshes = sizeof(refreshes) / sizeof(refreshes[0]);
+
+	for (int i = 0; i < num_heads; i++) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "MOCK-%d", i + 1);
+		struct mock_head * head = head_create(buf);
+		snprintf(buf, sizeof(buf), "Synthetic-%d", i + 1);
+		replace_string(&head->model, buf);
+		snprintf(buf, sizeof(buf), "SN%08d", i + 1);
+		replace_string(&head->serial_number, buf);
+		head->pos_x = i * 1920;
+
+		for (int m = 0; m < num_modes; m++) {
+			int size = m / num_refreshes;
+			int32_t refresh = refreshes[m % num_refreshes];
+			int32_t width = sizes[size % num_sizes][0];
+			int32_t height = sizes[size % num_sizes][1];
+			// past the end of the table keep modes unique by shaving the height
+			height -= size / num_sizes;
+			head_add_mode(head, width, height, refresh, m == 0);
+		}
+		head->current_mode = num_modes > 0 ? 0 : -1;
+	}
+}
+
+static int parse_mode_spec(const char * spec, int32_t * width, int32_t * height, int32_t * refresh) {
+	*refresh = 60000;
+	if (sscanf(spec, "%dx%d@%d", width, height, refresh) >= 2) {
+		return 1;
+	}
+	return sscanf(spec, "%d,%d@%d", width, height, refresh) >= 2;
+}
+
+static int parse_result(const char * value) {
+	if (strcmp(value, "succeeded") == 0) return RESULT_SUCCEEDED;
+	if (strcmp(value, "failed") == 0) return RESULT_FAILED;
+	if (strcmp(value, "cancelled") == 0) return RESULT_CANCELLED;
+	if (strcmp(value, "auto") == 0) return RESULT_AUTO;
+	return -1;
+}
+
+static int parse_result_list(char * value, int * results) {
+	int count = 0;
+	for (char * tok = strtok(value, ","); tok && count < MOCK_MAX_RESULTS; tok = strtok(NULL, ",")) {
+		int r = parse_result(tok);
+		if (r < 0) {
+			fprintf(stderr, "Unknown result '%s'\n", tok);
+			return -1;
+		}
+		results[count++] = r;
+	}
+	return count;
+}
+
+// splits a script line into whitespace separated tokens, "double quotes" group words
+static int tokenize(char * line, char ** tokens) {
+	int count = 0;
+	char * p = line;
+	while (*p && count < MOCK_MAX_TOKENS) {
+		while (isspace((unsigned char)*p)) p++;
+		if (!*p || *p == '#') break;
+		if (*p == '"') {
+			tokens[count++] = ++p;
+			while (*p && *p != '"') p++;
+		} else {
+			tokens[count++] = p;
+			while (*p && !isspace((unsigned char)*p)) p++;
+		}
+		if (*p) *p++ = '\0';
+	}
+	return count;
+}
+
+static int load_script(const char * path) {
+	FILE * file = fopen(path, "r");
+	if (!file) {
+		perror("Error opening script");
+		return 0;
+	}
+
+	char line[512];
+	int line_no = 0;
+	struct mock_head * head = NULL;
+
+	while (fgets(line, sizeof(line), file)) {
+		char * tokens[MOCK_MAX_TOKENS];
+		line_no++;
+		int count = tokenize(line, tokens);
+		if (count == 0) continue;
+
+		if (strcmp(tokens[0], "head") == 0 && count >= 2) {
+			head = head_create(tokens[1]);
+			for (int i = 2; i < count; i++) {
+				char * value = strchr(tokens[i], '=');
+				if (strcmp(tokens[i], "hidden") == 0) {
+					head->connected = 0;
+					continue;
+				}
+				if (!value) goto bad_line;
+				*value++ = '\0';
+				if (strcmp(tokens[i], "description") == 0) replace_string(&head->description, value);
+				else if (strcmp(tokens[i], "make") == 0) replace_string(&head->make, value);
+				else if (strcmp(tokens[i], "model") == 0) replace_string(&head->model, value);
+				else if (strcmp(tokens[i], "serial") == 0) replace_string(&head->serial_number, value);
+				else if (strcmp(tokens[i], "size") == 0) sscanf(value, "%dx%d", &head->physical_width, &head->physical_height);
+				else if (strcmp(tokens[i], "pos") == 0) sscanf(value, "%d,%d", &head->pos_x, &head->pos_y);
+				else if (strcmp(tokens[i], "transform") == 0) head->transform = atoi(value);
+				else if (strcmp(tokens[i], "scale") == 0) head->scale = wl_fixed_from_double(atof(value));
+				else if (strcmp(tokens[i], "enabled") == 0) head->enabled = atoi(value);
+				else if (strcmp(tokens[i], "adaptive_sync") == 0) head->adaptive_sync = atoi(value);
+				else goto bad_line;
+			}
+		}
+
+		else if (strcmp(tokens[0], "mode") == 0 && count >= 2 && head) {
+			int32_t width, height, refresh;
+			if (!parse_mode_spec(tokens[1], &width, &height, &refresh)) goto bad_line;
+			int preferred = 0, current = 0;
+			for (int i = 2; i < count; i++) {
+				if (strcmp(tokens[i], "preferred") == 0) preferred = 1;
+				else if (strcmp(tokens[i], "current") == 0) current = 1;
+				else goto bad_line;
+			}
+			head_add_mode(head, width, height, refresh, preferred);
+			if (current) head->current_mode = head->num_modes - 1;
+		}
+
+		else if (strcmp(tokens[0], "at") == 0 && count >= 3) {
+			struct script_event * ev = calloc(1, sizeof(struct script_event));
+			ev->at_ms = strtoul(tokens[1], NULL, 10);
+			snprintf(ev->action, sizeof(ev->action), "%s", tokens[2]);
+			if (count >= 4) snprintf(ev->target, sizeof(ev->target), "%s", tokens[3]);
+			if (count >= 5) snprintf(ev->arg, sizeof(ev->arg), "%s", tokens[4]);
+			wl_list_insert(script_events.prev, &ev->link);
+		}
+
+		else {
+			goto bad_line;
+		}
+		continue;
+
+bad_line:
+		fprintf(stderr, "%s:%d: cannot parse script line\n", path, line_no);
+		fclose(file);
+		return 0;
+	}
+
+	fclose(file);
+	return 1;
+}
+
+
+// requests - mode and head
+
+static void resource_release(struct wl_client * client, struct wl_resource * resource) {
+	wl_resource_destroy(resource);
+}
+
+static const struct zwlr_output_mode_v1_interface mode_impl = {
+	.release = resource_release,
+};
+
+static const struct zwlr_output_head_v1_interface head_impl = {
+	.release = resource_release,
+};
+
+static void mode_resource_destroy(struct wl_resource * resource) {
+	struct wl_resource ** slot = wl_resource_get_user_data(resource);
+	if (slot) {
+		*slot = NULL;
+	}
+}
+
+static void head_binding_detach(struct head_binding * binding) {
+	for (int i = 0; i < binding->num_modes; i++) {
+		if (binding->modes[i]) {
+			wl_resource_set_user_data(binding->modes[i], NULL);
+		}
+	}
+	if (binding->resource) {
+		wl_resource_set_user_data(binding->resource, NULL);
+	}
+	wl_list_remove(&binding->link);
+	free(binding->modes);
+	free(binding);
+}
+
+static void head_resource_destroy(struct wl_resource * resource) {
+	struct head_binding * binding = wl_resource_get_user_data(resource);
+	if (binding) {
+		binding->resource = NULL;
+		head_binding_detach(binding);
+	}
+}
+
+static void send_head_state(struct head_binding * binding) {
+	struct mock_head * head = binding->head;
+	struct wl_resource * res = binding->resource;
+	if (head->enabled && head->current_mode >= 0 && binding->modes[head->current_mode]) {
+		zwlr_output_head_v1_send_current_mode(res, binding->modes[head->current_mode]);
+	}
+	if (head->enabled) {
+		zwlr_output_head_v1_send_position(res, head->pos_x, head->pos_y);
+		zwlr_output_head_v1_send_transform(res, head->transform);
+		zwlr_output_head_v1_send_scale(res, head->scale);
+	}
+	if (wl_resource_get_version(res) >= ZWLR_OUTPUT_HEAD_V1_ADAPTIVE_SYNC_SINCE_VERSION) {
+		zwlr_output_head_v1_send_adaptive_sync(res, head->adaptive_sync);
+	}
+}
+
+static void send_head(struct manager_binding * manager, struct mock_head * head) {
+	struct wl_client * client = wl_resource_get_client(manager->resource);
+	uint32_t version = wl_resource_get_version(manager->resource);
+
+	struct wl_resource * res = wl_resource_create(client, &zwlr_output_head_v1_interface, version, 0);
+	if (!res) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	struct head_binding * binding = calloc(1, sizeof(struct head_binding));
+	binding->head = head;
+	binding->manager = manager;
+	binding->resource = res;
+	binding->num_modes = head->num_modes;
+	binding->modes = calloc(head->num_modes ? head->num_modes : 1, sizeof(struct wl_resource *));
+	wl_list_insert(&head->bindings, &binding->link);
+	wl_resource_set_implementation(res, &head_impl, binding, head_resource_destroy);
+
+	zwlr_output_manager_v1_send_head(manager->resource, res);
+	zwlr_output_head_v1_send_name(res, head->name);
+	zwlr_output_head_v1_send_description(res, head->description);
+	if (head->physical_width > 0 && head->physical_height > 0) {
+		zwlr_output_head_v1_send_physical_size(res, head->physical_width, head->physical_height);
+	}
+
+	uint32_t mode_version = version < 3 ? version : 3;
+	for (int i = 0; i < head->num_modes; i++) {
+		struct wl_resource * mode_res = wl_resource_create(client, &zwlr_output_mode_v1_interface, mode_version, 0);
+		if (!mode_res) {
+			wl_client_post_no_memory(client);
+			return;
+		}
+		binding->modes[i] = mode_res;
+		wl_resource_set_implementation(mode_res, &mode_impl, &binding->modes[i], mode_resource_destroy);
+		zwlr_output_head_v1_send_mode(res, mode_res);
+		zwlr_output_mode_v1_send_size(mode_res, head->modes[i].width, head->modes[i].height);
+		if (head->modes[i].refresh > 0) {
+			zwlr_output_mode_v1_send_refresh(mode_res, head->modes[i].refresh);
+		}
+		if (head->modes[i].preferred) {
+			zwlr_output_mode_v1_send_preferred(mode_res);
+		}
+	}
+
+	zwlr_output_head_v1_send_enabled(res, head->enabled);
+	if (version >= ZWLR_OUTPUT_HEAD_V1_MAKE_SINCE_VERSION) {
+		zwlr_output_head_v1_send_make(res, head->make);
+		zwlr_output_head_v1_send_model(res, head->model);
+		zwlr_output_head_v1_send_serial_number(res, head->serial_number);
+	}
+	send_head_state(binding);
+}
+
+static void send_head_finished(struct head_binding * binding) {
+	for (int i = 0; i < binding->num_modes; i++) {
+		if (binding->modes[i]) {
+			zwlr_output_mode_v1_send_finished(binding->modes[i]);
+		}
+	}
+	if (binding->resource) {
+		zwlr_output_head_v1_send_finished(binding->resource);
+	}
+	head_binding_detach(binding);
+}
+
+static void broadcast_done(void) {
+	serial++;
+	struct manager_binding * manager;
+	wl_list_for_each(manager, &managers, link) {
+		zwlr_output_manager_v1_send_done(manager->resource, serial);
+	}
+	mock_log("done, serial %u", serial);
+}
+
+static void broadcast_head_state(struct mock_head * head) {
+	struct head_binding * binding;
+	wl_list_for_each(binding, &head->bindings, link) {
+		if (binding->resource) {
+			zwlr_output_head_v1_send_enabled(binding->resource, head->enabled);
+			send_head_state(binding);
+		}
+	}
+}
+
+
+// requests - configuration
+
+static void config_head_resource_destroy(struct wl_resource * resource) {
+	struct mock_config_head * ch = wl_resource_get_user_data(resource);
+	if (ch) {
+		ch->resource = NULL;
+	}
+}
+
+static struct mock_config_head * config_head_from_resource(struct wl_resource * resource) {
+	return wl_resource_get_user_data(resource);
+}
+
+static void config_head_set_mode(struct wl_client * client, struct wl_resource * resource, struct wl_resource * mode) {
+	struct mock_config_head * ch = config_head_from_resource(resource);
+	struct wl_resource ** slot = mode ? wl_resource_get_user_data(mode) : NULL;
+	if (!ch || !ch->binding) return;
+	ch->has_custom_mode = 0;
+	ch->mode = -2;
+	if (slot && slot >= ch->binding->modes && slot < ch->binding->modes + ch->binding->num_modes) {
+		ch->mode = slot - ch->binding->modes;
+	}
+}
+
+static void config_head_set_custom_mode(struct wl_client * client, struct wl_resource * resource, int32_t width, int32_t height, int32_t refresh) {
+	struct mock_config_head * ch = config_head_from_resource(resource);
+	if (!ch) return;
+	ch->mode = -1;
+	ch->has_custom_mode = 1;
+	ch->custom_width = width;
+	ch->custom_height = height;
+	ch->custom_refresh = refresh;
+}
+
+static void config_head_set_position(struct wl_client * client, struct wl_resource * resource, int32_t x, int32_t y) {
+	struct mock_config_head * ch = config_head_from_resource(resource);
+	if (!ch) return;
+	ch->has_position = 1;
+	ch->pos_x = x;
+	ch->pos_y = y;
+}
+
+static void config_head_set_transform(struct wl_client * client, struct wl_resource * resource, int32_t transform) {
+	struct mock_config_head * ch = config_head_from_resource(resource);
+	if (!ch) return;
+	ch->has_transform = 1;
+	ch->transform = transform;
+}
+
+static void config_head_set_scale(struct wl_client * client, struct wl_resource * resource, wl_fixed_t scale) {
+	struct mock_config_head * ch = config_head_from_resource(resource);
+	if (!ch) return;
+	ch->has_scale = 1;
+	ch->scale = scale;
+}
+
+static void config_head_set_adaptive_sync(struct wl_client * client, struct wl_resource * resource, uint32_t state) {
+	struct mock_config_head * ch = config_head_from_resource(resource);
+	if (!ch) return;
+	ch->has_adaptive_sync = 1;
+	ch->adaptive_sync = state;
+}
+
+static const struct zwlr_output_configuration_head_v1_interface config_head_impl = {
+	.set_mode = config_head_set_mode,
+	.set_custom_mode = config_head_set_custom_mode,
+	.set_position = config_head_set_position,
+	.set_transform = config_head_set_transform,
+	.set_scale = config_head_set_scale,
+	.set_adaptive_sync = config_head_set_adaptive_sync,
+};
+
+static struct mock_config_head * config_add_head(struct mock_config * config, struct wl_resource * head_res, int32_t enabled) {
+	struct head_binding * binding = head_res ? wl_resource_get_user_data(head_res) : NULL;
+	struct mock_config_head * ch;
+	if (binding) {
+		wl_list_for_each(ch, &config->heads, link) {
+			if (ch->head == binding->head) {
+				wl_resource_post_error(config->resource, ZWLR_OUTPUT_CONFIGURATION_V1_ERROR_ALREADY_CONFIGURED_HEAD,
+					"head %s has been configured twice", binding->head->name);
+				return NULL;
+			}
+		}
+	}
+	ch = calloc(1, sizeof(struct mock_config_head));
+	ch->binding = binding;
+	ch->head = binding ? binding->head : NULL;
+	ch->enabled = enabled;
+	ch->mode = -1;
+	wl_list_insert(config->heads.prev, &ch->link);
+	return ch;
+}
+
+static void config_enable_head(struct wl_client * client, struct wl_resource * resource, uint32_t id, struct wl_resource * head) {
+	struct mock_config * config = wl_resource_get_user_data(resource);
+	struct wl_resource * res = wl_resource_create(client, &zwlr_output_configuration_head_v1_interface,
+		wl_resource_get_version(resource), id);
+	if (!res) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	struct mock_config_head * ch = config_add_head(config, head, 1);
+	if (ch) {
+		ch->resource = res;
+	}
+	wl_resource_set_implementation(res, &config_head_impl, ch, config_head_resource_destroy);
+}
+
+static void config_disable_head(struct wl_client * client, struct wl_resource * resource, struct wl_resource * head) {
+	struct mock_config * config = wl_resource_get_user_data(resource);
+	config_add_head(config, head, 0);
+}
+
+static int config_validate(struct mock_config * config) {
+	struct mock_config_head * ch;
+	wl_list_for_each(ch, &config->heads, link) {
+		if (!ch->head || !ch->head->connected || !ch->enabled) continue;
+		if (ch->mode == -2) return 0;
+		if (ch->has_custom_mode && (ch->custom_width <= 0 || ch->custom_height <= 0 || ch->custom_refresh < 0)) return 0;
+		if (ch->has_scale && ch->scale <= 0) return 0;
+		if (ch->has_transform && (ch->transform < 0 || ch->transform > 7)) return 0;
+		if (ch->has_adaptive_sync && ch->adaptive_sync > 1) return 0;
+	}
+	return 1;
+}
+
+static void config_commit(struct mock_config * config) {
+	struct mock_config_head * ch;
+	wl_list_for_each(ch, &config->heads, link) {
+		struct mock_head * head = ch->head;
+		if (!head || !head->connected) continue;
+		head->enabled = ch->enabled;
+		if (ch->enabled) {
+			if (ch->mode >= 0) {
+				head->current_mode = ch->mode;
+			} else if (ch->has_custom_mode) {
+				int found = -1;
+				for (int i = 0; i < head->num_modes; i++) {
+					if (head->modes[i].width == ch->custom_width && head->modes[i].height == ch->custom_height
+						&& head->modes[i].refresh == ch->custom_refresh) {
+						found = i;
+					}
+				}
+				if (found >= 0) head->current_mode = found;
+			}
+			if (ch->has_position) {
+				head->pos_x = ch->pos_x;
+				head->pos_y = ch->pos_y;
+			}
+			if (ch->has_transform) head->transform = ch->transform;
+			if (ch->has_scale) head->scale = ch->scale;
+			if (ch->has_adaptive_sync) head->adaptive_sync = ch->adaptive_sync;
+		}
+		broadcast_head_state(head);
+	}
+	broadcast_done();
+}
+
+static int config_finish(void * data) {
+	struct mock_config * config = data;
+	int outcome;
+	if (config->is_test) {
+		outcome = num_test_results ? test_results[test_count++ % num_test_results] : RESULT_AUTO;
+	} else {
+		outcome = num_apply_results ? apply_results[apply_count++ % num_apply_results] : RESULT_AUTO;
+	}
+
+	if (config->serial != serial) {
+		outcome = RESULT_CANCELLED;
+	} else if (outcome == RESULT_AUTO) {
+		outcome = config_validate(config) ? RESULT_SUCCEEDED : RESULT_FAILED;
+	}
+
+	if (config->timer) {
+		wl_event_source_remove(config->timer);
+		config->timer = NULL;
+	}
+	if (!config->resource) {
+		return 0;
+	}
+
+	mock_log("%s %s", config->is_test ? "test" : "apply",
+		outcome == RESULT_SUCCEEDED ? "succeeded" : outcome == RESULT_FAILED ? "failed" : "cancelled");
+
+	if (outcome == RESULT_SUCCEEDED) {
+		zwlr_output_configuration_v1_send_succeeded(config->resource);
+		if (!config->is_test) {
+			config_commit(config);
+		}
+	} else if (outcome == RESULT_FAILED) {
+		zwlr_output_configuration_v1_send_failed(config->resource);
+	} else {
+		zwlr_output_configuration_v1_send_cancelled(config->resource);
+	}
+	return 0;
+}
+
+static void config_submit(struct wl_resource * resource, int is_test) {
+	struct mock_config * config = wl_resource_get_user_data(resource);
+	if (config->used) {
+		wl_resource_post_error(resource, ZWLR_OUTPUT_CONFIGURATION_V1_ERROR_ALREADY_USED,
+			"configuration has already been applied or tested");
+		return;
+	}
+	config->used = 1;
+	config->is_test = is_test;
+
+	if (strict && config->serial == serial) {
+		struct mock_head * head;
+		wl_list_for_each(head, &heads, link) {
+			if (!head->connected) continue;
+			int found = 0;
+			struct mock_config_head * ch;
+			wl_list_for_each(ch, &config->heads, link) {
+				if (ch->head == head) found = 1;
+			}
+			if (!found) {
+				wl_resource_post_error(resource, ZWLR_OUTPUT_CONFIGURATION_V1_ERROR_UNCONFIGURED_HEAD,
+					"head %s has not been configured", head->name);
+				return;
+			}
+		}
+	}
+
+	if (latency_ms == 0) {
+		config_finish(config);
+		return;
+	}
+	struct wl_event_loop * loop = wl_display_get_event_loop(display);
+	config->timer = wl_event_loop_add_timer(loop, config_finish, config);
+	wl_event_source_timer_update(config->timer, latency_ms);
+}
+
+static void config_apply(struct wl_client * client, struct wl_resource * resource) {
+	config_submit(resource, 0);
+}
+
+static void config_test(struct wl_client * client, struct wl_resource * resource) {
+	config_submit(resource, 1);
+}
+
+static void config_destroy(struct wl_client * client, struct wl_resource * resource) {
+	wl_resource_destroy(resource);
+}
+
+static const struct zwlr_output_configuration_v1_interface config_impl = {
+	.enable_head = config_enable_head,
+	.disable_head = config_disable_head,
+	.apply = config_apply,
+	.test = config_test,
+	.destroy = config_destroy,
+};
+
+static void config_resource_destroy(struct wl_resource * resource) {
+	struct mock_config * config = wl_resource_get_user_data(resource);
+	struct mock_config_head * ch, * tmp;
+	wl_list_for_each_safe(ch, tmp, &config->heads, link) {
+		if (ch->resource) {
+			wl_resource_set_user_data(ch->resource, NULL);
+		}
+		wl_list_remove(&ch->link);
+		free(ch);
+	}
+	if (config->timer) {
+		wl_event_source_remove(config->timer);
+	}
+	free(config);
+}
+
+
+// requests - output manager
+
+static void manager_create_configuration(struct wl_client * client, struct wl_resource * resource, uint32_t id, uint32_t config_serial) {
+	struct wl_resource * res = wl_resource_create(client, &zwlr_output_configuration_v1_interface,
+		wl_resource_get_version(resource), id);
+	if (!res) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	struct mock_config * config = calloc(1, sizeof(struct mock_config));
+	config->resource = res;
+	config->serial = config_serial;
+	wl_list_init(&config->heads);
+	wl_resource_set_implementation(res, &config_impl, config, config_resource_destroy);
+}
+
+static void manager_stop(struct wl_client * client, struct wl_resource * resource) {
+	zwlr_output_manager_v1_send_finished(resource);
+	wl_resource_destroy(resource);
+}
+
+static const struct zwlr_output_manager_v1_interface manager_impl = {
+	.create_configuration = manager_create_configuration,
+	.stop = manager_stop,
+};
+
+static void manager_resource_destroy(struct wl_resource * resource) {
+	struct manager_binding * manager = wl_resource_get_user_data(resource);
+	struct mock_head * head;
+	wl_list_for_each(head, &heads, link) {
+		struct head_binding * binding, * tmp;
+		wl_list_for_each_safe(binding, tmp, &head->bindings, link) {
+			if (binding->manager == manager) {
+				head_binding_detach(binding);
+			}
+		}
+	}
+	wl_list_remove(&manager->link);
+	free(manager);
+}
+
+// The initial burst can be far larger than the socket buffer (thousands of
+// heads with a hundred modes each) and libwayland disconnects clients whose
+// buffer overflows. Heads are therefore sent while the socket has room and the
+// compositor waits for the client to drain it in between, so the whole burst
+// still precedes any reply to the client's next request (e.g. a roundtrip).
+static void manager_send_heads(struct manager_binding * manager) {
+	struct wl_client * client = wl_resource_get_client(manager->resource);
+	int client_fd = wl_client_get_fd(client);
+	int sndbuf = 0;
+	socklen_t optlen = sizeof(sndbuf);
+	getsockopt(client_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen);
+
+	struct mock_head * head;
+	wl_list_for_each(head, &heads, link) {
+		if (!head->connected) continue;
+		int queued = 0;
+		ioctl(client_fd, SIOCOUTQ, &queued);
+		if (queued > sndbuf / 4) {
+			struct pollfd pfd = { .fd = client_fd, .events = POLLOUT };
+			if (poll(&pfd, 1, 5000) <= 0) {
+				fprintf(stderr, "client is not reading, giving up on pacing\n");
+			}
+		}
+		send_head(manager, head);
+		wl_client_flush(client);
+	}
+	zwlr_output_manager_v1_send_done(manager->resource, serial);
+}
+
+static void manager_bind(struct wl_client * client, void * data, uint32_t version, uint32_t id) {
+	struct wl_resource * res = wl_resource_create(client, &zwlr_output_manager_v1_interface, version, id);
+	if (!res) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	struct manager_binding * manager = calloc(1, sizeof(struct manager_binding));
+	manager->resource = res;
+	wl_list_insert(&managers, &manager->link);
+	wl_resource_set_implementation(res, &manager_impl, manager, manager_resource_destroy);
+	mock_log("client bound output manager v%u", version);
+
+	manager_send_heads(manager);
+	arm_script();
+}
+
+
+// scripted events
+
+static void head_unplug(struct mock_head * head) {
+	struct head_binding * binding, * tmp;
+	wl_list_for_each_safe(binding, tmp, &head->bindings, link) {
+		send_head_finished(binding);
+	}
+	head->connected = 0;
+}
+
+static void head_plug(struct mock_head * head) {
+	head->connected = 1;
+	struct manager_binding * manager;
+	wl_list_for_each(manager, &managers, link) {
+		send_head(manager, head);
+	}
+}
+
+static int script_event_fire(void * data) {
+	struct script_event * ev = data;
+	struct mock_head * head = ev->target[0] ? head_find(ev->target) : NULL;
+	mock_log("script: %s %s %s", ev->action, ev->target, ev->arg);
+
+	if (strcmp(ev->action, "quit") == 0) {
+		wl_display_terminate(display);
+		return 0;
+	}
+	if (!head) {
+		fprintf(stderr, "script: unknown head '%s'\n", ev->target);
+		return 0;
+	}
+
+	if (strcmp(ev->action, "unplug") == 0 && head->connected) {
+		head_unplug(head);
+	} else if (strcmp(ev->action, "plug") == 0 && !head->connected) {
+		head_plug(head);
+	} else if (strcmp(ev->action, "replug") == 0) {
+		if (head->connected) head_unplug(head);
+		head_plug(head);
+	} else if (strcmp(ev->action, "enable") == 0) {
+		head->enabled = atoi(ev->arg);
+		broadcast_head_state(head);
+	} else if (strcmp(ev->action, "mode") == 0) {
+		int32_t width, height, refresh;
+		if (!parse_mode_spec(ev->arg, &width, &height, &refresh)) {
+			fprintf(stderr, "script: bad mode '%s'\n", ev->arg);
+			return 0;
+		}
+		for (int i = 0; i < head->num_modes; i++) {
+			if (head->modes[i].width == width && head->modes[i].height == height && head->modes[i].refresh == refresh) {
+				head->current_mode = i;
+			}
+		}
+		broadcast_head_state(head);
+	} else {
+		fprintf(stderr, "script: unknown action '%s'\n", ev->action);
+		return 0;
+	}
+	broadcast_done();
+	return 0;
+}
+
+// the timeline starts with the first client, so it does not depend on how
+// long the client took to connect
+static void arm_script(void) {
+	if (script_armed) return;
+	script_armed = 1;
+	struct wl_event_loop * loop = wl_display_get_event_loop(display);
+	struct script_event * ev;
+	wl_list_for_each(ev, &script_events, link) {
+		ev->timer = wl_event_loop_add_timer(loop, script_event_fire, ev);
+		wl_event_source_timer_update(ev->timer, ev->at_ms ? ev->at_ms : 1);
+	}
+}
+
+static int handle_signal(int signal_number, void * data) {
+	wl_display_terminate(display);
+	return 0;
+}
+
+
+int main(int argc, char ** argv) {
+
+	const char * socket_name = NULL;
+	const char * script_path = NULL;
+	int num_heads = -1;
+	int num_modes = 8;
+	int opt;
+
+	wl_list_init(&heads);
+	wl_list_init(&managers);
+	wl_list_init(&script_events);
+
+	while ((opt = getopt(argc, argv, "s:n:m:c:r:t:l:Svh")) != -1) {
+		switch (opt) {
+			case 's': socket_name = optarg; break;
+			case 'n': num_heads = atoi(optarg); break;
+			case 'm': num_modes = atoi(optarg); break;
+			case 'c': script_path = optarg; break;
+			case 'r':
+				num_apply_results = parse_result_list(optarg, apply_results);
+				if (num_apply_results < 0) return 1;
+				break;
+			case 't':
+				num_test_results = parse_result_list(optarg, test_results);
+				if (num_test_results < 0) return 1;
+				break;
+			case 'l': latency_ms = strtoul(optarg, NULL, 10); break;
+			case 'S': strict = 1; break;
+			case 'v': verbose = 1; break;
+			default:
+				fprintf(stderr,
+					"Usage: %s [-s socket] [-n heads] [-m modes] [-c script]\n"
+					"          [-r result[,result...]] [-t result[,result...]] [-l latency_ms] [-S] [-v]\n"
+					"  results: succeeded, failed, cancelled, auto\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (script_path && !load_script(script_path)) {
+		return 1;
+	}
+	if (num_heads < 0 && !script_path) {
+		num_heads = 2;
+	}
+	if (num_heads > 0) {
+		synthesize_heads(num_heads, num_modes);
+	}
+
+	display = wl_display_create();
+	if (!display) {
+		fprintf(stderr, "Cannot create Wayland display\n");
+		return 1;
+	}
+	if (socket_name) {
+		if (wl_display_add_socket(display, socket_name) != 0) {
+			perror("Cannot add Wayland socket");
+			return 1;
+		}
+	} else {
+		socket_name = wl_display_add_socket_auto(display);
+		if (!socket_name) {
+			perror("Cannot add Wayland socket");
+			return 1;
+		}
+	}
+
+	wl_global_create(display, &zwlr_output_manager_v1_interface, MOCK_MANAGER_VERSION, NULL, manager_bind);
+
+	struct wl_event_loop * loop = wl_display_get_event_loop(display);
+	wl_event_loop_add_signal(loop, SIGINT, handle_signal, NULL);
+	wl_event_loop_add_signal(loop, SIGTERM, handle_signal, NULL);
+
+	printf("WAYLAND_DISPLAY=%s\n", socket_name);
+	fflush(stdout);
+
+	wl_display_run(display);
+
+	wl_display_destroy_clients(display);
+	wl_display_destroy(display);
+
+	struct mock_head * head, * tmp_head;
+	wl_list_for_each_safe(head, tmp_head, &heads, link) {
+		free(head->name);
+		free(head->description);
+		free(head->make);
+		free(head->model);
+		free(head->serial_number);
+		free(head->modes);
+		wl_list_remove(&head->link);
+		free(head);
+	}
+	struct script_event * ev, * tmp_ev;
+	wl_list_for_each_safe(ev, tmp_ev, &script_events, link) {
+		wl_list_remove(&ev->link);
+		free(ev);
+	}
+	return 0;
+}